@@ -25,8 +25,361 @@ NOTES
 
 	The file format follows the "standard" APER form, one entry per line.
 	The file must have the same type of contents as the specified list.
+	The list, the cleared list for reply and the new data are read at
+	the same time, each on a thread of its own, which helps most when
+	they're on a slow or network filesystem.  They're merged afterwards
+	in that order, so the result doesn't depend on which finished first.
+
+	Reply entries also in the cleared list, with a clearing date no
+	older than their own, are dropped when the reply list is written.
+	With --verbose a reply run reports on stderr how many entries were
+	cleared, how many were listed again after being cleared, and how
+	many cleared addresses were never listed at all.
+
+	Links are keyed by a canonical form of the URL, so that one page is
+	listed once however it was written: the http or https scheme, its
+	userinfo and default port, the fragment, a leading "www." and empty
+	or "." path segments are dropped, ".." segments resolved, the host
+	lowercased and needless percent escapes decoded (see
+	APERlinks::cleanup).  Entries can be looked up the same way:
+
+		aper query list [key ...]
+
+	writes the entry for each address or link, read from stdin if none
+	are given, and complains about those not listed.  Lists written
+	before links were canonicalized are fixed up with
+
+		aper canonicalize links [--write]
+
+	which reports how many entries there are, how many keys change and
+	how many entries collapse into others, and with --write rewrites the
+	list (resharding a sharded one).  Until then the list is
+	canonicalized whenever it's loaded, entries for the same page merged
+	as if added again, but diff, patch, federate, sync and --memory,
+	which read lists in order as they stream them, refuse it.
+
+	A links entry can also be a pattern covering many URLs:
+
+		*.example.com/login.php,20240101
+
+	A "*" host label matches one or more labels, so a host of just "*"
+	matches any host, as for a phishing kit's path wherever it's put.  A
+	"*" path segment matches one segment, or as the last segment
+	everything below.  Patterns take no query, and a "*" anywhere else
+	is an ordinary character.  Patterns are entries like any other,
+	merged and dated the same way.  query, and aper_query() in aper.h,
+	try the listed link first and then the patterns, all folded into one
+	trie, so a lookup costs the same however many patterns there are.
+	Snapshots and exports carry patterns as written.
+
+	Phishers rotate look-alikes of one address at a freemail provider,
+	help.desk+1@, helpdesk@, he1pdesk@, which exact lookups miss.
+
+		aper query reply --variants [address ...]
+
+	answers an address that isn't listed with every listed entry it's a
+	variant of, each followed by a tab and the address as given.  Two
+	addresses are variants when they're the same once a plus tag is cut
+	off the local part, its dots dropped at providers that ignore them
+	(gmail.com, googlemail.com), and characters drawn like others read
+	as those: "rn" as "m", "vv" as "w", 0 as o, 1 as l and Cyrillic and
+	Greek letters as the Latin ones they look like (see
+	APERvariants::fold).  The variants are an index over the loaded
+	list, built once per query run, so each lookup is a single hash
+	probe; aper_variants() in aper.h keeps one up to date as entries are
+	added.  Nothing about the list or its files changes.
+
+	Changes between two versions of a list can be shipped as a delta:
+
+		aper diff list old new [delta]
+		aper patch list [delta]
+
+	diff merges the two sorted list files and writes a delta to 'delta'
+	or stdout.  patch applies a delta, read from stdin if not given, to
+	the list in the current directory.  A delta starts with the comment
+	"# aper delta list" followed by one record per line in list order,
+	each prefixed by what happened to it:
+
+		+	added
+		-	removed
+		d	re-dated
+		t	type changed (possibly re-dated too)
+		c	cleared (reply only, found in the cleared list)
+
+	Added, re-dated and type changed records carry the new record,
+	removed and cleared records the old one.
+
+	Copies of a list kept elsewhere, a partner's say, are merged with
+
+		aper federate list file file ... [--min-sources K]
+
+	which reads the sorted list files (up to 64, compressed or not) side
+	by side in one pass, holding a record of each at a time, and writes
+	the merged entries to stdout.  An entry in several copies is dated
+	the latest and gets every type any of them gave it, as when adding
+	new data.  After the record, separated by a tab, is a hex bitmap of
+	the copies it came from, the first file being 1, the second 2, the
+	third 4 and so on; comments at the top name the file for each bit.
+	With --min-sources only entries found in at least K copies are
+	written.  The bitmaps come off with cut -f1, leaving new data for
+	the list:
+
+		aper federate reply ours theirs1 theirs2 --min-sources 2 |
+			cut -f1 | aper reply
+
+	Copies of a list on other hosts are kept up to date with
+
+		aper merkle list [--depth N]
+		aper sync list dir | --via command
+		aper sync list --serve
+
+	A list's entries, as written, are spread by a hash of their key over
+	the leaves of a binary tree of md5 digests: a leaf's digest covers
+	its entries, every other node's its two children.  The tree is as
+	deep as it takes for a leaf to hold about 16 entries, up to 20
+	levels (a million leaves).  merkle writes "# aper merkle list depth"
+	and then the tree, to N levels below the root if given, a node per
+	line: its number (the root is 1, node n's children 2n and 2n+1), how
+	many entries are under it and its digest.
+
+	sync makes the list in the current directory the same as the one in
+	'dir'.  The list here is given a tree as deep as the other copy's,
+	which a server names in its first line, the same as merkle's.  The
+	trees are compared from the root down a level at a time,
+	going on only below nodes that differ, and then the entries under
+	the leaves that differ are replaced with the other copy's, so a
+	handful of changes costs a few hundred digests however long the
+	list is.  With --via the other copy is the one served by 'command',
+	run by /bin/sh with a socket for its stdin and stdout, which should
+	end up running sync --serve where that copy is:
+
+		aper sync reply --via "ssh master 'cd /var/aper && aper sync reply --serve'"
+
+	sync writes the number of nodes compared, leaves fetched, entries
+	fetched and entries replaced, tab separated.  The list is rewritten
+	only if something differed.  The cleared list goes by its own tree,
+	so sync it before reply.
+
+	Entries can be selected by the date they were last seen:
+
+		aper prune list --older-than days [--write]
+		aper export list --since YYYYMMDD [--until YYYYMMDD]
+
+	prune writes the entries last seen more than 'days' ago to stdout and
+	with --write also drops them from the list.  export writes the entries
+	seen on or after --since and before --until.  Both write records only,
+	in list order.  A loaded list keeps its entries bucketed by the date
+	they were last seen, so both look only at the dates selected.
+
+	For analysis tools, the lists can be exported in columns instead:
+
+		aper export [list] --columnar file [--since YYYYMMDD] [--until YYYYMMDD]
+
+	writes the given list, or all three, to 'file' as arrays that can be
+	read in place (numpy.frombuffer and the like): a header of offsets, a
+	sorted dictionary of the domains and link hosts, then per list the
+	dictionary index of each entry's domain, the rest of its key, its date
+	as a YYYYMMDD integer, its reply types as bits (A is 1 up to E 16) and
+	whether it is cleared.  The layout is described with APERcolheader
+	below.  Cleared reply entries are included, dated when cleared and
+	flagged, those never listed with no types.
+
+	The keys are nearly all different, so laid out for reading in place
+	the file is only a little smaller than the text lists.  Built with
+	zstd, or else gzip, the whole file is compressed with it unless -z
+	says otherwise, which makes it a third of the size of the text or
+	less; decompress it (zstd -d, gunzip) and read that in place, or
+	write it with -z none to read it in place as it is.
+
+	A summary of the lists comes from
+
+		aper stats [list] [--top N] [--json]
+
+	which counts the entries of the list, or of all three, and for reply
+	how many are cleared and how many active entries have each type.
+	Active entries are also counted by age (a day, week, month, 6 months,
+	a year, older) and by month last seen, and the N (10) domains, or
+	link hosts, with the most entries are listed.  The output is
+	tab separated text, or JSON with --json.
+
+	Tools that add entries concurrently can queue them instead:
+
+		aper submit list [file]
+		aper ingest list
+
+	submit drops a copy of the new data into the list's spool directory
+	(the list file name plus ".spool").  ingest merges everything queued
+	there in one load and write of the list, in the order submitted, and
+	then removes the spooled files.  A spooled file with a bad entry is
+	renamed with a ".bad" suffix and left for inspection; the rest are
+	still ingested.
+
+	Normally the first bad entry stops everything and nothing is written.
+	With large submissions it can be better to keep the good entries:
+
+		aper list --reject rejfile [--max-errors ratio] [file]
+
+	This parses every line (in parallel for large inputs), merges the good
+	ones and writes each bad line to 'rejfile' ('-' for stderr) as
+
+		source:line<TAB>reason<TAB>line as given
 
-[b] Compile: c++ -s -o aper aper.cc
+	If the bad lines exceed 'ratio' of all entries, given as a fraction or
+	a percentage, the whole batch is refused and the list left alone.
+	Either option turns this on; ingest applies it to each spooled file.
+
+	Batches too big to hold in memory along with the list can be merged
+	in bounded memory:
+
+		aper list --memory size [file]
+
+	The new entries are read in batches of about 'size' bytes (K, M or G
+	suffixes, at least 16M), each sorted, combined by address and written
+	to a temporary file in the current directory.  These are merged with
+	each other and with the list file as it is rewritten, so neither the
+	list nor the new entries are ever loaded whole; only the cleared list
+	is, for reply.  The list must be a single sorted file, as aper writes
+	it, not sharded.  --reject and --verbose work as usual.
+
+	Every command that rewrites a list holds an exclusive lock on it (the
+	hidden file "." plus the list file name plus ".lock") from loading to
+	writing, so concurrent updates are applied one after the other rather
+	than the last writer winning.
+
+	A big list can be split into shards so that an update only rewrites
+	the shards it touched:
+
+		aper shard list [--shards N] [--by hash|domain]
+		aper unshard list [--write | file]
+
+	shard moves the list into the directory named by the list file plus
+	".shards", as N (default 16) sorted files named 0000, 0001, ... and a
+	"manifest" holding the layout and the list's leading comments.  An
+	entry's shard is picked by a hash of the whole entry, or with
+	--by domain of its registered domain (the last two labels, three
+	under co.uk and the like), which keeps a domain in one shard.  Shard
+	can be run again to change the layout.
+
+	Every command works on a sharded list as before, except patch.
+	Shards are loaded in parallel and written back one by one, each
+	through its own temporary file and rename.  unshard writes the list
+	in its single file form to 'file' or stdout, and with --write turns
+	it back into a single file list.
+
+	Whatever is built from the lists can be rebuilt as soon as they
+	change, rather than on a schedule:
+
+		aper watch conffile [--debounce ms]
+
+	'conffile' has a line per command to run, giving the list it's built
+	from and the command, run by /bin/sh in the current directory:
+
+		reply	./addresses2bindzone.pl > zone.new && mv zone.new zone
+		links	./sa-phish-gen
+
+	watch keeps each of those lists in memory and waits on the directory
+	(and any shard directories) for list files to be replaced or written.
+	Once things have been quiet for --debounce ms (default 250) each
+	changed list is reloaded, under its lock, and compared to the copy in
+	memory.  If anything is different, its commands are run in order with
+	APER_LIST set to the list, APER_DELTA to a delta file of the changes
+	(as written by diff) and APER_CHANGES to the number of them.  A
+	change to the cleared list counts as a change to reply.
+
+	Many processes on one host can share a single copy of the active
+	reply and links entries:
+
+		aper publish snapshot
+
+	writes them to the file 'snapshot' as ready made hash tables, best
+	kept in /dev/shm.  Readers map it with aper_snapshot_open() from
+	aper.h and look entries up in place, without parsing or locking.
+	Each publish renames a new file into place and then marks the old
+	one superseded, and readers switch over on their next lookup, so
+	they never see a half written snapshot or wait on a publish.  Run it
+	from watch to keep the snapshot current:
+
+		reply	aper publish /dev/shm/aper.snapshot
+		links	aper publish /dev/shm/aper.snapshot
+
+	The reply list can be served as a DNS blocklist straight from memory,
+	in place of the zone addresses2bindzone.pl builds for named:
+
+		aper dnsbl zone [--port N] [--listen address] [--debounce ms]
+
+	answers queries over UDP and TCP on 'address' (default 127.0.0.1)
+	port N (default 5300).  The names are those of the generated zone:
+
+		local.@.domain.zone				A 127.1.0.types, TXT lastseen:date
+		<md5 of local>.domain.md5.zone	the same
+
+	where 'types' adds 1, 2, 4, 8 and 16 for types A to E.  Cleared
+	entries aren't listed.  Unlisted names get NXDOMAIN with an SOA, so
+	resolvers cache the miss.  When the reply or cleared list is replaced
+	the list is reloaded, as watch does, and swapped in between queries.
+	Anything that can query a server on a port will do to try it:
+
+		dig -p 5300 @127.0.0.1 user.@.example.com.zone A
+
+	Postfix can look addresses up in the reply list directly, without
+	map files or postmap:
+
+		aper tabled [--listen address|path] [--port N] [--max-age days]
+			[--action text] [--debounce ms]
+
+	serves both the tcp_table and the policy delegation protocols on
+	'address' (default 127.0.0.1) port N (default 10029), or on the unix
+	socket 'path' if given one with a '/' in it.  A listed address, last
+	seen no more than --max-age days ago if given, gets 'text' (default
+	"REJECT Phishing reply address") as its action; a policy request is
+	listed if its recipient or sender is, and anything else gets DUNNO.
+	Cleared entries aren't listed.  The list is reloaded as dnsbl does.
+
+		check_recipient_access tcp:127.0.0.1:10029
+		check_policy_service inet:127.0.0.1:10029
+
+	Any client that can write a line to a socket can try it:
+
+		printf 'get user@example.com\n' | nc 127.0.0.1 10029
+
+	SpamAssassin rules can be made from the reply list directly:
+
+		aper spamassassin [--since YYYYMMDD] [--max-rule bytes] [--check] [file]
+
+	writes rules for the active entries, or those seen since the date, to
+	'file' or stdout, sorted by type as addresses2spamassassin.pl does:
+	Reply-To (A) and From (B) scored together as PHISH_REPLY, body (C)
+	and other (E) on their own.  Rather than a rule per address, each
+	rule's pattern matches as many addresses as fit in 'bytes' (8192 if
+	not given): they are grouped by domain, and each domain's local parts
+	are folded into a trie so that common prefixes are matched once.  An
+	address too long to fit in a rule by itself is left out, with an
+	error naming it.  --check compiles every pattern and makes sure it
+	matches each of its addresses before anything is written.
+
+[b] Compile: c++ -s -pthread -o aper aper.cc
+
+	Compressed lists are supported when built with either or both of
+
+		-DAPER_GZIP -lz
+		-DAPER_ZSTD -lzstd
+
+	Compressed input, lists as well as new data, is recognized by its magic
+	bytes and decoded on a separate thread while it is being parsed.  A
+	list is written back with the compression it was read with, unless
+	overridden with '-z gzip|zstd|none' before the list name.
+
+	Every list file is written to a temporary file beside it, synced to
+	disk and renamed into place, and the directory is synced after the
+	rename, so a crash leaves the old file or the new one.  A file that
+	would come out byte for byte the same as the one it replaces is left
+	alone, keeping its modification time, so nothing watching it sees a
+	change that isn't one.
+
+	The same source builds a library for other programs to load, query
+	and update lists in process, through the C interface in aper.h:
+
+		c++ -DAPER_LIBRARY -fPIC -shared -pthread -o libaper.so aper.cc
 
 [c] Warranty
 
@@ -58,7 +411,35 @@ Copyright (C) 2010 University of Minnesota.  All rights reserved.
 #include <cstdlib>
 #include <time.h>
 #include <cstdio>
+#include <cstring>
+#include <cerrno>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <regex.h>
+#include <pthread.h>
+
+#include "aper.h"
+
+#ifdef APER_GZIP
+#include <zlib.h>
+#endif
+
+#ifdef APER_ZSTD
+#include <zstd.h>
+#endif
 
 //=================================================================
 // TWEEKABLES
@@ -69,6 +450,10 @@ const std::string replyfile			= "phishing_reply_addresses";
 const std::string replytypes		= "ABCDE";
 const std::string replyclearedfile	= "phishing_cleared_addresses";
 const std::string linksfile			= "phishing_links";
+const std::string spoolsuffix		= ".spool";
+const std::string locksuffix		= ".lock";
+const std::string shardsuffix		= ".shards";
+const std::string manifestfile		= "manifest";
 //=================================================================
 
 const char tokcomment = '#';
@@ -80,6 +465,36 @@ const char tokdns = '.';
 const char *tmpdir = ".";	// dir for temp files
 const char *tmpprefix = ".aper";  // prefix for temp files (5 char max)
 
+const unsigned int maxthreads = 8;	// upper bound on worker threads
+const std::size_t iobufsize = 65536;	// size of file and codec buffers
+const std::size_t inputblock = 1048576;	// input handed over by reader threads in blocks this size
+const std::size_t outputblock = 1048576;	// output gathered into writes this size
+const std::size_t minparallel = 65536;	// smaller jobs aren't worth threading
+const std::size_t minsortmemory = 16777216;	// least --memory taken
+const std::size_t sortfanin = 64;	// most runs merged at once
+const std::size_t maxfederate = 64;	// most lists federated, one bit each
+const std::size_t merkleleaf = 16;	// entries a merkle leaf is sized for
+const unsigned int maxmerkledepth = 20;	// most merkle tree levels below the root
+const std::size_t sortstringoverhead = 32;	// allocation overhead reckoned per string
+const unsigned int defaultshards = 16;	// shards made when not told otherwise
+const unsigned int maxshards = 4096;	// shard files are named 0000 to 4095
+const unsigned int watchdebounce = 250;	// ms of quiet before acting on changes
+const unsigned int dnsblport = 5300;	// dnsbl port when not told, 53 needs root
+const uint32_t dnsblttl = 3600;		// ttl of dnsbl answers
+const uint32_t dnsblnegttl = 30;	// ttl of dnsbl misses, the soa minimum
+const unsigned int dnsblclients = 256;	// tcp clients served at once
+const unsigned int dnsblidle = 10;	// seconds a quiet tcp client is kept
+const unsigned int tabledport = 10029;	// tabled port when not told
+const std::size_t tabledline = 2048;	// longest request line tabled takes
+const std::size_t tabledout = 16384;	// answers a tabled client can fall behind on
+const unsigned int tabledclients = 1024;	// clients tabled serves at once
+const unsigned int tabledidle = 300;	// seconds a quiet tabled client is kept
+const char sarulename[] = "PHISH_REPLY";	// spamassassin rules are named after this
+const char sascore[] = "10.000";	// score of a spamassassin match
+const std::size_t samaxrule = 8192;	// longest spamassassin pattern when not told
+const std::size_t saminrule = 256;	// shortest --max-rule taken
+const std::size_t statstop = 10;	// domains stats lists when not told
+
 enum errstate
 {
 	EOK,		// all ok
@@ -97,6 +512,29 @@ enum errstate
 	EUSERDB,	// cannot load user database
 	EWAPERDB,	// cannot write APER database
 	EMEM,		// memory allocation problem
+	ESORT,		// list is not in sorted order
+	EDELTA,		// bad delta file
+	EDIFF,		// cannot diff lists
+	EPATCH,		// cannot patch list
+	ECODEC,		// compression not supported by this build
+	EDECODE,	// corrupt compressed data
+	EENCODE,	// cannot write compressed data
+	EOPTION,	// bad option value
+	ELOCK,		// cannot lock list
+	ESPOOL,		// cannot use spool directory
+	EREJECT,	// too many bad entries
+	ENOENTRY,	// no such entry in the list
+	ESHARD,		// bad or unusable shard layout
+	EWATCH,		// cannot watch lists
+	ERUN,		// output command failed
+	ESNAPSHOT,	// cannot publish or map a snapshot
+	EDNSBL,		// cannot serve dns blocklist
+	ETABLED,	// cannot serve table lookups
+	ESARULES,	// cannot write spamassassin rules
+	ECOLUMNAR,	// cannot write columnar export
+	EFEDERATE,	// cannot federate lists
+	ESYNC,		// cannot sync list
+	ECANONICAL,	// listed link not canonical
 	EUNKNOWN	// we shouldn't need this, but...
 };
 
@@ -107,7 +545,14 @@ enum trimspec
 };
 
 enum datamode { reply, links, cleared, nummodes };
-std::bitset<nummodes> dbmode; 
+
+enum codec { plain, gzip, zstd, keep };
+
+enum shardkey { byhash, bydomain };
+
+enum dnstype { dnstypea = 1, dnstypesoa = 6, dnstypetxt = 16, dnstypeany = 255 };
+enum dnsclass { dnsclassin = 1, dnsclassany = 255 };
+enum dnsrcode { dnsformerr = 1, dnsnxdomain = 3, dnsnotimp = 4, dnsrefused = 5 };
 
 
 
@@ -125,7 +570,7 @@ public:
 	bool isnewer( std::string d ) const;
 
 	virtual void address( std::string a ) = 0;
-	virtual std::string address( void ) const = 0;
+	virtual const std::string &address( void ) const = 0;
 	virtual bool isvalidaddress( std::string ) const = 0;
 
 	virtual void write( std::ostream &f ) = 0;
@@ -141,7 +586,7 @@ class APERreply : public APERnode
 public:
 	APERreply( void );
 
-	std::string address( void ) const { return ( _address ); }
+	const std::string &address( void ) const { return ( _address ); }
 	void address( std::string a ) { _address = a; }
 	bool isvalidaddress( std::string a ) const;
 
@@ -166,7 +611,7 @@ class APERlinks : public APERnode
 public:
 	APERlinks( void );
 
-	std::string address( void ) const { return ( _address ); }
+	const std::string &address( void ) const { return ( _address ); }
 	void address( std::string a ) { _address = a; }
 	bool isvalidaddress( std::string address ) const;
 	std::string cleanup( std::string url );
@@ -182,7 +627,7 @@ class APERcleared : public APERnode
 public:
 	APERcleared( void );
 
-	std::string address( void ) const { return ( _address ); }
+	const std::string &address( void ) const { return ( _address ); }
 	void address( std::string a ) { _address = a; }
 	bool isvalidaddress( std::string address ) const;
 
@@ -192,1104 +637,9297 @@ private:
 	std::string _address;
 };
 
-typedef std::map<std::string, APERnode *> APERdb;
-typedef std::vector<std::string> Comments;
-typedef unsigned int linenum_type;
+// open addressing hash table of nodes keyed by their address.  loaders
+// need a single probe per line; sorted order is only produced when the
+// database is written.  the table owns the nodes given to it.
 
-std::string trimspace( std::string &s, trimspec trim = ENDS );
-std::string split( std::string s, char c = tokcsv );
-std::string tolowercase( std::string s );
-errstate errnotify( errstate err, std::string extrainfo = "", linenum_type line = 0 );
+class APERdb
+{
+public:
+	typedef std::vector<APERnode *> Nodes;
 
-bool loadaperdb( void );
-bool loadaperreply( std::istream *f );
-bool loadapercleared( std::istream *f );
-bool loadaperlinks( std::istream *f );
-bool setapercleared( std::istream *f );
+	APERdb( void );
+	~APERdb( void );
 
-bool loaduserdb( std::string datafile );
-bool loaduserreply( std::istream *f );
-bool loadusercleared( std::istream *f );
-bool loaduserlinks( std::istream *f );
+	APERnode *insert( APERnode *node );
+	APERnode *find( const std::string &key ) const;
+	bool erase( const std::string &key );
+	void redate( APERnode *node, const std::string &date );
+	std::size_t size( void ) const { return ( _used ); }
 
-bool writeaperdb( void );
+	void nodes( Nodes &v ) const;
+	void sorted( Nodes &v ) const;
+	void dated( const std::string &from, const std::string &to, Nodes &v ) const;
+	void release( void );
 
-APERdb aperdb;
-Comments comments;
+private:
+	struct Bucket
+	{
+		std::size_t hash;
+		APERnode *node;
+	};
 
+	APERdb( const APERdb & );
+	APERdb &operator=( const APERdb & );
 
+	typedef std::map<std::string, std::set<APERnode *> > Dates;
 
-/////////////////////////////////////////////////////
-//      main                                       //
-/////////////////////////////////////////////////////
+	static std::size_t hash( const std::string &key );
+	void grow( void );
 
-int main( int argc, char *argv[] )
+	std::vector<Bucket> _b;
+	std::size_t _used;
+	Dates _dates;		// nodes by the date they were last seen
+};
+
+// secondary index of the wildcard entries of the links list, such as
+// *.example.com/forms/* or */forms/use/*/form1.html.  a "*" host label
+// stands for one or more labels, a "*" path segment for one segment, or
+// for everything below when it's the last.  the patterns are folded
+// into one trie, host labels from the top level down and then the path,
+// so a lookup walks the key once however many patterns there are.
+// literal entries are found in the list itself.
+
+class APERlinkpatterns
 {
-	std::string datafile;
+public:
+	APERlinkpatterns( void );
 
-	while ( --argc > 0 )
+	static bool ispattern( const std::string &key );
+	static void splitkey( const std::string &key, std::vector<std::string> &labels,
+		std::vector<std::string> &segments );
+
+	void build( const APERdb &db );
+	void add( APERnode *node );
+	APERnode *match( const std::string &key ) const;
+	std::size_t size( void ) const { return ( _count ); }
+
+private:
+	struct State
 	{
-		std::string opt = *++argv;
+		State( void ) : star( 0 ), path( 0 ), entry( 0 ), rest( 0 ) {}
+
+		std::map<std::string, std::size_t> next;
+		std::size_t star;		// where a "*" label or segment leads
+		std::size_t path;		// end of a host: where its paths start
+		APERnode *entry;		// pattern ending here
+		APERnode *rest;			// pattern ending here with "*"
+	};
+
+	std::size_t child( std::size_t s, const std::string &token );
+	APERnode *matchhost( std::size_t s, const std::vector<std::string> &labels, std::size_t i,
+		const std::vector<std::string> &segments ) const;
+	APERnode *matchpath( std::size_t s, const std::vector<std::string> &segments, std::size_t i ) const;
+
+	std::vector<State> _s;	// 0 is the root, so no state leads to 0
+	std::size_t _count;
+};
 
-		if ( dbmode.none() )
-		{
-			if ( opt == "help" ) { return errnotify( EUSE ); }
+// secondary index of reply entries by a folded form of the address, so
+// that look-alikes of a listed address are found with one lookup.  see
+// fold() for what's folded.  entries folding alike share a probe run
+// and are told apart by folding them again.  cleared entries are
+// indexed too, so that listing one again needs no change to the index;
+// find() leaves them out.
 
-			if ( opt == "cleared" ) { dbmode.set( cleared ); continue; }
-			if ( opt == "links" ) { dbmode.set( links ); continue; }
-			if ( opt == "reply" ) { dbmode.set( reply ); continue; }
-		}
+class APERvariants
+{
+public:
+	APERvariants( void ) : _used( 0 ) {}
 
-		if ( dbmode.any() ) { datafile = opt; break; }
-	}
+	static std::string fold( const std::string &address );
 
-	if ( dbmode.none() ) return ( errnotify( EUSE ) );
+	void build( const APERdb &db );
+	void add( APERnode *node );
+	void find( const std::string &address, APERdb::Nodes &v ) const;
+	std::size_t size( void ) const { return ( _used ); }
 
-	if ( ! loadaperdb() ) return ( errnotify( EAPERDB ) );
-	if ( ! loaduserdb( datafile ) ) return ( errnotify( EUSERDB ) );
-	if ( ! writeaperdb() ) return ( errnotify( EWAPERDB ) ); 
+private:
+	struct Bucket
+	{
+		uint32_t hash;
+		APERnode *node;
+	};
 
-	return ( EOK );
-}
+	void grow( void );
 
-/////////////////////////////////////////////////////
-//      errnotify                                  //
-/////////////////////////////////////////////////////
+	std::vector<Bucket> _b;
+	std::size_t _used;
+};
 
-errstate errnotify( errstate err, std::string extrainfo, linenum_type line )
-{
-	std::string msg;
+// exclusive advisory lock on a list, held from load to write.
 
-	switch ( err )
-	{
-		case EUSE:
-			msg =
-				"Add bulk to Anti Phishing Email Reply list data\n" \
-				"use: aper list [file]\n" \
-				"\t'list' reply | cleared | links\n" \
-				"\t'file' data to add, read stdin if not specified";
-			break;
+class APERlock
+{
+public:
+	APERlock( void ) : _fd( -1 ) {}
+	~APERlock( void ) { unlock(); }
 
-		case EFILE:		msg = "Cannot open new data file"; break;
-		case ERFILE:	msg = "Cannot open reply address file"; break;
-		case ECFILE:	msg = "Cannot open cleared address file"; break;
-		case EXFILE:	msg = "Cannot open temporary file"; break;
-		case EXFILERM:	msg = "Cannot remove temporary file"; break;
-		case EATYPE:	msg = "Bad record type"; break;
-		case EADDRESS:	msg = "Bad address format"; break;
-		case EDATE:		msg = "Bad date format"; break;
-		case EAPERDB:	msg = "Cannot load APER database"; break;
-		case EUSERDB:	msg = "Cannot load user database"; break;
-		case EWAPERDB:	msg = "Cannot write APER database"; break;
-		case ELFILE:	msg = "Cannot open links file"; break;
+	bool lock( const std::string &lockfile );
+	void unlock( void );
 
-		case EUNKNOWN:
-		default:		msg = "Unknown error state"; break;
-	}
+private:
+	APERlock( const APERlock & );
+	APERlock &operator=( const APERlock & );
 
-	if ( ! extrainfo.empty() )
-		msg += ": " + extrainfo;
+	int _fd;
+};
 
-	if ( line > 0 )
-		std::cerr << "\tline " << line << ": ";
+typedef std::vector<std::string> Comments;
+typedef unsigned int linenum_type;
+typedef std::map<std::string, std::string> Options;
 
-	std::cerr << msg << std::endl;
+// one parsed line of a list, fields as they would be written.
 
-	return ( err );
-}
+struct APERrecord
+{
+	std::string address;
+	std::string addrt;
+	std::string date;
+};
 
-/////////////////////////////////////////////////////
-//      loadaperdb                                 //
-/////////////////////////////////////////////////////
+// what reconciling the reply list with the cleared list did.
 
-bool loadaperdb( void )
+struct APERclearstats
 {
-	if ( dbmode.test( reply ) )
-	{
-		bool r(true), c(true);
+	APERclearstats( void ) : cleared( 0 ), reactivated( 0 ) {}
 
-		std::ifstream ifsreply( replyfile.c_str() );
-		if ( ! ifsreply ) { errnotify( ERFILE, replyfile ); return ( false ); }
-		r = loadaperreply( &ifsreply );
-		ifsreply.close();
+	std::size_t cleared;		// listed entries cleared
+	std::size_t reactivated;	// cleared entries listed again since
+};
 
-		std::ifstream ifsclear( replyclearedfile.c_str() );
-		if ( ! ifsclear ) { errnotify( ECFILE, replyclearedfile ); return ( false ); }
-		c = setapercleared( &ifsclear );
-		ifsclear.close();
+// how a list is split over the files in its shard directory.  each
+// shard is a sorted list of its own.  count is 0 for a list kept in a
+// single file.  shards holding changed entries are marked dirty, and
+// only those are written back.
 
-		return ( r & c );
-	}
+struct APERshards
+{
+	APERshards( void ) : by( byhash ), count( 0 ) {}
 
-	if ( dbmode.test( links ) )
-	{
-		std::ifstream ifs( linksfile.c_str() );
-		if ( ! ifs ) { errnotify( ELFILE, linksfile ); return ( false ); }
-		bool status = loadaperlinks( &ifs );
-		ifs.close();
+	unsigned int of( datamode m, const std::string &key ) const;
 
-		return ( status );
-	}
+	shardkey by;
+	unsigned int count;
+	std::vector<bool> dirty;
+};
 
-	if ( dbmode.test( cleared ) )
-	{
-		std::ifstream ifs( replyclearedfile.c_str() );
-		if ( ! ifs ) { errnotify( ECFILE, replyclearedfile ); return ( false ); }
-		bool status = loadapercleared( &ifs );
-		ifs.close();
+// everything belonging to one open list.  nothing is shared between
+// lists, so any number of them can be open at once.  list files are
+// looked for in dir, the current directory if it's empty.
 
-		return ( status );
-	}
+struct APERlist
+{
+	APERlist( datamode m, const std::string &d = "" );
+
+	std::string path( const std::string &file ) const;
+	std::string name( void ) const;
+	std::string file( void ) const { return ( path( name() ) ); }
+	std::string lockfile( void ) const { return ( path( "." + name() + locksuffix ) ); }
+	void touch( const std::string &key ) { if ( shards.count ) shards.dirty[ shards.of( mode, key ) ] = true; }
+	bool clearedon( const std::string &address, std::string &date ) const;
+	const APERrecord *findunlisted( const std::string &address ) const;
+
+	datamode mode;
+	std::string dir;
+	APERdb db;
+	Comments comments;
+	codec listcodec;		// how the list was compressed when loaded
+	codec outcodec;			// how to compress the list when written
+	std::ostream *rejects;	// where bad entries go when they don't stop us
+	double maxerrors;		// fraction of bad entries that refuses a batch
+	APERlock lock;			// held from load to write when updating
+	APERshards shards;		// the list's shard layout, if it has one
+	APERdb::Nodes order;	// reply entries in file order, while it's sorted
+	bool ordered;			// order can be merged with the cleared list
+	std::vector<APERrecord> unlisted;	// cleared, never listed, by address
+	APERclearstats clearstats;
 
-	return ( false );
-}
+private:
+	APERlist( const APERlist & );
+	APERlist &operator=( const APERlist & );
+};
 
-/////////////////////////////////////////////////////
-//      loadaperreply                              //
-/////////////////////////////////////////////////////
+// read side of list i/o.  small plain files are read straight from the
+// file.  pipes, big files and compressed data, recognized by its magic
+// bytes, are read and decoded on their own thread and handed to the
+// parser a block at a time so that the two overlap.  an empty file name
+// means stdin.
 
-bool loadaperreply( std::istream *f )
+class APERinput
 {
-	std::string s;
-	linenum_type line = 0;
+public:
+	APERinput( void );
+	~APERinput( void );
 
-	while ( getline( *f, s ) )
-	{
-		++line;
-		trimspace( s, ENDS );
-		if ( s.empty() ) continue;
+	bool open( const std::string &file );
+	bool close( void );
 
-		if ( s[0] == tokcomment )
-			comments.push_back( s );
-		else
-			break;
-	}
+	std::istream &stream( void ) { return ( _is ); }
+	codec format( void ) const { return ( _codec ); }
 
-	if ( f->good() )
+private:
+	class fdbuf : public std::streambuf
 	{
-		do
-		{
-			if ( s[0] == tokcomment ) continue;
+	public:
+		fdbuf( void ) : _fd( -1 ) {}
+		void attach( int fd, const char *p, std::size_t n );
 
-			trimspace( s, ENDS );
-			if ( s.empty() ) continue;
-
-			std::string address, addrt, date;
+	protected:
+		int underflow( void );
 
-			std::istringstream iss( split( s ) );
-				iss >> address >> addrt >> date;
+	private:
+		int _fd;
+		char _buf[ iobufsize ];
+	};
 
-			APERreply *node = new (std::nothrow) APERreply;
+	// input filled by a reader thread and parsed on the caller's, in two
+	// blocks so that one is filled while the other is parsed.  lines
+	// running over the end of a block carry on in the next, as with any
+	// streambuf.  input that ends because the reader failed ends in an
+	// error rather than eof, so the line it was cut off in isn't parsed.
 
-			errstate err = ( node ) ? EOK : EMEM;
-			if ( err == EOK && ! node->isvalidaddress( address ) )
-				err = errnotify( EADDRESS, address, line );
-			if ( err == EOK && ! node->isvalidaddrtype( addrt ) )
-				err = errnotify( EATYPE, addrt, line );
-			if ( err == EOK && ! node->isvaliddate( date ) )
-				err = errnotify( EDATE, date, line );
+	class blockbuf : public std::streambuf
+	{
+	public:
+		blockbuf( void );
+		~blockbuf( void );
+
+		void reset( void );
+		char *space( std::size_t &n );
+		void commit( std::size_t n );
+		void finish( bool failed );
+		void abandon( void );
+		bool abandoned( void );
+
+	protected:
+		int underflow( void );
+
+	private:
+		blockbuf( const blockbuf & );
+		blockbuf &operator=( const blockbuf & );
+
+		void publish( void );
+
+		pthread_mutex_t _lock;
+		pthread_cond_t _cond;
+		std::vector<char> _block[ 2 ];
+		std::size_t _size[ 2 ];
+		unsigned int _in;		// block being filled
+		unsigned int _out;		// block being parsed, or next to be
+		unsigned int _full;		// blocks filled and not yet parsed
+		std::size_t _filled;
+		bool _filling;
+		bool _holding;
+		bool _ended;
+		bool _failed;
+		bool _abandoned;
+	};
+
+	APERinput( const APERinput & );
+	APERinput &operator=( const APERinput & );
+
+	static void *reader( void *arg );
+	bool readplain( void );
+	bool decodegzip( void );
+	bool decodezstd( void );
+
+	int _fd;
+	codec _codec;
+	std::string _file;
+	char _magic[ 4 ];
+	std::size_t _nmagic;
+	pthread_t _tid;
+	bool _threaded;
+	bool _failed;
+	fdbuf _buf;
+	blockbuf _blocks;
+	std::istream _is;
+};
 
-			if ( err != EOK )
-			{
-				delete node;
-				return ( false );
-			}
+// write side of list i/o, optionally compressing on the way out.
+// output is gathered into large blocks for write(2).  given the file
+// it will replace, what's written is compared with it on the way, so
+// that a file that comes out the same can be left alone.
 
-			address = tolowercase( address );
-			node->address( address );
-			node->addrtype( addrt );
-			node->date( date );
+class APERoutput
+{
+public:
+	APERoutput( void );
+	~APERoutput( void );
 
-			if ( aperdb.count( address ) == 0 )
-			{
-				aperdb[ address ] = node;
-			}
-			else
-			{
-				delete node;
-	
-				if ( ! aperdb[ address ]->isnewer( date ) )
-					aperdb[ address ]->date( date );
+	bool open( const char *file, codec c );
+	void compare( const std::string &file ) { _buf.compare( file ); }
+	bool close( void );
+	bool unchanged( void ) const { return ( _buf.unchanged() ); }
 
-				APERreply *p = dynamic_cast<APERreply *>( aperdb[ address ] );
-				if ( p->addrtype() != addrt ) p->addrtype( addrt );
-			}
-		}
-		while ( ++line, getline( *f, s ) );
-	}
+	std::ostream &stream( void ) { return ( _os ); }
 
-	return ( true );
-}
+private:
+	class codecbuf : public std::streambuf
+	{
+	public:
+		codecbuf( void );
+		~codecbuf( void );
+		bool open( int fd, codec c );
+		void compare( const std::string &file );
+		bool finish( void );
+		bool unchanged( void ) const { return ( _same ); }
+
+	protected:
+		int overflow( int c );
+		int sync( void );
+
+	private:
+		bool put( const char *p, std::size_t n, bool last );
+		bool writeall( const char *p, std::size_t n );
+		void match( const char *p, std::size_t n );
+
+		int _fd;
+		codec _codec;
+		bool _failed;
+		int _cmpfd;			// the file being replaced, while it matches
+		bool _same;
+		std::vector<char> _buf;
+		std::vector<char> _zbuf;
+		std::vector<char> _cmp;
+#ifdef APER_GZIP
+		z_stream _zs;
+#endif
+#ifdef APER_ZSTD
+		ZSTD_CStream *_zcs;
+#endif
+	};
+
+	APERoutput( const APERoutput & );
+	APERoutput &operator=( const APERoutput & );
+
+	int _fd;
+	codec _codec;
+	codecbuf _buf;
+	std::ostream _os;
+};
 
-/////////////////////////////////////////////////////
-//      setapercleared                             //
-/////////////////////////////////////////////////////
-// this is a little different from loadapercleared() in that this simply
-// sets the cleared flag.  this should be called after loadaperreply().
+// a stream of records in list order, for building deltas.  file
+// records are checked for order as they're read.
 
-bool setapercleared( std::istream *f )
+class APERrecords
 {
-	std::string s;
-	linenum_type line = 0;
+public:
+	virtual ~APERrecords( void ) {}
 
-	while ( getline( *f, s ) )
-	{
-		++line;
-		trimspace( s, ENDS );
-		if ( s.empty() ) continue;
-		if ( s[0] == tokcomment ) continue;
+	virtual bool next( APERrecord &r ) = 0;
+	bool ok( void ) const { return ( _ok ); }
 
-		std::string address, date;
-		std::istringstream iss( split( s ) );
-		iss >> address >> date;
+protected:
+	APERrecords( void ) : _ok( true ) {}
 
-		APERreply *node = new (std::nothrow) APERreply;
-		
-		errstate err = ( node ) ? EOK : EMEM;
-		if ( err == EOK && ! node->isvalidaddress( address ) )
-			err = errnotify( EADDRESS, address, line );
-		if ( err == EOK && ! node->isvaliddate( date ) )
-			err = errnotify( EDATE, date, line );
+	bool _ok;
+};
 
-		if ( err != EOK )
-		{
-			delete node;
-			return ( false );
-		}
+class APERfilerecords : public APERrecords
+{
+public:
+	APERfilerecords( std::istream *f, datamode m, const std::string &name ) :
+		_f( f ), _m( m ), _name( name ), _line( 0 ) {}
 
-		address = tolowercase( address );
-		node->address( address );
-		node->date( date );
+	bool next( APERrecord &r );
 
-		if ( aperdb.count( address ) > 0 )
-		{
-			delete node;
+private:
+	std::istream *_f;
+	datamode _m;
+	std::string _name;
+	linenum_type _line;
+	std::string _last;
+};
 
-			if ( ! aperdb[ address ]->isnewer( date ) )
-			{
-				APERreply *p = dynamic_cast<APERreply *>( aperdb[ address ] );
-				p->clear();
-				p->date( date );
-			}
-		}
-		else
-		{
-				node->clear();
-				aperdb[ address ] = node;
-		}
-	}
+class APERvectorrecords : public APERrecords
+{
+public:
+	APERvectorrecords( const std::vector<APERrecord> &v ) : _v( v ), _i( 0 ) {}
 
-	return ( true );
-}
+	bool next( APERrecord &r );
 
-/////////////////////////////////////////////////////
-//      loadapercleared                            //
-/////////////////////////////////////////////////////
+private:
+	const std::vector<APERrecord> &_v;
+	std::size_t _i;
+};
 
-bool loadapercleared( std::istream *f )
+// several sorted streams merged into one, records for the same address
+// combined as new entries are.  sources() has a bit set for each of the
+// first 64 streams the last record came from.
+
+class APERmergedrecords : public APERrecords
 {
-	std::string s;
-	linenum_type line = 0;
+public:
+	APERmergedrecords( datamode m, const std::vector<APERrecords *> &sources );
 
-	while ( getline( *f, s ) )
+	bool next( APERrecord &r );
+	uint64_t sources( void ) const { return ( _from ); }
+
+private:
+	struct Head
 	{
-		++line;
+		APERrecord r;
+		std::size_t source;
+	};
+
+	static bool later( const Head &a, const Head &b );
+	void pull( std::size_t source );
+	void from( std::size_t source );
+
+	datamode _m;
+	std::vector<APERrecords *> _sources;
+	std::vector<Head> _heap;
+	uint64_t _from;
+};
+
+// a merkle tree over a list's entries as written, for finding where two
+// copies of it differ without comparing them whole.  entries go to one
+// of 2^depth leaves by the top bits of hash32() of their key, so each
+// leaf covers a fixed slice of the key space whatever else is listed,
+// and the depth is chosen from the size of the list so that a leaf
+// holds about merkleleaf entries.  both copies must be built to the
+// same depth to be compared.  a leaf's digest is the md5 of its
+// entries' lines in list order, any other node's the md5 of its
+// children's digests.  nodes are numbered as in a heap: the root is 1,
+// n's children are 2n and 2n + 1, and the leaves are numbered from
+// 2^depth on.
+
+class APERmerkle
+{
+public:
+	APERmerkle( void ) : _depth( 0 ) {}
+
+	static unsigned int depthfor( std::size_t entries );
+
+	unsigned int depth( void ) const { return ( _depth ); }
+	std::size_t leaves( void ) const { return ( static_cast<std::size_t>( 1 ) << _depth ); }
+	std::size_t leaf( const std::string &key ) const;
+
+	void build( datamode m, const std::vector<APERrecord> &v, unsigned int depth );
+	const std::string &digest( std::size_t node ) const { return ( _digest[ node ] ); }
+	std::size_t count( std::size_t node ) const { return ( _count[ node ] ); }
+	void records( std::size_t node, std::vector<APERrecord> &v ) const;
+
+private:
+	unsigned int _depth;
+	std::vector<std::string> _digest;	// by node, 0 unused
+	std::vector<std::size_t> _count;	// entries under each node
+	std::vector<APERrecord> _records;	// by leaf, then address
+	std::vector<std::size_t> _first;	// where each leaf's records start
+};
+
+// the other copy of a list as sync sees it: the digests of tree nodes
+// and the entries under leaves, asked for a level at a time.
+
+class APERsyncpeer
+{
+public:
+	virtual ~APERsyncpeer( void ) {}
+
+	virtual unsigned int depth( void ) const = 0;
+	virtual bool digests( const std::vector<std::size_t> &nodes, std::vector<std::string> &d ) = 0;
+	virtual bool records( const std::vector<std::size_t> &leaves, std::vector<APERrecord> &v ) = 0;
+};
+
+// a copy loaded here, from another directory.
+
+class APERlocalpeer : public APERsyncpeer
+{
+public:
+	APERlocalpeer( const APERmerkle &t ) : _t( t ) {}
+
+	unsigned int depth( void ) const { return ( _t.depth() ); }
+	bool digests( const std::vector<std::size_t> &nodes, std::vector<std::string> &d );
+	bool records( const std::vector<std::size_t> &leaves, std::vector<APERrecord> &v );
+
+private:
+	const APERmerkle &_t;
+};
+
+// a copy served by "aper sync list --serve" at the other end of a
+// command, ssh most likely, which is run with a socket for its stdin
+// and stdout.
+
+class APERremotepeer : public APERsyncpeer
+{
+public:
+	APERremotepeer( datamode m ) : _m( m ), _depth( 0 ), _fd( -1 ), _pid( -1 ), _at( 0 ) {}
+	~APERremotepeer( void ) { close(); }
+
+	bool open( const std::string &command );
+	bool close( void );
+
+	unsigned int depth( void ) const { return ( _depth ); }
+	bool digests( const std::vector<std::size_t> &nodes, std::vector<std::string> &d );
+	bool records( const std::vector<std::size_t> &leaves, std::vector<APERrecord> &v );
+
+private:
+	APERremotepeer( const APERremotepeer & );
+	APERremotepeer &operator=( const APERremotepeer & );
+
+	bool request( char op, const std::vector<std::size_t> &nodes );
+	bool getline( std::string &s );
+
+	datamode _m;
+	unsigned int _depth;	// the server's tree's
+	int _fd;
+	pid_t _pid;
+	std::string _in;		// read from the socket
+	std::size_t _at;		// where the next line in _in starts
+};
+
+// a published snapshot of the active reply and links entries, for any
+// number of processes to map and search in place.  everything is
+// addressed by offset from the start of the file.  each list is an open
+// addressing table of buckets, a power of 2 of them, pointing at
+// "address\0types\0date\0" strings.  a new snapshot is renamed over
+// the old one and then the old one is marked superseded, which tells
+// its readers to map the file again.
+
+struct APERsnaptable
+{
+	uint64_t buckets;		// offset of the buckets
+	uint64_t mask;			// number of buckets - 1
+	uint64_t count;			// entries
+};
+
+struct APERsnapheader
+{
+	char magic[ 8 ];
+	uint32_t version;
+	volatile uint32_t superseded;
+	uint64_t generation;
+	uint64_t size;
+	APERsnaptable table[ nummodes ];
+};
+
+struct APERsnapbucket
+{
+	uint32_t hash;
+	uint32_t pad;
+	uint64_t entry;			// offset of the strings, 0 if empty
+};
+
+const char snapmagic[ 8 ] = { 'A', 'P', 'E', 'R', 'S', 'N', 'A', 'P' };
+const uint32_t snapversion = 1;
+
+// a columnar export of the lists, for analysis tools to read straight
+// into arrays.  every offset is from the start of the file and 8 byte
+// aligned, and numbers are in the writer's byte order, which version
+// reads as 1 in.  domains, and link hosts, are kept once in a sorted
+// dictionary of strings and each row has its index; the rest of the key
+// is a string column.  strings are uint32 offsets, one more than there
+// are strings, into their bytes.
+
+struct APERcoltable
+{
+	uint64_t rows;
+	uint64_t domain;		// uint32 dictionary index
+	uint64_t restoffsets;	// the key less its domain: local part@ or /path
+	uint64_t restbytes;
+	uint64_t date;			// uint32 YYYYMMDD
+	uint64_t types;			// uint8 reply types, A in bit 0 to E in bit 4
+	uint64_t cleared;		// uint8 1 if the reply entry is cleared
+};
+
+struct APERcolheader
+{
+	char magic[ 8 ];
+	uint32_t version;
+	uint32_t tables;		// nummodes, by datamode; unexported lists are empty
+	uint64_t size;
+	uint64_t words;			// dictionary entries
+	uint64_t wordoffsets;
+	uint64_t wordbytes;
+	APERcoltable table[ nummodes ];
+};
+
+const char colmagic[ 8 ] = { 'A', 'P', 'E', 'R', 'C', 'O', 'L', '1' };
+const uint32_t colversion = 1;
+
+// a list being watched: the commands to run when it changes, and the
+// list as it was when they last ran.
+
+struct APERwatch
+{
+	APERwatch( void ) : watched( false ), changed( false ) {}
+
+	bool watched;
+	bool changed;
+	std::vector<std::string> commands;
+	std::vector<APERrecord> records;
+};
+
+// the reply list as dnsbl serves it, searched by address and by the md5
+// of the local part followed by the domain.
+
+struct APERdnsbl
+{
+	typedef std::pair<std::string, std::size_t> Hashed;
+
+	std::vector<APERrecord> records;
+	std::vector<Hashed> hashed;
+	uint32_t serial;
+};
+
+// a dnsbl client over tcp, with what it sent that isn't answered yet and
+// what it hasn't taken of the answers.
+
+struct APERdnsconn
+{
+	std::string in;
+	std::string out;
+	time_t active;
+};
+
+// the reply list as tabled serves it, in an open hash table of indexes
+// into records so that addresses are looked up in place.
+
+struct APERtable
+{
+	std::vector<APERrecord> records;
+	std::vector<uint32_t> slots;	// index of the entry plus 1, 0 if empty
+	uint32_t mask;
+};
+
+// a tabled client.  listed is set once an address of the policy request
+// being read is found.
+
+struct APERtableconn
+{
+	char in[ tabledline ];
+	std::size_t inlen;
+	char out[ tabledout ];
+	std::size_t outlen;
+	bool listed;
+	bool eof;			// the client has sent all it will
+	time_t active;
+};
+
+// a spamassassin pattern and the addresses it is meant to match.
+
+struct APERsarule
+{
+	std::string pattern;
+	std::vector<std::string> addresses;
+};
+
+// a line of new entries that didn't make it.
+
+struct APERreject
+{
+	linenum_type line;
+	errstate err;
+	std::string info;
+	std::string text;
+};
+
+// new entries read from one file, kept apart until they are merged.
+
+struct APERstage
+{
+	std::string file;
+	std::vector<APERrecord> records;
+	std::vector<APERreject> rejects;
+	linenum_type entries;
+	errstate err;
+	std::string errinfo;
+	linenum_type errline;
+};
+
+std::string trimspace( std::string &s, trimspec trim = ENDS );
+std::string split( std::string s, char c = tokcsv );
+std::string tolowercase( std::string s );
+uint32_t hash32( const std::string &s );
+uint32_t hash32( const char *p, std::size_t n );
+std::string md5hex( const std::string &s );
+std::string listkey( datamode m, std::string key );
+std::string::size_type domainat( datamode m, const std::string &key );
+std::string daysago( unsigned int days );
+unsigned int numthreads( std::size_t jobsize );
+void parallelfor( std::size_t n, void ( *job )( std::size_t, void * ), void *arg );
+void sortnodes( APERdb::Nodes &v );
+errstate errnotify( errstate err, std::string extrainfo = "", linenum_type line = 0 );
+const char *errmessage( errstate err );
+
+bool loadaperdb( APERlist &l );
+bool loadaperreply( APERlist &l, std::istream *f );
+bool loadapercleared( APERlist &l, std::istream *f );
+bool loadaperlinks( APERlist &l, std::istream *f );
+bool setapercleared( APERlist &l, std::istream *f );
+void mergecleared( APERlist &l, const std::vector<APERrecord> &v );
+
+errstate loadconcurrent( APERlist &l, std::string datafile );
+bool userline( datamode m, std::string &s );
+bool mergeuserrecord( APERlist &l, const APERrecord &r );
+bool stageuserfile( const APERlist &l, APERstage &st );
+bool acceptstage( const APERlist &l, const APERstage &st );
+bool sortuserdb( APERlist &l, std::string datafile, std::size_t budget );
+void combinerecord( datamode m, APERrecord &r, const APERrecord &n );
+
+bool writeaperdb( APERlist &l );
+bool writelistfile( APERlist &l, const std::string &file );
+void putlist( APERlist &l, std::ostream &f );
+bool commitaperfile( const char *tmpfile, const std::string &file, bool unchanged = false );
+std::string dirof( const std::string &file );
+std::string listname( datamode m );
+
+errstate parserecord( datamode m, std::string s, APERrecord &r, bool listed );
+std::string formatrecord( datamode m, const APERrecord &r );
+errstate recorderror( errstate err, const APERrecord &r, linenum_type line );
+bool nextrecord( std::istream *f, datamode m, APERrecord &r, linenum_type &line, bool &ok );
+
+bool federatelists( datamode m, const std::vector<std::string> &files, unsigned int minsources );
+bool difflists( APERlist &l, std::string oldfile, std::string newfile, std::string deltafile );
+bool writedelta( datamode m, APERrecords &o, APERrecords &n, const APERlist *cleared, std::ostream &out, std::size_t *changes = 0 );
+void noderecord( datamode m, const APERnode *n, APERrecord &r );
+bool patchlist( APERlist &l, std::string deltafile );
+bool prunelist( APERlist &l, unsigned int days, bool rewrite );
+void datednodes( const APERdb &db, const std::string &from, const std::string &to, APERdb::Nodes &v );
+bool exportlist( APERlist &l, std::string since, std::string until );
+bool querylist( APERlist &l, const std::vector<std::string> &keys, bool variants );
+bool canonicalizelinks( APERlist &l, bool rewrite );
+bool exportcolumnar( const std::string &file, std::bitset<nummodes> lists, const std::string &since,
+	const std::string &until, codec c );
+bool liststats( std::bitset<nummodes> lists, std::size_t top, bool json );
+bool submitspool( APERlist &l, std::string datafile );
+bool ingestspool( APERlist &l );
+
+bool issharded( const std::string &file );
+std::string shardname( unsigned int i );
+bool clearreply( APERlist &l, const std::string &address, const std::string &date );
+void applycleared( APERlist &l, APERnode *n, const std::string &address, const std::string &date );
+void finishcleared( APERlist &l );
+bool recordless( const APERrecord &a, const APERrecord &b );
+void reportcleared( const APERlist &l );
+bool loadlistfile( APERlist &l, const std::string &name, bool ( *load )( APERlist &, std::istream * ), errstate err );
+bool readmanifest( const std::string &dir, APERshards &sh, Comments *comments );
+bool writemanifest( APERlist &l, const std::string &dir );
+bool loadshards( datamode m, const std::string &dir, const APERshards &sh, APERdb::Nodes &v, codec &format );
+bool writeshards( APERlist &l, const std::string &dir );
+bool shardlist( APERlist &l, unsigned int count, shardkey by );
+bool unshardlist( APERlist &l, std::string file, bool rewrite );
+bool removeshards( const std::string &dir );
+
+bool publishsnapshot( const std::string &file );
+bool loadlocked( APERlist &l );
+void activerecords( const APERlist &l, std::vector<APERrecord> &v );
+bool mapsnapshot( const std::string &file, const char *&base, std::size_t &size );
+bool dumpmerkle( APERlist &l, unsigned int depth );
+bool servesync( APERlist &l );
+bool synclist( APERlist &l, const std::string &dir, const std::string &command );
+bool watchlists( const std::string &conffile, unsigned int debounce );
+bool readwatchconf( const std::string &file, APERwatch w[] );
+bool rebuildwatch( datamode m, APERwatch &w, bool run );
+long long monotonicms( void );
+int listensocket( int family, const struct sockaddr *addr, socklen_t len, int type );
+int watchreply( std::map<int, datamode> &shardwds );
+bool replychanged( int fd, std::vector<char> &buf, std::map<int, datamode> &shardwds );
+bool servednsbl( const std::string &zone, const std::string &address, unsigned int port, unsigned int debounce );
+bool loaddnsbl( APERdnsbl &d );
+bool answerdns( const APERdnsbl &d, const std::vector<std::string> &zone, const unsigned char *q, std::size_t n, std::string &a, std::size_t size );
+bool servetable( const std::string &address, unsigned int port, int maxage, const std::string &action, unsigned int debounce );
+bool loadtable( APERtable &t );
+const APERrecord *findtable( const APERtable &t, const char *p, std::size_t n );
+bool writespamassassin( const std::string &file, const std::string &since, std::size_t maxrule, bool check );
+
+// long options, whether they take a value and the commands they go
+// with, "add" being plain adding of new data.
+
+struct APERoption
+{
+	const char *name;
+	bool hasvalue;
+	const char *commands;
+};
+
+const APERoption longoptions[] =
+{
+	{ "older-than", true, "prune" },
+	{ "since", true, "export spamassassin" },
+	{ "until", true, "export" },
+	{ "write", false, "prune canonicalize unshard" },
+	{ "reject", true, "add ingest" },
+	{ "max-errors", true, "add ingest" },
+	{ "shards", true, "shard" },
+	{ "by", true, "shard" },
+	{ "debounce", true, "watch dnsbl tabled" },
+	{ "verbose", false, "add ingest" },
+	{ "port", true, "dnsbl tabled" },
+	{ "listen", true, "dnsbl tabled" },
+	{ "max-age", true, "tabled" },
+	{ "action", true, "tabled" },
+	{ "memory", true, "add" },
+	{ "max-rule", true, "spamassassin" },
+	{ "check", false, "spamassassin" },
+	{ "columnar", true, "export" },
+	{ "json", false, "stats" },
+	{ "top", true, "stats" },
+	{ "min-sources", true, "federate" },
+	{ "variants", false, "query" },
+	{ "depth", true, "merkle" },
+	{ "via", true, "sync" },
+	{ "serve", false, "sync" },
+	{ 0, false, 0 }
+};
+
+
+
+#ifndef APER_LIBRARY
+
+/////////////////////////////////////////////////////
+//      main                                       //
+/////////////////////////////////////////////////////
+
+int main( int argc, char *argv[] )
+{
+	std::string command;
+	std::vector<std::string> files;
+	Options options;
+	std::bitset<nummodes> dbmode;
+	codec outcodec = keep;
+
+	std::ios::sync_with_stdio( false );
+
+	while ( --argc > 0 )
+	{
+		std::string opt = *++argv;
+
+		if ( opt.size() > 2 && opt.compare( 0, 2, "--" ) == 0 )
+		{
+			const APERoption *o = longoptions;
+			while ( o->name && opt.compare( 2, std::string::npos, o->name ) != 0 ) ++o;
+
+			if ( o->name == 0 ) return ( errnotify( EUSE ) );
+
+			if ( o->hasvalue )
+			{
+				if ( --argc == 0 ) return ( errnotify( EUSE ) );
+				options[ o->name ] = *++argv;
+			}
+			else
+				options[ o->name ] = "";
+
+			continue;
+		}
+
+		if ( dbmode.none() )
+		{
+			if ( opt == "help" ) { return errnotify( EUSE ); }
+
+			if ( opt == "-z" )
+			{
+				if ( --argc == 0 ) return ( errnotify( EUSE ) );
+				std::string z = *++argv;
+
+				if ( z == "none" ) outcodec = plain;
+				else if ( z == "gzip" ) outcodec = gzip;
+				else if ( z == "zstd" ) outcodec = zstd;
+				else return ( errnotify( EUSE ) );
+
+				continue;
+			}
+
+			if ( command.empty() && ( opt == "diff" || opt == "patch" ||
+					opt == "prune" || opt == "export" ||
+					opt == "submit" || opt == "ingest" ||
+					opt == "shard" || opt == "unshard" || opt == "watch" ||
+					opt == "publish" || opt == "dnsbl" || opt == "tabled" ||
+					opt == "spamassassin" || opt == "stats" || opt == "query" ||
+					opt == "canonicalize" || opt == "federate" || opt == "merkle" || opt == "sync" ) )
+				{ command = opt; continue; }
+
+			if ( command == "watch" || command == "publish" || command == "dnsbl" || command == "tabled" ||
+					command == "spamassassin" )
+				{ files.push_back( opt ); continue; }
+
+			if ( opt == "cleared" ) { dbmode.set( cleared ); continue; }
+			if ( opt == "links" ) { dbmode.set( links ); continue; }
+			if ( opt == "reply" ) { dbmode.set( reply ); continue; }
+		}
+
+		if ( dbmode.any() ) { files.push_back( opt ); }
+	}
+
+// every option given has to be one the command takes.
+
+	std::string used = " " + ( command.empty() ? std::string( "add" ) : command ) + " ";
+
+	for ( Options::iterator itr = options.begin(); itr != options.end(); ++itr )
+	{
+		const APERoption *o = longoptions;
+		while ( itr->first != o->name ) ++o;
+
+		if ( ( " " + std::string( o->commands ) + " " ).find( used ) == std::string::npos )
+			return ( errnotify( EOPTION, "--" + itr->first + " doesn't go with " + used.substr( 1, used.size() - 2 ) ) );
+	}
+
+	unsigned int debounce = watchdebounce;
+
+	if ( options.count( "debounce" ) )
+	{
+		std::string ms = options[ "debounce" ];
+		if ( ms.empty() || ms.size() > 6 || ms.find_first_not_of( "0123456789" ) != std::string::npos )
+			return ( errnotify( EOPTION, "--debounce " + ms ) );
+		debounce = atoi( ms.c_str() );
+	}
+
+	if ( command == "watch" )
+	{
+		if ( files.size() != 1 ) return ( errnotify( EUSE ) );
+
+		if ( ! watchlists( files[ 0 ], debounce ) ) return ( errnotify( EWATCH ) );
+		return ( EOK );
+	}
+
+	if ( command == "publish" )
+	{
+		if ( files.size() != 1 ) return ( errnotify( EUSE ) );
+		if ( ! publishsnapshot( files[ 0 ] ) ) return ( errnotify( ESNAPSHOT, files[ 0 ] ) );
+		return ( EOK );
+	}
+
+	if ( command == "dnsbl" )
+	{
+		if ( files.size() != 1 ) return ( errnotify( EUSE ) );
+
+		unsigned int port = dnsblport;
+		std::string address = options.count( "listen" ) ? options[ "listen" ] : "127.0.0.1";
+
+		if ( options.count( "port" ) )
+		{
+			std::string n = options[ "port" ];
+			if ( n.empty() || n.size() > 5 || n.find_first_not_of( "0123456789" ) != std::string::npos ||
+					( port = atoi( n.c_str() ) ) == 0 || port > 65535 )
+				return ( errnotify( EOPTION, "--port " + n ) );
+		}
+
+		if ( ! servednsbl( files[ 0 ], address, port, debounce ) ) return ( errnotify( EDNSBL ) );
+		return ( EOK );
+	}
+
+	if ( command == "tabled" )
+	{
+		if ( ! files.empty() ) return ( errnotify( EUSE ) );
+
+		unsigned int port = tabledport;
+		int maxage = -1;
+		std::string address = options.count( "listen" ) ? options[ "listen" ] : "127.0.0.1";
+		std::string action = options.count( "action" ) ? options[ "action" ] : "REJECT Phishing reply address";
+
+		if ( options.count( "port" ) )
+		{
+			std::string n = options[ "port" ];
+			if ( n.empty() || n.size() > 5 || n.find_first_not_of( "0123456789" ) != std::string::npos ||
+					( port = atoi( n.c_str() ) ) == 0 || port > 65535 )
+				return ( errnotify( EOPTION, "--port " + n ) );
+		}
+
+		if ( options.count( "max-age" ) )
+		{
+			std::string days = options[ "max-age" ];
+			if ( days.empty() || days.size() > 6 || days.find_first_not_of( "0123456789" ) != std::string::npos )
+				return ( errnotify( EOPTION, "--max-age " + days ) );
+			maxage = atoi( days.c_str() );
+		}
+
+		if ( ! servetable( address, port, maxage, action, debounce ) ) return ( errnotify( ETABLED ) );
+		return ( EOK );
+	}
+
+	if ( command == "export" && options.count( "columnar" ) )
+	{
+		if ( ! files.empty() ) return ( errnotify( EUSE ) );
+
+		APERcleared n;
+		if ( options.count( "since" ) && ! n.isvaliddate( options[ "since" ] ) )
+			return ( errnotify( EOPTION, "--since " + options[ "since" ] ) );
+		if ( options.count( "until" ) && ! n.isvaliddate( options[ "until" ] ) )
+			return ( errnotify( EOPTION, "--until " + options[ "until" ] ) );
+
+		std::bitset<nummodes> lists = dbmode;
+		if ( lists.none() ) lists.set();
+
+		if ( ! exportcolumnar( options[ "columnar" ], lists, options[ "since" ], options[ "until" ], outcodec ) )
+			return ( errnotify( ECOLUMNAR, options[ "columnar" ] ) );
+		return ( EOK );
+	}
+
+	if ( command == "stats" )
+	{
+		if ( ! files.empty() ) return ( errnotify( EUSE ) );
+
+		std::size_t top = statstop;
+
+		if ( options.count( "top" ) )
+		{
+			std::string n = options[ "top" ];
+			if ( n.empty() || n.size() > 6 || n.find_first_not_of( "0123456789" ) != std::string::npos )
+				return ( errnotify( EOPTION, "--top " + n ) );
+			top = atoi( n.c_str() );
+		}
+
+		std::bitset<nummodes> lists = dbmode;
+		if ( lists.none() ) lists.set();
+
+		if ( ! liststats( lists, top, options.count( "json" ) > 0 ) ) return ( errnotify( EAPERDB ) );
+		return ( EOK );
+	}
+
+	if ( command == "spamassassin" )
+	{
+		if ( files.size() > 1 ) return ( errnotify( EUSE ) );
+
+		std::size_t maxrule = samaxrule;
+		std::string since = options[ "since" ];
+
+		APERcleared n;
+		if ( ! since.empty() && ! n.isvaliddate( since ) ) return ( errnotify( EOPTION, "--since " + since ) );
+
+		if ( options.count( "max-rule" ) )
+		{
+			std::string b = options[ "max-rule" ];
+			if ( b.empty() || b.size() > 9 || b.find_first_not_of( "0123456789" ) != std::string::npos ||
+					( maxrule = atoi( b.c_str() ) ) < saminrule )
+				return ( errnotify( EOPTION, "--max-rule " + b ) );
+		}
+
+		files.resize( 1 );
+		if ( ! writespamassassin( files[ 0 ], since, maxrule, options.count( "check" ) > 0 ) ) return ( errnotify( ESARULES ) );
+		return ( EOK );
+	}
+
+	if ( dbmode.none() ) return ( errnotify( EUSE ) );
+
+	datamode m = dbmode.test( links ) ? links : dbmode.test( cleared ) ? cleared : reply;
+	APERlist list( m );
+	list.outcodec = outcodec;
+
+	if ( command == "diff" )
+	{
+		if ( files.size() < 2 || files.size() > 3 ) return ( errnotify( EUSE ) );
+		files.resize( 3 );
+		if ( ! difflists( list, files[ 0 ], files[ 1 ], files[ 2 ] ) ) return ( errnotify( EDIFF ) );
+		return ( EOK );
+	}
+
+	if ( command == "federate" )
+	{
+		if ( files.size() < 2 ) return ( errnotify( EUSE ) );
+
+		unsigned int minsources = 1;
+
+		if ( options.count( "min-sources" ) )
+		{
+			std::string k = options[ "min-sources" ];
+			if ( k.empty() || k.size() > 2 || k.find_first_not_of( "0123456789" ) != std::string::npos ||
+					( minsources = atoi( k.c_str() ) ) == 0 || minsources > files.size() )
+				return ( errnotify( EOPTION, "--min-sources " + k ) );
+		}
+
+		if ( ! federatelists( m, files, minsources ) ) return ( errnotify( EFEDERATE ) );
+		return ( EOK );
+	}
+
+	if ( command == "query" )
+	{
+		bool variants = options.count( "variants" ) > 0;
+		if ( variants && m != reply ) return ( errnotify( EUSE ) );
+
+		if ( ! loadlocked( list ) ) return ( EAPERDB );
+		if ( ! querylist( list, files, variants ) ) return ( ENOENTRY );
+		return ( EOK );
+	}
+
+	if ( command == "merkle" )
+	{
+		if ( ! files.empty() ) return ( errnotify( EUSE ) );
+
+		unsigned int depth = maxmerkledepth;
+
+		if ( options.count( "depth" ) )
+		{
+			std::string n = options[ "depth" ];
+			if ( n.empty() || n.size() > 2 || n.find_first_not_of( "0123456789" ) != std::string::npos ||
+					( depth = atoi( n.c_str() ) ) > maxmerkledepth )
+				return ( errnotify( EOPTION, "--depth " + n ) );
+		}
+
+		if ( ! loadlocked( list ) ) return ( EAPERDB );
+		if ( ! dumpmerkle( list, depth ) ) return ( errnotify( EFILE, "stdout" ) );
+		return ( EOK );
+	}
+
+	if ( command == "sync" && options.count( "serve" ) )
+	{
+		if ( ! files.empty() ) return ( errnotify( EUSE ) );
+		if ( ! servesync( list ) ) return ( errnotify( ESYNC ) );
+		return ( EOK );
+	}
+
+	if ( files.size() > 1 ) return ( errnotify( EUSE ) );
+
+	std::string datafile;
+	if ( ! files.empty() ) datafile = files[ 0 ];
+
+	std::ofstream rejectfile;
+
+	if ( options.count( "reject" ) || options.count( "max-errors" ) )
+	{
+		list.rejects = &std::cerr;
+
+		std::string f = options[ "reject" ];
+		if ( ! f.empty() && f != "-" )
+		{
+			rejectfile.open( f.c_str() );
+			if ( ! rejectfile ) return ( errnotify( EFILE, f ) );
+			list.rejects = &rejectfile;
+		}
+
+		if ( options.count( "max-errors" ) )
+		{
+			std::string r = options[ "max-errors" ];
+			char *end = 0;
+			double maxerrors = strtod( r.c_str(), &end );
+
+			if ( end && *end == '%' ) { maxerrors /= 100; ++end; }
+			if ( r.empty() || ! end || *end || maxerrors < 0 || maxerrors > 1 )
+				return ( errnotify( EOPTION, "--max-errors " + r ) );
+
+			list.maxerrors = maxerrors;
+		}
+	}
+
+	if ( command == "submit" )
+	{
+		if ( ! submitspool( list, datafile ) ) return ( errnotify( ESPOOL ) );
+		return ( EOK );
+	}
+
+	if ( command == "export" )
+	{
+		if ( ! files.empty() || options.count( "since" ) == 0 ) return ( errnotify( EUSE ) );
+
+		APERcleared n;
+		if ( ! n.isvaliddate( options[ "since" ] ) ) return ( errnotify( EOPTION, "--since " + options[ "since" ] ) );
+		if ( options.count( "until" ) && ! n.isvaliddate( options[ "until" ] ) )
+			return ( errnotify( EOPTION, "--until " + options[ "until" ] ) );
+
+		if ( ! loadaperdb( list ) ) return ( errnotify( EAPERDB ) );
+		if ( ! exportlist( list, options[ "since" ], options[ "until" ] ) ) return ( errnotify( EFILE, "stdout" ) );
+		return ( EOK );
+	}
+
+// everything past here may rewrite the list.
+
+	if ( ! list.lock.lock( list.lockfile() ) ) return ( errnotify( ELOCK, list.file() ) );
+
+	if ( command == "ingest" )
+	{
+		if ( ! files.empty() ) return ( errnotify( EUSE ) );
+		if ( ! ingestspool( list ) ) return ( errnotify( EWAPERDB ) );
+		if ( options.count( "verbose" ) && m == reply ) reportcleared( list );
+		return ( EOK );
+	}
+
+	if ( command == "canonicalize" )
+	{
+		if ( m != links || ! files.empty() ) return ( errnotify( EUSE ) );
+		if ( ! canonicalizelinks( list, options.count( "write" ) > 0 ) ) return ( errnotify( EWAPERDB ) );
+		return ( EOK );
+	}
+
+	if ( command == "sync" )
+	{
+		if ( files.size() != ( options.count( "via" ) ? 0u : 1u ) ) return ( errnotify( EUSE ) );
+
+		if ( ! loadaperdb( list ) ) return ( errnotify( EAPERDB ) );
+		if ( ! synclist( list, datafile, options[ "via" ] ) ) return ( errnotify( ESYNC ) );
+		return ( EOK );
+	}
+
+	if ( command == "patch" )
+	{
+		if ( ! patchlist( list, datafile ) ) return ( errnotify( EPATCH ) );
+		return ( EOK );
+	}
+
+	if ( command == "shard" )
+	{
+		if ( ! files.empty() ) return ( errnotify( EUSE ) );
+
+		unsigned int count = defaultshards;
+		shardkey by = byhash;
+
+		if ( options.count( "shards" ) )
+		{
+			std::string n = options[ "shards" ];
+			if ( n.empty() || n.size() > 4 || n.find_first_not_of( "0123456789" ) != std::string::npos ||
+					( count = atoi( n.c_str() ) ) == 0 || count > maxshards )
+				return ( errnotify( EOPTION, "--shards " + n ) );
+		}
+
+		if ( options.count( "by" ) )
+		{
+			std::string b = options[ "by" ];
+			if ( b == "domain" ) by = bydomain;
+			else if ( b != "hash" ) return ( errnotify( EOPTION, "--by " + b ) );
+		}
+
+		if ( ! loadaperdb( list ) ) return ( errnotify( EAPERDB ) );
+		if ( ! shardlist( list, count, by ) ) return ( errnotify( EWAPERDB ) );
+		return ( EOK );
+	}
+
+	if ( command == "unshard" )
+	{
+		bool rewrite = options.count( "write" ) > 0;
+		if ( rewrite && ! files.empty() ) return ( errnotify( EUSE ) );
+
+		if ( ! loadaperdb( list ) ) return ( errnotify( EAPERDB ) );
+		if ( ! unshardlist( list, datafile, rewrite ) ) return ( errnotify( EWAPERDB ) );
+		return ( EOK );
+	}
+
+	if ( command == "prune" )
+	{
+		if ( ! files.empty() || options.count( "older-than" ) == 0 ) return ( errnotify( EUSE ) );
+
+		std::string days = options[ "older-than" ];
+		if ( days.empty() || days.find_first_not_of( "0123456789" ) != std::string::npos )
+			return ( errnotify( EOPTION, "--older-than " + days ) );
+
+		if ( ! loadaperdb( list ) ) return ( errnotify( EAPERDB ) );
+		if ( ! prunelist( list, atoi( days.c_str() ), options.count( "write" ) > 0 ) ) return ( errnotify( EWAPERDB ) );
+		return ( EOK );
+	}
+
+	if ( options.count( "memory" ) )
+	{
+		std::string size = options[ "memory" ];
+		char *end = 0;
+		unsigned long long budget = strtoull( size.c_str(), &end, 10 );
+
+		if ( end && ( *end == 'k' || *end == 'K' ) ) { budget <<= 10; ++end; }
+		else if ( end && ( *end == 'm' || *end == 'M' ) ) { budget <<= 20; ++end; }
+		else if ( end && ( *end == 'g' || *end == 'G' ) ) { budget <<= 30; ++end; }
+
+		if ( size.empty() || ! isdigit( size[0] ) || ! end || *end || budget < minsortmemory )
+			return ( errnotify( EOPTION, "--memory " + size ) );
+
+		if ( ! sortuserdb( list, datafile, budget ) ) return ( errnotify( EUSERDB ) );
+
+		if ( options.count( "verbose" ) && m == reply ) reportcleared( list );
+		return ( EOK );
+	}
+
+	errstate err = loadconcurrent( list, datafile );
+	if ( err != EOK ) return ( errnotify( err ) );
+	if ( ! writeaperdb( list ) ) return ( errnotify( EWAPERDB ) ); 
+
+	if ( options.count( "verbose" ) && m == reply ) reportcleared( list );
+
+	return ( EOK );
+}
+
+#endif
+
+/////////////////////////////////////////////////////
+//      errnotify                                  //
+/////////////////////////////////////////////////////
+
+errstate errnotify( errstate err, std::string extrainfo, linenum_type line )
+{
+	std::string msg = errmessage( err );
+
+	if ( ! extrainfo.empty() )
+		msg += ": " + extrainfo;
+
+	if ( line > 0 )
+		std::cerr << "\tline " << line << ": ";
+
+	std::cerr << msg << std::endl;
+
+	return ( err );
+}
+
+/////////////////////////////////////////////////////
+//      errmessage                                 //
+/////////////////////////////////////////////////////
+
+const char *errmessage( errstate err )
+{
+	const char *msg;
+
+	switch ( err )
+	{
+		case EUSE:
+			msg =
+				"Add bulk to Anti Phishing Email Reply list data\n" \
+				"use: aper [-z gzip|zstd|none] list [file]\n" \
+				"     aper diff list old new [delta]\n" \
+				"     aper federate list file file ... [--min-sources K]\n" \
+				"     aper merkle list [--depth N]\n" \
+				"     aper sync list dir | --via command\n" \
+				"     aper sync list --serve\n" \
+				"     aper patch list [delta]\n" \
+				"     aper prune list --older-than days [--write]\n" \
+				"     aper export list --since YYYYMMDD [--until YYYYMMDD]\n" \
+				"     aper query list [key ...]\n" \
+				"     aper query reply --variants [address ...]\n" \
+				"     aper canonicalize links [--write]\n" \
+				"     aper export [list] --columnar file [--since YYYYMMDD] [--until YYYYMMDD]\n" \
+				"     aper submit list [file]\n" \
+				"     aper ingest list\n" \
+				"     aper list --reject rejfile [--max-errors ratio] [file]\n" \
+				"     aper list --memory size [file]\n" \
+				"     aper reply --verbose [file]\n" \
+				"     aper shard list [--shards N] [--by hash|domain]\n" \
+				"     aper unshard list [--write | file]\n" \
+				"     aper watch conffile [--debounce ms]\n" \
+				"     aper publish snapshot\n" \
+				"     aper dnsbl zone [--port N] [--listen address] [--debounce ms]\n" \
+				"     aper tabled [--listen address|path] [--port N] [--max-age days]\n" \
+				"                 [--action text] [--debounce ms]\n" \
+				"     aper spamassassin [--since YYYYMMDD] [--max-rule bytes] [--check] [file]\n" \
+				"     aper stats [list] [--top N] [--json]\n" \
+				"\t'list' reply | cleared | links\n" \
+				"\t'file' data to add, read stdin if not specified\n" \
+				"\t'delta' changes between lists, stdout/stdin if not specified";
+			break;
+
+		case EFILE:		msg = "Cannot open new data file"; break;
+		case ERFILE:	msg = "Cannot open reply address file"; break;
+		case ECFILE:	msg = "Cannot open cleared address file"; break;
+		case EXFILE:	msg = "Cannot open temporary file"; break;
+		case EXFILERM:	msg = "Cannot remove temporary file"; break;
+		case EATYPE:	msg = "Bad record type"; break;
+		case EADDRESS:	msg = "Bad address format"; break;
+		case EDATE:		msg = "Bad date format"; break;
+		case EAPERDB:	msg = "Cannot load APER database"; break;
+		case EUSERDB:	msg = "Cannot load user database"; break;
+		case EWAPERDB:	msg = "Cannot write APER database"; break;
+		case ELFILE:	msg = "Cannot open links file"; break;
+		case ESORT:		msg = "List is not sorted"; break;
+		case EDELTA:	msg = "Bad delta record"; break;
+		case EDIFF:		msg = "Cannot diff lists"; break;
+		case EPATCH:	msg = "Cannot patch list"; break;
+		case ECODEC:	msg = "Compression not supported by this build"; break;
+		case EDECODE:	msg = "Cannot decode compressed data"; break;
+		case EENCODE:	msg = "Cannot write compressed data"; break;
+		case EOPTION:	msg = "Bad option value"; break;
+		case ELOCK:		msg = "Cannot lock list"; break;
+		case ESPOOL:	msg = "Cannot use spool directory"; break;
+		case EREJECT:	msg = "Too many bad entries, batch refused"; break;
+		case ENOENTRY:	msg = "No such entry"; break;
+		case ESHARD:	msg = "Bad sharded list"; break;
+		case EWATCH:	msg = "Cannot watch lists"; break;
+		case ERUN:		msg = "Output command failed"; break;
+		case ESNAPSHOT:	msg = "Bad snapshot"; break;
+		case EDNSBL:	msg = "Cannot serve DNS blocklist"; break;
+		case ETABLED:	msg = "Cannot serve table lookups"; break;
+		case ESARULES:	msg = "Cannot write SpamAssassin rules"; break;
+		case ECOLUMNAR:	msg = "Cannot write columnar export"; break;
+		case EFEDERATE:	msg = "Cannot federate lists"; break;
+		case ESYNC:		msg = "Cannot sync list"; break;
+		case ECANONICAL:	msg = "Link not canonical, run aper canonicalize links --write"; break;
+
+		case EUNKNOWN:
+		default:		msg = "Unknown error state"; break;
+	}
+
+	return ( msg );
+}
+
+/////////////////////////////////////////////////////
+//      loadaperdb                                 //
+/////////////////////////////////////////////////////
+
+bool loadaperdb( APERlist &l )
+{
+	switch ( l.mode )
+	{
+		case reply:
+		{
+			if ( ! loadlistfile( l, replyfile, loadaperreply, ERFILE ) ) return ( false );
+			bool ok = loadlistfile( l, replyclearedfile, setapercleared, ECFILE );
+			finishcleared( l );
+			return ( ok );
+		}
+
+		case links:		return ( loadlistfile( l, linksfile, loadaperlinks, ELFILE ) );
+		case cleared:	return ( loadlistfile( l, replyclearedfile, loadapercleared, ECFILE ) );
+		default:		return ( false );
+	}
+}
+
+/////////////////////////////////////////////////////
+//      loadlistfile                               //
+/////////////////////////////////////////////////////
+// run one of the loaders over a list file in the list's directory, or
+// over its shards if it has been sharded.  only the list's own file
+// sets how the list is written back.
+
+bool loadlistfile( APERlist &l, const std::string &name, bool ( *load )( APERlist &, std::istream * ), errstate err )
+{
+	std::string file = l.path( name );
+	bool own = ( name == l.name() );
+
+	if ( issharded( file ) )
+	{
+		datamode m = ( name == replyclearedfile ) ? cleared : l.mode;
+		std::string dir = file + shardsuffix;
+
+		APERshards sh;
+		if ( ! readmanifest( dir, sh, own ? &l.comments : 0 ) ) return ( false );
+
+		APERdb::Nodes v;
+		codec format;
+		bool ok = loadshards( m, dir, sh, v, format );
+
+		for ( APERdb::Nodes::iterator itr = v.begin(); itr != v.end(); ++itr )
+		{
+			if ( ok && own )
+			{
+				if ( l.db.insert( *itr ) == *itr ) continue;
+				ok = false;
+				errnotify( ESHARD, "duplicate " + (*itr)->address() );
+			}
+			else if ( ok )
+				ok = clearreply( l, (*itr)->address(), (*itr)->date() );
+
+			delete *itr;
+		}
+
+		if ( own ) { l.shards = sh; l.listcodec = format; }
+
+		return ( ok );
+	}
+
+	APERinput ifs;
+	if ( ! ifs.open( file ) ) { errnotify( err, file ); return ( false ); }
+
+	bool status = load( l, &ifs.stream() );
+	status = ifs.close() && status;
+	if ( own ) l.listcodec = ifs.format();
+
+	return ( status );
+}
+
+/////////////////////////////////////////////////////
+//      loadaperreply                              //
+/////////////////////////////////////////////////////
+
+bool loadaperreply( APERlist &l, std::istream *f )
+{
+	std::string s;
+	linenum_type line = 0;
+
+	l.order.clear();
+	l.ordered = ( l.db.size() == 0 );
+
+	while ( getline( *f, s ) )
+	{
+		++line;
+		trimspace( s, ENDS );
+		if ( s.empty() ) continue;
+
+		if ( s[0] == tokcomment )
+			l.comments.push_back( s );
+		else
+			break;
+	}
+
+	if ( f->good() )
+	{
+		do
+		{
+			if ( s[0] == tokcomment ) continue;
+
+			trimspace( s, ENDS );
+			if ( s.empty() ) continue;
+
+			std::string address, addrt, date;
+
+			std::istringstream iss( split( s ) );
+				iss >> address >> addrt >> date;
+
+			APERreply *node = new (std::nothrow) APERreply;
+
+			errstate err = ( node ) ? EOK : EMEM;
+			if ( err == EOK && ! node->isvalidaddress( address ) )
+				err = errnotify( EADDRESS, address, line );
+			if ( err == EOK && ! node->isvalidaddrtype( addrt ) )
+				err = errnotify( EATYPE, addrt, line );
+			if ( err == EOK && ! node->isvaliddate( date ) )
+				err = errnotify( EDATE, date, line );
+
+			if ( err != EOK )
+			{
+				delete node;
+				return ( false );
+			}
+
+			address = tolowercase( address );
+			node->address( address );
+			node->addrtype( addrt );
+			node->date( date );
+
+			APERnode *n = l.db.insert( node );
+
+			if ( n != node )
+			{
+				delete node;
+				l.ordered = false;
+	
+				if ( ! n->isnewer( date ) )
+					l.db.redate( n, date );
+
+				APERreply *p = dynamic_cast<APERreply *>( n );
+				if ( p->addrtype() != addrt ) p->addrtype( addrt );
+			}
+			else if ( l.ordered )
+			{
+				if ( l.order.empty() || l.order.back()->address() < address )
+					l.order.push_back( node );
+				else
+					l.ordered = false;
+			}
+		}
+		while ( ++line, getline( *f, s ) );
+	}
+
+	if ( ! l.ordered ) l.order.clear();
+
+	return ( true );
+}
+
+// apply one cleared entry for setapercleared(), walking the reply
+// entries along with the cleared ones while both are in order.  join
+// is cleared, and lookups used instead, once either is out of order.
+
+static void joincleared( APERlist &l, bool &join, std::string &last, APERdb::Nodes::iterator &r,
+	const std::string &address, const std::string &date )
+{
+	if ( join && address < last ) join = false;
+	last = address;
+
+	APERnode *n = 0;
+
+	if ( join )
+	{
+		while ( r != l.order.end() && (*r)->address() < address ) ++r;
+		if ( r != l.order.end() && (*r)->address() == address ) n = *r;
+	}
+	else
+		n = l.db.find( address );
+
+	applycleared( l, n, address, date );
+}
+
+/////////////////////////////////////////////////////
+//      setapercleared                             //
+/////////////////////////////////////////////////////
+// this is a little different from loadapercleared() in that this simply
+// sets the cleared flag.  this should be called after loadaperreply().
+// both lists are sorted, so they are walked together, one pass over
+// each with no lookups.  if either turns out not to be in order the
+// rest of the cleared entries are looked up instead.
+
+bool setapercleared( APERlist &l, std::istream *f )
+{
+	std::string s, address, date, last;
+	linenum_type line = 0;
+	APERreply v;
+	bool join = l.ordered;
+	APERdb::Nodes::iterator r = l.order.begin();
+
+	while ( getline( *f, s ) )
+	{
+		++line;
+		trimspace( s, ENDS );
+		if ( s.empty() ) continue;
+		if ( s[0] == tokcomment ) continue;
+
+		std::istringstream iss( split( s ) );
+		iss >> address >> date;
+
+		if ( ! v.isvalidaddress( address ) ) { errnotify( EADDRESS, address, line ); return ( false ); }
+		if ( ! v.isvaliddate( date ) ) { errnotify( EDATE, date, line ); return ( false ); }
+
+		address = tolowercase( address );
+
+		joincleared( l, join, last, r, address, date );
+	}
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      mergecleared                               //
+/////////////////////////////////////////////////////
+// apply cleared entries read ahead of time, in the order they were
+// read, as setapercleared() would have.
+
+void mergecleared( APERlist &l, const std::vector<APERrecord> &v )
+{
+	std::string last;
+	bool join = l.ordered;
+	APERdb::Nodes::iterator r = l.order.begin();
+
+	for ( std::vector<APERrecord>::const_iterator itr = v.begin(); itr != v.end(); ++itr )
+		joincleared( l, join, last, r, itr->address, itr->date );
+}
+
+/////////////////////////////////////////////////////
+//      clearreply                                 //
+/////////////////////////////////////////////////////
+// mark a reply entry cleared as of date, looking it up.
+
+bool clearreply( APERlist &l, const std::string &address, const std::string &date )
+{
+	applycleared( l, l.db.find( address ), address, date );
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      applycleared                               //
+/////////////////////////////////////////////////////
+// apply one cleared entry to reply entry n.  a reply seen after it was
+// cleared stays listed, and isn't counted as re-activated: only new
+// entries re-activate.  addresses that were never listed are kept
+// aside, so that listing one later with an older date leaves it
+// cleared.
+
+void applycleared( APERlist &l, APERnode *n, const std::string &address, const std::string &date )
+{
+	if ( n == 0 )
+	{
+		l.unlisted.push_back( APERrecord() );
+		l.unlisted.back().address = address;
+		l.unlisted.back().date = date;
+		return;
+	}
+
+	APERreply *p = dynamic_cast<APERreply *>( n );
+
+	if ( p->iscleared() )
+	{
+		if ( ! p->isnewer( date ) ) l.db.redate( p, date );
+		return;
+	}
+
+	if ( p->isnewer( date ) ) return;
+
+	l.touch( address );
+	p->clear();
+	l.db.redate( p, date );
+	++l.clearstats.cleared;
+}
+
+/////////////////////////////////////////////////////
+//      finishcleared                              //
+/////////////////////////////////////////////////////
+// once the cleared list is in, put the never listed entries in order,
+// one per address with its latest date.
+
+void finishcleared( APERlist &l )
+{
+	std::vector<APERrecord> &v = l.unlisted;
+
+	l.order.clear();
+	l.ordered = false;
+
+	for ( std::size_t i = 1; i < v.size(); ++i )
+	{
+		if ( recordless( v[ i ], v[ i - 1 ] ) )
+		{
+			std::stable_sort( v.begin(), v.end(), recordless );
+			break;
+		}
+	}
+
+	std::size_t j = 0;
+
+	for ( std::size_t i = 0; i < v.size(); ++i )
+	{
+		if ( j > 0 && v[ j - 1 ].address == v[ i ].address )
+		{
+			if ( v[ j - 1 ].date < v[ i ].date ) v[ j - 1 ].date = v[ i ].date;
+			continue;
+		}
+
+		if ( i != j ) v[ j ] = v[ i ];
+		++j;
+	}
+
+	v.resize( j );
+}
+
+bool recordless( const APERrecord &a, const APERrecord &b )
+{
+	return ( a.address < b.address );
+}
+
+/////////////////////////////////////////////////////
+//      reportcleared                              //
+/////////////////////////////////////////////////////
+
+// the never listed addresses the new entries listed are in the table
+// now, so they aren't counted.
+
+void reportcleared( const APERlist &l )
+{
+	std::size_t unlisted = 0;
+
+	for ( std::vector<APERrecord>::const_iterator itr = l.unlisted.begin(); itr != l.unlisted.end(); ++itr )
+		if ( l.db.find( itr->address ) == 0 ) ++unlisted;
+
+	std::cerr << listname( l.mode ) << ": "
+		<< l.clearstats.cleared << " cleared, "
+		<< l.clearstats.reactivated << " re-activated, "
+		<< unlisted << " cleared but never listed" << std::endl;
+}
+
+/////////////////////////////////////////////////////
+//      loadapercleared                            //
+/////////////////////////////////////////////////////
+
+bool loadapercleared( APERlist &l, std::istream *f )
+{
+	std::string s;
+	linenum_type line = 0;
+
+	while ( getline( *f, s ) )
+	{
+		++line;
+		trimspace( s, ENDS );
+		if ( s.empty() ) continue;
+
+		if ( s[0] == tokcomment )
+			l.comments.push_back( s );
+		else
+			break;
+	}
+
+	if ( f->good() )
+	{
+		do
+		{
+			if ( s[0] == tokcomment ) continue;
+
+			trimspace( s, ENDS );
+			if ( s.empty() ) continue;
+
+			std::string address, date;
+
+			std::istringstream iss( split( s ) );
+			iss >> address >> date;
+
+			APERcleared *node = new (std::nothrow) APERcleared;
+
+			errstate err = ( node ) ? EOK : EMEM;
+			if ( err == EOK && ! node->isvalidaddress( address ) )
+				err = errnotify( EADDRESS, address, line );
+			if ( err == EOK && ! node->isvaliddate( date ) )
+				err = errnotify( EDATE, date, line );
+
+			if ( err != EOK )
+			{
+				delete node;
+				return ( false );
+			}
+
+			address = tolowercase( address );
+			node->address( address );
+			node->date( date );
+
+			APERnode *n = l.db.insert( node );
+
+			if ( n != node )
+			{
+				delete node;
+
+				if ( ! n->isnewer( date ) )
+					l.db.redate( n, date );
+			}
+		}
+		while ( ++line, getline( *f, s ) );
+	}
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      loadaperlinks                              //
+/////////////////////////////////////////////////////
+// keys are canonicalized as they're read, and entries that turn out to
+// be the same page merged as new ones would be.
+
+bool loadaperlinks( APERlist &l, std::istream *f )
+{
+	std::string s;
+	linenum_type line = 0;
+
+	while ( getline( *f, s ) )
+	{
+		++line;
+		trimspace( s, ENDS );
+		if ( s.empty() ) continue;
+
+		if ( s[0] == tokcomment )
+			l.comments.push_back( s );
+		else
+			break;
+	}
+
+	if ( f->good() )
+	{
+		do
+		{
+			if ( s[0] == tokcomment ) continue;
+
+			trimspace( s, ENDS );
+			if ( s.empty() ) continue;
+
+			std::string address, date;
+
+			std::istringstream iss( split( s ) );
+			iss >> address >> date;
+
+			APERlinks *node = new (std::nothrow) APERlinks;
+			errstate err = EOK;
+
+			if ( node )
+			{
+				address = node->cleanup( address );
+			}
+			else
+			{
+				err = EMEM;
+			}
+
+			if ( err == EOK && ! node->isvalidaddress( address ) )
+				err = errnotify( EADDRESS, address, line );
+			if ( err == EOK && ! node->isvaliddate( date ) )
+				err = errnotify( EDATE, date, line );
+
+			if ( err != EOK )
+			{
+				delete node;
+				return ( false );
+			}
+
+			node->address( address );
+			node->date( date );
+
+			APERnode *n = l.db.insert( node );
+
+			if ( n != node )
+			{
+				delete node;
+
+				if ( ! n->isnewer( date ) )
+					l.db.redate( n, date );
+			}
+		}
+		while ( ++line, getline( *f, s ) );
+	}
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      loadconcurrent                             //
+/////////////////////////////////////////////////////
+// load the list and merge the new entries into it.  the list, the
+// cleared list for reply and the new entries are each read on a thread
+// of their own into a place of their own, then merged as they always
+// have been: the list, the cleared list, then the new entries in the
+// order given.  the list comes out the same, just sooner when reading
+// is slow.  gives EAPERDB or EUSERDB for what failed.
+
+struct ConcurrentLoad
+{
+	APERlist *list;
+	APERlist *cleared;		// reply: the cleared entries, all unlisted
+	APERstage *stage;
+	char ok[ 3 ];
+};
+
+static void concurrentjob( std::size_t i, void *arg )
+{
+	ConcurrentLoad &j = *static_cast<ConcurrentLoad *>( arg );
+	APERlist &l = *j.list;
+
+	switch ( i )
+	{
+		case 0:
+			j.ok[ i ] = stageuserfile( l, *j.stage );
+			break;
+
+		case 1:
+			switch ( l.mode )
+			{
+				case reply:	j.ok[ i ] = loadlistfile( l, replyfile, loadaperreply, ERFILE ); break;
+				case links:	j.ok[ i ] = loadlistfile( l, linksfile, loadaperlinks, ELFILE ); break;
+				default:	j.ok[ i ] = loadlistfile( l, replyclearedfile, loadapercleared, ECFILE ); break;
+			}
+			break;
+
+// against a list with no entries, every cleared entry is kept aside
+// in unlisted, in the order read.
+
+		default:
+			j.ok[ i ] = loadlistfile( *j.cleared, replyclearedfile, setapercleared, ECFILE );
+			break;
+	}
+}
+
+errstate loadconcurrent( APERlist &l, std::string datafile )
+{
+	APERlist c( reply, l.dir );
+	APERstage st;
+	st.file = datafile;
+
+	ConcurrentLoad job = { &l, &c, &st, { 0, 0, 0 } };
+	parallelfor( l.mode == reply ? 3 : 2, concurrentjob, &job );
+
+	if ( ! job.ok[ 1 ] || ( l.mode == reply && ! job.ok[ 2 ] ) ) return ( EAPERDB );
+
+	if ( l.mode == reply )
+	{
+		mergecleared( l, c.unlisted );
+		finishcleared( l );
+	}
+
+	if ( ! job.ok[ 0 ] )
+	{
+		errnotify( st.err, st.errinfo, st.errline );
+		return ( EUSERDB );
+	}
+
+	if ( l.rejects && ! acceptstage( l, st ) ) return ( EUSERDB );
+
+	for ( std::vector<APERrecord>::iterator r = st.records.begin(); r != st.records.end(); ++r )
+	{
+		if ( ! mergeuserrecord( l, *r ) )
+		{
+			errnotify( EMEM, r->address );
+			return ( EUSERDB );
+		}
+	}
+
+	return ( EOK );
+}
+
+/////////////////////////////////////////////////////
+//      userline                                   //
+/////////////////////////////////////////////////////
+// tidy up a line of new entries.  false if there's nothing in it.
+// each list has always been a little different in what it forgives.
+
+bool userline( datamode m, std::string &s )
+{
+	if ( m == reply ) trimspace( s, ALL );
+	if ( m == cleared ) trimspace( s, ENDS );
+
+	if ( s.empty() ) return ( false );
+	if ( s[0] == tokcomment ) return ( false );
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      mergeuserrecord                            //
+/////////////////////////////////////////////////////
+// add a new entry to the list.  new dates win, reply types accumulate,
+// and a reply seen after it was cleared is listed again.
+
+bool mergeuserrecord( APERlist &l, const APERrecord &r )
+{
+	APERnode *node = 0;
+
+	switch ( l.mode )
+	{
+		case reply:		node = new (std::nothrow) APERreply; break;
+		case links:		node = new (std::nothrow) APERlinks; break;
+		default:		node = new (std::nothrow) APERcleared; break;
+	}
+
+	if ( node == 0 ) return ( false );
+
+	node->address( r.address );
+	node->date( r.date );
+
+	if ( l.mode != reply )
+	{
+		APERnode *n = l.db.insert( node );
+
+		if ( n != node )
+		{
+			delete node;
+
+			if ( ! n->isnewer( r.date ) && n->date() != r.date )
+			{
+				l.db.redate( n, r.date );
+				l.touch( r.address );
+			}
+		}
+		else
+			l.touch( r.address );
+
+		return ( true );
+	}
+
+	dynamic_cast<APERreply *>( node )->addrtype( r.addrt );
+
+	APERnode *n = l.db.insert( node );
+
+	if ( n != node )
+	{
+		APERreply *p = dynamic_cast<APERreply *>( n );
+
+		if ( node->isnewer( p->date() ) )
+		{
+			if ( p->iscleared() ) { p->unclear(); ++l.clearstats.reactivated; }
+			l.db.redate( p, r.date );
+			l.touch( r.address );
+		}
+
+		if ( p->addrtype() != r.addrt )
+		{
+			p->addrtype( r.addrt );
+			l.touch( r.address );
+		}
+
+		delete node;
+	}
+	else
+	{
+		const APERrecord *c = l.findunlisted( r.address );
+
+		if ( c && ! node->isnewer( c->date ) )
+		{
+			dynamic_cast<APERreply *>( node )->clear();
+			l.db.redate( node, c->date );
+		}
+		else
+		{
+			if ( c ) ++l.clearstats.reactivated;
+			l.touch( r.address );
+		}
+	}
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      stageuserfile                              //
+/////////////////////////////////////////////////////
+// parse a file of new entries without touching the list, so that
+// several files can be read at once.  the first bad entry stops it,
+// unless bad entries are being rejected, in which case every line is
+// parsed and the bad ones set aside.
+
+struct StageLines
+{
+	datamode m;
+	std::vector<std::string> text;
+	std::vector<linenum_type> line;
+	std::vector<APERrecord> records;
+	std::vector<errstate> err;
+};
+
+const std::size_t stagechunk = 4096;	// lines parsed per job
+
+static void stagechunkjob( std::size_t i, void *arg )
+{
+	StageLines &sl = *static_cast<StageLines *>( arg );
+	std::size_t last = std::min( ( i + 1 ) * stagechunk, sl.text.size() );
+
+	for ( std::size_t k = i * stagechunk; k < last; ++k )
+	{
+		std::string s = sl.text[ k ];
+		userline( sl.m, s );
+		sl.err[ k ] = parserecord( sl.m, s, sl.records[ k ], false );
+	}
+}
+
+bool stageuserfile( const APERlist &l, APERstage &st )
+{
+	datamode m = l.mode;
+
+	st.records.clear();
+	st.rejects.clear();
+	st.entries = 0;
+	st.err = EOK;
+	st.errline = 0;
+
+	APERinput in;
+	if ( ! in.open( st.file ) )
+	{
+		st.err = EFILE;
+		st.errinfo = st.file.empty() ? "stdin" : st.file;
+		return ( false );
+	}
+
+	StageLines sl;
+	sl.m = m;
+
+	std::string s;
+	linenum_type line = 0;
+
+	while ( getline( in.stream(), s ) )
+	{
+		++line;
+
+		std::string t = s;
+		if ( ! userline( m, t ) ) continue;
+		++st.entries;
+
+		if ( l.rejects )
+		{
+			sl.text.push_back( s );
+			sl.line.push_back( line );
+			continue;
+		}
+
+		APERrecord r;
+
+		errstate err = parserecord( m, t, r, false );
+		if ( err != EOK )
+		{
+			st.err = err;
+			st.errline = line;
+			st.errinfo = ( err == EATYPE ) ? r.addrt : ( err == EDATE ) ? r.date : r.address;
+			break;
+		}
+
+		st.records.push_back( r );
+	}
+
+	if ( st.err != EOK && st.file.empty() )
+		in.stream().ignore( std::numeric_limits<int>::max() );
+
+	if ( ! in.close() && st.err == EOK )
+	{
+		st.err = EDECODE;
+		st.errinfo = st.file;
+	}
+
+	if ( ! l.rejects || st.err != EOK ) return ( st.err == EOK );
+
+	sl.records.resize( sl.text.size() );
+	sl.err.resize( sl.text.size() );
+
+	std::size_t chunks = ( sl.text.size() + stagechunk - 1 ) / stagechunk;
+
+	if ( numthreads( sl.text.size() ) > 1 )
+		parallelfor( chunks, stagechunkjob, &sl );
+	else
+		for ( std::size_t i = 0; i < chunks; ++i ) stagechunkjob( i, &sl );
+
+	st.records.reserve( sl.text.size() );
+
+	for ( std::size_t k = 0; k < sl.text.size(); ++k )
+	{
+		const APERrecord &r = sl.records[ k ];
+
+		if ( sl.err[ k ] == EOK )
+		{
+			st.records.push_back( r );
+			continue;
+		}
+
+		APERreject rj;
+		rj.line = sl.line[ k ];
+		rj.err = sl.err[ k ];
+		rj.info = ( rj.err == EATYPE ) ? r.addrt : ( rj.err == EDATE ) ? r.date : r.address;
+		rj.text = sl.text[ k ];
+		st.rejects.push_back( rj );
+	}
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      acceptstage                                //
+/////////////////////////////////////////////////////
+// write out the entries a stage rejected, and decide if there were
+// few enough of them to go ahead with the rest.
+
+bool acceptstage( const APERlist &l, const APERstage &st )
+{
+	std::ostream &rejects = *l.rejects;
+	std::string source = st.file.empty() ? "stdin" : st.file;
+
+	for ( std::vector<APERreject>::const_iterator itr = st.rejects.begin(); itr != st.rejects.end(); ++itr )
+	{
+		rejects << source << ':' << itr->line << '\t' << errmessage( itr->err );
+		if ( ! itr->info.empty() ) rejects << ": " << itr->info;
+		rejects << '\t' << itr->text << '\n';
+	}
+
+	rejects.flush();
+
+	if ( st.rejects.size() > l.maxerrors * st.entries )
+	{
+		std::ostringstream oss;
+		oss << source << ", " << st.rejects.size() << " of " << st.entries;
+		errnotify( EREJECT, oss.str() );
+		return ( false );
+	}
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      sortuserdb                                 //
+/////////////////////////////////////////////////////
+// merge new entries into the list without holding either in memory.
+// the new entries are read in batches that fit in budget bytes, give
+// or take, each sorted, combined by address and spilled to a run file
+// in tmpdir.  the runs are then merged, a few at a time if there are
+// many, and finally merged with the list file as it's rewritten.  the
+// list must be a single sorted file.  a reply list's cleared list is
+// loaded as usual.
+
+// run files open for merging.
+
+struct RunFiles
+{
+	~RunFiles( void ) { close(); }
+
+	bool open( datamode m, const std::vector<std::string> &names, errstate err = EXFILE );
+	bool close( void );
+
+	std::vector<APERinput *> in;
+	std::vector<APERrecords *> records;
+};
+
+bool RunFiles::open( datamode m, const std::vector<std::string> &names, errstate err )
+{
+	for ( std::vector<std::string>::const_iterator itr = names.begin(); itr != names.end(); ++itr )
+	{
+		in.push_back( new (std::nothrow) APERinput );
+		if ( in.back() == 0 || ! in.back()->open( *itr ) ) { errnotify( err, *itr ); return ( false ); }
+
+		records.push_back( new (std::nothrow) APERfilerecords( &in.back()->stream(), m, *itr ) );
+		if ( records.back() == 0 ) { errnotify( EMEM, *itr ); return ( false ); }
+	}
+
+	return ( true );
+}
+
+bool RunFiles::close( void )
+{
+	bool ok = true;
+
+	for ( std::size_t i = 0; i < in.size(); ++i )
+	{
+		if ( in[ i ] ) ok = in[ i ]->close() && ok;
+		delete in[ i ];
+	}
+
+	for ( std::size_t i = 0; i < records.size(); ++i ) delete records[ i ];
+
+	in.clear();
+	records.clear();
+
+	return ( ok );
+}
+
+static void removeruns( const std::vector<std::string> &runs )
+{
+	for ( std::vector<std::string>::const_iterator itr = runs.begin(); itr != runs.end(); ++itr )
+		if ( unlink( itr->c_str() ) != 0 ) errnotify( EXFILERM, *itr );
+}
+
+// write records to a new run file in tmpdir.
+
+static bool writerun( datamode m, APERrecords &src, std::vector<std::string> &runs )
+{
+	const char *tmpfile = tempnam( tmpdir, tmpprefix );
+
+	APERoutput out;
+	if ( ! out.open( tmpfile, plain ) ) { errnotify( EXFILE, tmpfile ); return ( false ); }
+
+	runs.push_back( tmpfile );
+
+	APERrecord r;
+	while ( src.next( r ) ) out.stream() << formatrecord( m, r ) << '\n';
+
+	if ( ! out.close() ) { errnotify( EXFILE, tmpfile ); return ( false ); }
+
+	return ( src.ok() );
+}
+
+// sort a batch of new entries, combine each address's and spill them.
+
+static bool spillrun( datamode m, std::vector<APERrecord> &v, std::vector<std::string> &runs )
+{
+	std::sort( v.begin(), v.end(), recordless );
+
+	std::size_t j = 0;
+
+	for ( std::size_t i = 0; i < v.size(); ++i )
+	{
+		if ( j > 0 && v[ j - 1 ].address == v[ i ].address )
+		{
+			combinerecord( m, v[ j - 1 ], v[ i ] );
+			continue;
+		}
+
+		if ( i != j ) v[ j ] = v[ i ];
+		++j;
+	}
+
+	v.resize( j );
+
+	APERvectorrecords src( v );
+	bool ok = writerun( m, src, runs );
+
+	v.clear();
+
+	return ( ok );
+}
+
+// read the new entries into runs.  bad entries stop it, or with
+// rejects are set aside as loadconcurrent() does.
+
+static bool spilluserdb( APERlist &l, const std::string &datafile, std::size_t budget, std::vector<std::string> &runs )
+{
+	datamode m = l.mode;
+
+	APERinput in;
+	if ( ! in.open( datafile ) ) { errnotify( EFILE, datafile.empty() ? "stdin" : datafile ); return ( false ); }
+
+	APERstage st;
+	st.file = datafile;
+	st.entries = 0;
+
+	std::vector<APERrecord> v;
+	v.reserve( budget / 4 / sizeof( APERrecord ) );
+
+	std::size_t used = 0;
+	std::string s;
+	linenum_type line = 0;
+	bool ok = true;
+
+	while ( ok && getline( in.stream(), s ) )
+	{
+		++line;
+
+		std::string t = s;
+		if ( ! userline( m, t ) ) continue;
+		++st.entries;
+
+		APERrecord r;
+
+		errstate err = parserecord( m, t, r, false );
+		if ( err != EOK )
+		{
+			if ( ! l.rejects ) { recorderror( err, r, line ); ok = false; break; }
+
+			APERreject rj;
+			rj.line = line;
+			rj.err = err;
+			rj.info = ( err == EATYPE ) ? r.addrt : ( err == EDATE ) ? r.date : r.address;
+			rj.text = s;
+			st.rejects.push_back( rj );
+			continue;
+		}
+
+// the batch is full once its array is or its strings, roughly counted
+// with their allocation overhead, have taken half the budget.
+
+		if ( v.size() == v.capacity() || used > budget / 2 )
+		{
+			ok = spillrun( m, v, runs );
+			used = 0;
+		}
+
+		used += r.address.size() + r.addrt.size() + r.date.size() + 3 * sortstringoverhead;
+		v.push_back( r );
+	}
+
+	if ( datafile.empty() ) in.stream().ignore( std::numeric_limits<int>::max() );
+
+	ok = in.close() && ok;
+
+	if ( ok && ! v.empty() ) ok = spillrun( m, v, runs );
+	if ( ok && l.rejects ) ok = acceptstage( l, st );
+
+	return ( ok );
+}
+
+// merge-join the combined new entries with the list file and write the
+// list.  in reply mode the cleared list is joined too, with the rules
+// loadaperdb() and mergeuserrecord() apply.
+
+static bool writesorted( APERlist &l, APERrecords &n )
+{
+	datamode m = l.mode;
+	std::string file = l.file();
+
+	APERlist c( cleared, l.dir );
+	APERdb::Nodes cn;
+
+	if ( m == reply )
+	{
+		if ( ! loadaperdb( c ) ) return ( false );
+		c.db.sorted( cn );
+	}
+
+	APERinput base;
+	if ( ! base.open( file ) ) { errnotify( m == links ? ELFILE : m == cleared ? ECFILE : ERFILE, file ); return ( false ); }
+
+	std::istream &bf = base.stream();
+	std::string s;
+
+	while ( bf.peek() == tokcomment || bf.peek() == '\n' )
+	{
+		getline( bf, s );
+		trimspace( s, ENDS );
+		if ( ! s.empty() ) l.comments.push_back( s );
+	}
+
+	l.listcodec = base.format();
+
+	const char *tmpfile = tempnam( dirof( file ).c_str(), tmpprefix );
+
+	APERoutput out;
+	if ( ! out.open( tmpfile, l.outcodec == keep ? l.listcodec : l.outcodec ) )
+	{
+		errnotify( EXFILE, tmpfile );
+		return ( false );
+	}
+
+	out.compare( file );
+
+	std::ostream &f = out.stream();
+
+	for ( Comments::iterator itr = l.comments.begin(); itr != l.comments.end(); ++itr )
+		f << *itr << '\n';
+
+	APERfilerecords o( &bf, m, file );
+	APERrecord ro, rn;
+	bool haveo = o.next( ro );
+	bool haven = n.next( rn );
+	std::size_t ci = 0;
+
+	while ( o.ok() && n.ok() && ( haveo || haven ) )
+	{
+		bool listed = haveo && ( ! haven || ! ( rn.address < ro.address ) );
+		bool added = haven && ( ! haveo || ! ( ro.address < rn.address ) );
+
+		APERrecord r = listed ? ro : rn;
+		if ( listed && added ) combinerecord( m, r, rn );
+
+		bool show = true;
+
+		for ( ; ci < cn.size() && cn[ ci ]->address() <= r.address; ++ci )
+		{
+			const std::string &date = cn[ ci ]->date();
+
+			if ( cn[ ci ]->address() < r.address )
+			{
+				l.unlisted.push_back( APERrecord() );
+				l.unlisted.back().address = cn[ ci ]->address();
+				l.unlisted.back().date = date;
+			}
+
+			if ( cn[ ci ]->address() < r.address ) continue;
+
+// a listed entry is cleared unless it was seen after it was cleared,
+// and either way is listed again if the new entries saw it later.
+// only the latter counts as re-activated.
+
+			bool iscleared = true;
+
+			if ( listed )
+			{
+				iscleared = ! ( ro.date > date );
+				if ( iscleared ) ++l.clearstats.cleared;
+			}
+
+			if ( iscleared && added && rn.date > date )
+			{
+				iscleared = false;
+				++l.clearstats.reactivated;
+			}
+
+			show = ! iscleared;
+		}
+
+		if ( show ) f << formatrecord( m, r ) << '\n';
+
+		if ( listed ) haveo = o.next( ro );
+		if ( added ) haven = n.next( rn );
+	}
+
+	for ( ; ci < cn.size(); ++ci )
+	{
+		l.unlisted.push_back( APERrecord() );
+		l.unlisted.back().address = cn[ ci ]->address();
+		l.unlisted.back().date = cn[ ci ]->date();
+	}
+
+	bool ok = o.ok() && n.ok();
+	ok = base.close() && ok;
+	ok = out.close() && ok;
+
+	if ( ! ok )
+	{
+		errnotify( EWAPERDB, file );
+		if ( unlink( tmpfile ) != 0 ) errnotify( EXFILERM, tmpfile );
+		return ( false );
+	}
+
+	return ( commitaperfile( tmpfile, file, out.unchanged() ) );
+}
+
+bool sortuserdb( APERlist &l, std::string datafile, std::size_t budget )
+{
+	datamode m = l.mode;
+
+	if ( issharded( l.file() ) ) { errnotify( ESHARD, "--memory needs a single file list: " + l.file() ); return ( false ); }
+
+	std::vector<std::string> runs;
+	bool ok = spilluserdb( l, datafile, budget, runs );
+
+// every open run has its own read buffers, so the budget also bounds
+// how many are merged at once.
+
+	std::size_t fanin = std::max<std::size_t>( 2, std::min<std::size_t>( sortfanin, budget / ( 4 * inputblock ) ) );
+
+	while ( ok && runs.size() > fanin )
+	{
+		std::vector<std::string> some( runs.begin(), runs.begin() + fanin );
+		runs.erase( runs.begin(), runs.begin() + fanin );
+
+		RunFiles rf;
+		ok = rf.open( m, some );
+
+		if ( ok )
+		{
+			APERmergedrecords src( m, rf.records );
+			ok = writerun( m, src, runs );
+		}
+
+		ok = rf.close() && ok;
+		removeruns( some );
+	}
+
+	if ( ok )
+	{
+		RunFiles rf;
+		ok = rf.open( m, runs );
+
+		if ( ok )
+		{
+			APERmergedrecords src( m, rf.records );
+			ok = writesorted( l, src );
+		}
+
+		ok = rf.close() && ok;
+	}
+
+	removeruns( runs );
+
+	return ( ok );
+}
+
+/////////////////////////////////////////////////////
+//      federatelists                              //
+/////////////////////////////////////////////////////
+// merge copies of a list, as sortuserdb() merges its runs, and write
+// each entry with a bitmap of the copies it came from.  only the read
+// buffers and one record per copy are held.
+
+bool federatelists( datamode m, const std::vector<std::string> &files, unsigned int minsources )
+{
+	if ( files.size() > maxfederate ) { errnotify( EFEDERATE, "too many lists" ); return ( false ); }
+
+	RunFiles rf;
+	bool ok = rf.open( m, files, EFILE );
+
+	std::ostream &out = std::cout;
+
+	if ( ok )
+	{
+		out << tokcomment << " aper federate " << listname( m ) << '\n';
+
+		for ( std::size_t i = 0; i < files.size(); ++i )
+		{
+			char bit[ 17 ];
+			snprintf( bit, sizeof( bit ), "%llx", static_cast<unsigned long long>( 1 ) << i );
+			out << tokcomment << " source " << bit << ' ' << files[ i ] << '\n';
+		}
+
+		APERmergedrecords src( m, rf.records );
+		APERrecord r;
+
+		while ( src.next( r ) )
+		{
+			uint64_t from = src.sources();
+
+			unsigned int n = 0;
+			for ( uint64_t b = from; b != 0; b &= b - 1 ) ++n;
+			if ( n < minsources ) continue;
+
+			char bits[ 17 ];
+			snprintf( bits, sizeof( bits ), "%llx", static_cast<unsigned long long>( from ) );
+			out << formatrecord( m, r ) << '\t' << bits << '\n';
+		}
+
+		ok = src.ok();
+	}
+
+	ok = rf.close() && ok;
+
+	out.flush();
+	if ( ! out ) { errnotify( EFILE, "stdout" ); return ( false ); }
+
+	return ( ok );
+}
+
+/////////////////////////////////////////////////////
+//      combinerecord                              //
+/////////////////////////////////////////////////////
+// fold another record for the same address into r, as merging new data
+// does: the latest date wins and reply types accumulate.
+
+void combinerecord( datamode m, APERrecord &r, const APERrecord &n )
+{
+	if ( r.date < n.date ) r.date = n.date;
+
+	if ( m == reply && r.addrt != n.addrt )
+	{
+		APERreply p;
+		p.addrtype( r.addrt );
+		p.addrtype( n.addrt );
+		r.addrt = p.addrtype();
+	}
+}
+
+/////////////////////////////////////////////////////
+//      writeaperdb                                //
+/////////////////////////////////////////////////////
+
+bool writeaperdb( APERlist &l )
+{
+	if ( l.shards.count ) return ( writeshards( l, l.file() + shardsuffix ) );
+
+	return ( writelistfile( l, l.file() ) );
+}
+
+/////////////////////////////////////////////////////
+//      writelistfile                              //
+/////////////////////////////////////////////////////
+// write the whole list to one file, by way of a temporary file next to
+// it so the rename is atomic.
+
+bool writelistfile( APERlist &l, const std::string &file )
+{
+	const char *tmpfile = tempnam( dirof( file ).c_str(), tmpprefix );
+
+	APERoutput out;
+	if ( ! out.open( tmpfile, l.outcodec == keep ? l.listcodec : l.outcodec ) )
+	{
+		errnotify( EXFILE, tmpfile );
+		return ( false );
+	}
+
+	out.compare( file );
+
+	putlist( l, out.stream() );
+
+	if ( ! out.close() )
+	{
+		errnotify( EXFILE, tmpfile );
+		if ( unlink( tmpfile ) != 0 ) errnotify( EXFILERM, tmpfile );
+		return ( false );
+	}
+
+	return ( commitaperfile( tmpfile, file, out.unchanged() ) );
+}
+
+/////////////////////////////////////////////////////
+//      putlist                                    //
+/////////////////////////////////////////////////////
+// the list in its canonical single file form.
+
+void putlist( APERlist &l, std::ostream &f )
+{
+	for ( Comments::iterator itr = l.comments.begin(); itr != l.comments.end(); ++itr )
+		f << *itr << '\n';
+
+	APERdb::Nodes nodes;
+	l.db.sorted( nodes );
+
+	for ( APERdb::Nodes::iterator itr = nodes.begin(); itr != nodes.end(); ++itr )
+		(*itr)->write( f );
+}
+
+/////////////////////////////////////////////////////
+//      commitaperfile                             //
+/////////////////////////////////////////////////////
+// move a finished temporary file into place, once it's on disk, and
+// make the rename stick too.  an unchanged file is dropped instead, so
+// the one in place keeps its time and watchers don't see a change.
+
+bool commitaperfile( const char *tmpfile, const std::string &file, bool unchanged )
+{
+	if ( unchanged )
+	{
+		if ( unlink( tmpfile ) != 0 ) errnotify( EXFILERM, tmpfile );
+		return ( true );
+	}
+
+	int fd = open( tmpfile, O_RDONLY );
+	bool synced = ( fd >= 0 && fsync( fd ) == 0 );
+	if ( fd >= 0 ) close( fd );
+
+	if ( ! synced || rename( tmpfile, file.c_str() ) != 0 )
+	{
+		errnotify( EWAPERDB, file );
+		if ( unlink( tmpfile ) != 0 ) errnotify( EXFILERM, tmpfile );
+		return ( false );
+	}
+
+	std::string dir = dirof( file );
+
+	fd = open( dir.c_str(), O_RDONLY | O_DIRECTORY );
+	synced = ( fd >= 0 && fsync( fd ) == 0 );
+	if ( fd >= 0 ) close( fd );
+
+	if ( ! synced ) { errnotify( EWAPERDB, dir ); return ( false ); }
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      dirof                                      //
+/////////////////////////////////////////////////////
+// the directory a file is in, for temporary files that get renamed
+// over it.
+
+std::string dirof( const std::string &file )
+{
+	std::string::size_type p = file.rfind( '/' );
+
+	if ( p == std::string::npos ) return ( tmpdir );
+	if ( p == 0 ) return ( "/" );
+
+	return ( file.substr( 0, p ) );
+}
+
+/////////////////////////////////////////////////////
+//      listname                                   //
+/////////////////////////////////////////////////////
+// the name of a list as given on the command line.
+
+std::string listname( datamode m )
+{
+	switch ( m )
+	{
+		case links:		return ( "links" );
+		case cleared:	return ( "cleared" );
+		default:		return ( "reply" );
+	}
+}
+
+/////////////////////////////////////////////////////
+//      parserecord                                //
+/////////////////////////////////////////////////////
+// parse and normalize one line the way the loaders do, without building
+// a node.  the type is given in written form.  new links are
+// canonicalized.  a listed link, read from a list, a delta or a peer,
+// must already be: its order in the stream is by the key as written, so
+// a list that needs canonicalizing can't be streamed.
+
+errstate parserecord( datamode m, std::string s, APERrecord &r, bool listed )
+{
+	std::istringstream iss( split( s ) );
+
+	r.addrt.clear();
+
+	if ( m == reply )
+		iss >> r.address >> r.addrt >> r.date;
+	else
+		iss >> r.address >> r.date;
+
+	if ( m == links )
+	{
+		APERlinks n;
+		std::string key = n.cleanup( r.address );
+
+		if ( listed && key != r.address ) return ( ECANONICAL );
+		r.address = key;
+		if ( ! n.isvalidaddress( r.address ) ) return ( EADDRESS );
+	}
+	else
+	{
+		APERreply n;
+		if ( ! n.isvalidaddress( r.address ) ) return ( EADDRESS );
+		r.address = tolowercase( r.address );
+
+		if ( m == reply )
+		{
+			if ( ! n.isvalidaddrtype( r.addrt ) ) return ( EATYPE );
+			n.addrtype( r.addrt );
+			r.addrt = n.addrtype();
+		}
+	}
+
+	APERcleared n;
+	if ( ! n.isvaliddate( r.date ) ) return ( EDATE );
+
+	return ( EOK );
+}
+
+/////////////////////////////////////////////////////
+//      formatrecord                               //
+/////////////////////////////////////////////////////
+
+std::string formatrecord( datamode m, const APERrecord &r )
+{
+	if ( m == reply )
+		return ( r.address + tokcsv + r.addrt + tokcsv + r.date );
+
+	return ( r.address + tokcsv + r.date );
+}
+
+/////////////////////////////////////////////////////
+//      recorderror                                //
+/////////////////////////////////////////////////////
+// report a record parserecord() didn't like, naming the bad field.
+
+errstate recorderror( errstate err, const APERrecord &r, linenum_type line )
+{
+	switch ( err )
+	{
+		case EATYPE:	return ( errnotify( err, r.addrt, line ) );
+		case EDATE:		return ( errnotify( err, r.date, line ) );
+		default:		return ( errnotify( err, r.address, line ) );
+	}
+}
+
+/////////////////////////////////////////////////////
+//      nextrecord                                 //
+/////////////////////////////////////////////////////
+// read the next record of a list file, skipping comments and blanks.
+// returns false at end of file or on error, the latter also clears ok.
+
+bool nextrecord( std::istream *f, datamode m, APERrecord &r, linenum_type &line, bool &ok )
+{
+	std::string s;
+
+	while ( getline( *f, s ) )
+	{
+		++line;
+		trimspace( s, ENDS );
+		if ( s.empty() ) continue;
+		if ( s[0] == tokcomment ) continue;
+
+		errstate err = parserecord( m, s, r, true );
+		if ( err == EOK ) return ( true );
+
+		recorderror( err, r, line );
+		ok = false;
+		return ( false );
+	}
+
+	return ( false );
+}
+
+/////////////////////////////////////////////////////
+//      difflists                                  //
+/////////////////////////////////////////////////////
+// merge-join two sorted versions of a list into a delta.  only the
+// records are held in memory, plus the cleared list in reply mode so
+// that cleared entries can be told apart from plain removals.
+
+bool difflists( APERlist &l, std::string oldfile, std::string newfile, std::string deltafile )
+{
+	datamode m = l.mode;
+	APERlist c( cleared, l.dir );
+
+	APERinput inold;
+	if ( ! inold.open( oldfile ) ) { errnotify( EFILE, oldfile ); return ( false ); }
+
+	APERinput innew;
+	if ( ! innew.open( newfile ) ) { errnotify( EFILE, newfile ); return ( false ); }
+
+	std::ostream *out = &std::cout;
+	std::ofstream ofs;
+
+	if ( ! deltafile.empty() )
+	{
+		ofs.open( deltafile.c_str() );
+		if ( ! ofs ) { errnotify( EFILE, deltafile ); return ( false ); }
+		out = &ofs;
+	}
+
+	if ( m == reply && ( access( c.file().c_str(), F_OK ) == 0 || issharded( c.file() ) ) )
+	{
+		if ( ! loadaperdb( c ) ) return ( false );
+	}
+
+	APERfilerecords o( &inold.stream(), m, oldfile );
+	APERfilerecords n( &innew.stream(), m, newfile );
+
+	bool ok = writedelta( m, o, n, m == reply ? &c : 0, *out );
+
+	out->flush();
+	if ( ! *out ) { errnotify( EFILE, deltafile ); return ( false ); }
+
+	ok = inold.close() && ok;
+	ok = innew.close() && ok;
+
+	return ( ok );
+}
+
+/////////////////////////////////////////////////////
+//      writedelta                                 //
+/////////////////////////////////////////////////////
+// merge-join two versions of a list into a delta.  in reply mode a
+// removed record found in cleared, with a clearing date no older than
+// its own, was cleared rather than removed.  the number of records in
+// the delta goes to changes.
+
+bool writedelta( datamode m, APERrecords &o, APERrecords &n, const APERlist *cleared, std::ostream &out, std::size_t *changes )
+{
+	out << tokcomment << " aper delta " << listname( m ) << '\n';
+
+	APERrecord ro, rn;
+	bool haveo = o.next( ro );
+	bool haven = n.next( rn );
+	std::size_t count = 0;
+
+	while ( o.ok() && n.ok() && ( haveo || haven ) )
+	{
+		if ( haveo && ( ! haven || ro.address < rn.address ) )
+		{
+			char op = '-';
+
+			std::string date;
+			if ( cleared && cleared->clearedon( ro.address, date ) && ! ( ro.date > date ) ) op = 'c';
+
+			out << op << formatrecord( m, ro ) << '\n';
+			++count;
+
+			haveo = o.next( ro );
+			continue;
+		}
+
+		if ( haven && ( ! haveo || rn.address < ro.address ) )
+		{
+			out << '+' << formatrecord( m, rn ) << '\n';
+			++count;
+
+			haven = n.next( rn );
+			continue;
+		}
+
+		if ( ro.addrt != rn.addrt )
+			{ out << 't' << formatrecord( m, rn ) << '\n'; ++count; }
+		else if ( ro.date != rn.date )
+			{ out << 'd' << formatrecord( m, rn ) << '\n'; ++count; }
+
+		haveo = o.next( ro );
+		haven = n.next( rn );
+	}
+
+	if ( changes ) *changes = count;
+
+	return ( o.ok() && n.ok() );
+}
+
+/////////////////////////////////////////////////////
+//      APERfilerecords::next                      //
+/////////////////////////////////////////////////////
+
+bool APERfilerecords::next( APERrecord &r )
+{
+	if ( ! _ok || ! nextrecord( _f, _m, r, _line, _ok ) ) return ( false );
+
+	if ( ! _last.empty() && r.address <= _last )
+	{
+		errnotify( ESORT, _name, _line );
+		_ok = false;
+		return ( false );
+	}
+
+	_last = r.address;
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      APERvectorrecords::next                    //
+/////////////////////////////////////////////////////
+
+bool APERvectorrecords::next( APERrecord &r )
+{
+	if ( _i == _v.size() ) return ( false );
+
+	r = _v[ _i++ ];
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      APERmergedrecords::APERmergedrecords       //
+/////////////////////////////////////////////////////
+// a heap of the next record from each source, smallest address on top.
+
+APERmergedrecords::APERmergedrecords( datamode m, const std::vector<APERrecords *> &sources ) :
+	_m( m ), _sources( sources ), _from( 0 )
+{
+	_heap.reserve( sources.size() );
+
+	for ( std::size_t i = 0; i < _sources.size(); ++i ) pull( i );
+}
+
+bool APERmergedrecords::later( const Head &a, const Head &b )
+{
+	return ( b.r.address < a.r.address );
+}
+
+void APERmergedrecords::pull( std::size_t source )
+{
+	_heap.push_back( Head() );
+
+	if ( _sources[ source ]->next( _heap.back().r ) )
+	{
+		_heap.back().source = source;
+		std::push_heap( _heap.begin(), _heap.end(), later );
+		return;
+	}
+
+	_heap.pop_back();
+	if ( ! _sources[ source ]->ok() ) _ok = false;
+}
+
+void APERmergedrecords::from( std::size_t source )
+{
+	if ( source < 64 ) _from |= static_cast<uint64_t>( 1 ) << source;
+}
+
+/////////////////////////////////////////////////////
+//      APERmergedrecords::next                    //
+/////////////////////////////////////////////////////
+
+bool APERmergedrecords::next( APERrecord &r )
+{
+	if ( ! _ok || _heap.empty() ) return ( false );
+
+	std::pop_heap( _heap.begin(), _heap.end(), later );
+	r = _heap.back().r;
+	std::size_t source = _heap.back().source;
+	_heap.pop_back();
+	_from = 0;
+	from( source );
+	pull( source );
+
+	while ( _ok && ! _heap.empty() && _heap.front().r.address == r.address )
+	{
+		std::pop_heap( _heap.begin(), _heap.end(), later );
+		combinerecord( _m, r, _heap.back().r );
+		source = _heap.back().source;
+		_heap.pop_back();
+		from( source );
+		pull( source );
+	}
+
+	return ( _ok );
+}
+
+/////////////////////////////////////////////////////
+//      noderecord                                 //
+/////////////////////////////////////////////////////
+// a node's fields as they would be written.
+
+void noderecord( datamode m, const APERnode *n, APERrecord &r )
+{
+	r.address = n->address();
+	r.date = n->date();
+	r.addrt.clear();
+
+	if ( m == reply ) r.addrt = dynamic_cast<const APERreply *>( n )->addrtype();
+}
+
+/////////////////////////////////////////////////////
+//      patchlist                                  //
+/////////////////////////////////////////////////////
+// apply a delta to the list by merging the two in a single pass.
+// removals of absent records and additions of present ones are taken
+// as already applied, so a delta can safely be applied twice.
+
+bool patchlist( APERlist &l, std::string deltafile )
+{
+	datamode m = l.mode;
+	std::string file = l.file();
+
+	if ( issharded( file ) )
+	{
+		errnotify( ESHARD, file + " must be unsharded to be patched" );
+		return ( false );
+	}
+
+	APERinput indelta;
+	if ( ! indelta.open( deltafile ) ) { errnotify( EFILE, deltafile ); return ( false ); }
+	std::istream *d = &indelta.stream();
+
+	std::string s;
+	linenum_type dline = 1;
+	std::string header = std::string( 1, tokcomment ) + " aper delta " + listname( m );
+
+	if ( ! getline( *d, s ) || trimspace( s, ENDS ) != header )
+		{ errnotify( EDELTA, "missing \"" + header + "\"", dline ); return ( false ); }
+
+	APERinput in;
+	if ( ! in.open( file ) ) { errnotify( EFILE, file ); return ( false ); }
+	std::istream &ifs = in.stream();
+
+	const char *tmpfile = tempnam( dirof( file ).c_str(), tmpprefix );
+
+	APERoutput out;
+	if ( ! out.open( tmpfile, l.outcodec == keep ? in.format() : l.outcodec ) )
+		{ errnotify( EXFILE, tmpfile ); return ( false ); }
+	out.compare( file );
+	std::ostream &ofs = out.stream();
+
+// keep the leading comment block, just like loading the list does.
+
+	APERrecord r, dr;
+	linenum_type line = 0;
+	bool ok = true;
+	bool haver = false;
+
+	while ( getline( ifs, s ) )
+	{
+		++line;
+		trimspace( s, ENDS );
+		if ( s.empty() ) continue;
+
+		if ( s[0] == tokcomment )
+		{
+			ofs << s << '\n';
+			continue;
+		}
+
+		errstate err = parserecord( m, s, r, true );
+		if ( err != EOK ) { errnotify( err, s, line ); ok = false; }
+
+		haver = ok;
+		break;
+	}
+
+	char op = 0;
+	bool haved = false;
+	std::string lastr, lastd;
+
+	for ( ; ok; )
+	{
+		if ( haver && ! lastr.empty() && r.address <= lastr )
+		{
+			errnotify( ESORT, file, line );
+			ok = false;
+			break;
+		}
+
+		if ( ! haved )
+		{
+			while ( ( haved = static_cast<bool>( getline( *d, s ) ) ) )
+			{
+				++dline;
+				trimspace( s, ENDS );
+				if ( s.empty() || s[0] == tokcomment ) continue;
+				break;
+			}
+
+			if ( haved )
+			{
+				op = s[0];
+				errstate err = ( std::string( "+-dtc" ).find( op ) != std::string::npos ) ? EOK : EDELTA;
+				if ( op == 'c' && m != reply ) err = EDELTA;
+				if ( err == EOK ) err = parserecord( m, s.substr( 1 ), dr, true );
+				if ( err == EOK && ! lastd.empty() && dr.address <= lastd ) err = ESORT;
+
+				if ( err != EOK )
+				{
+					errnotify( err, s, dline );
+					ok = false;
+					break;
+				}
+
+				lastd = dr.address;
+			}
+		}
+
+		if ( ! haver && ! haved ) break;
+
+		if ( haver && ( ! haved || r.address < dr.address ) )
+		{
+			ofs << formatrecord( m, r ) << '\n';
+			lastr = r.address;
+			haver = nextrecord( &ifs, m, r, line, ok );
+			continue;
+		}
+
+		bool same = ( haver && r.address == dr.address );
+
+		if ( op != '-' && op != 'c' )
+			ofs << formatrecord( m, dr ) << '\n';
+
+		if ( same )
+		{
+			lastr = r.address;
+			haver = nextrecord( &ifs, m, r, line, ok );
+		}
+
+		haved = false;
+	}
+
+	ok = in.close() && ok;
+	ok = indelta.close() && ok;
+
+	bool written = out.close();
+	if ( ! written ) errnotify( EXFILE, tmpfile );
+
+	if ( ! ok || ! written )
+	{
+		if ( unlink( tmpfile ) != 0 ) errnotify( EXFILERM, tmpfile );
+		return ( false );
+	}
+
+	return ( commitaperfile( tmpfile, file, out.unchanged() ) );
+}
+
+/////////////////////////////////////////////////////
+//      prunelist                                  //
+/////////////////////////////////////////////////////
+// write out entries not seen in the given number of days, and drop
+// them from the list if asked to.
+
+bool prunelist( APERlist &l, unsigned int days, bool rewrite )
+{
+	APERdb::Nodes v;
+	datednodes( l.db, "", daysago( days ), v );
+
+	for ( APERdb::Nodes::iterator itr = v.begin(); itr != v.end(); ++itr )
+		(*itr)->write( std::cout );
+
+	std::cout.flush();
+	if ( ! rewrite ) return ( std::cout.good() );
+
+	for ( APERdb::Nodes::iterator itr = v.begin(); itr != v.end(); ++itr )
+	{
+		std::string key = (*itr)->address();
+		l.db.erase( key );
+		l.touch( key );
+	}
+
+	return ( writeaperdb( l ) );
+}
+
+/////////////////////////////////////////////////////
+//      datednodes                                 //
+/////////////////////////////////////////////////////
+// the listed nodes dated in [from, to), in list order, out of the
+// table's date buckets, so the cost goes with the range selected.
+// empty bounds are open.  cleared reply entries aren't part of the list.
+
+void datednodes( const APERdb &db, const std::string &from, const std::string &to, APERdb::Nodes &v )
+{
+	db.dated( from, to, v );
+
+	std::size_t j = 0;
+
+	for ( std::size_t i = 0; i < v.size(); ++i )
+	{
+		APERreply *p = dynamic_cast<APERreply *>( v[ i ] );
+		if ( p && p->iscleared() ) continue;
+
+		v[ j++ ] = v[ i ];
+	}
+
+	v.resize( j );
+	sortnodes( v );
+}
+
+/////////////////////////////////////////////////////
+//      exportlist                                 //
+/////////////////////////////////////////////////////
+// write out entries seen in [since, until).  no until means up to now.
+
+bool exportlist( APERlist &l, std::string since, std::string until )
+{
+	APERdb::Nodes v;
+	datednodes( l.db, since, until, v );
+
+	for ( APERdb::Nodes::iterator itr = v.begin(); itr != v.end(); ++itr )
+		(*itr)->write( std::cout );
+
+	std::cout.flush();
+
+	return ( std::cout.good() );
+}
+
+/////////////////////////////////////////////////////
+//      querylist                                  //
+/////////////////////////////////////////////////////
+// write out the entry for each key, normalized the way entries are, so
+// that any spelling of a link finds it.  a link that isn't listed as it
+// is gets the wildcard entry matching it.  with variants an address
+// that isn't listed gets the listed entries it's a look-alike of, each
+// followed by the address as given.  keys are read from stdin when
+// none are given.  false if any isn't listed.
+
+bool querylist( APERlist &l, const std::vector<std::string> &keys, bool variants )
+{
+	std::vector<std::string> k( keys );
+
+	if ( k.empty() )
+	{
+		std::string s;
+
+		while ( getline( std::cin, s ) )
+		{
+			trimspace( s, ENDS );
+			if ( ! s.empty() && s[0] != tokcomment ) k.push_back( s );
+		}
+	}
+
+	APERlinkpatterns patterns;
+	if ( l.mode == links ) patterns.build( l.db );
+
+	APERvariants alike;
+	if ( variants ) alike.build( l.db );
+
+	std::size_t missing = 0;
+
+	for ( std::vector<std::string>::iterator itr = k.begin(); itr != k.end(); ++itr )
+	{
+		std::string key = listkey( l.mode, *itr );
+
+		APERnode *n = l.db.find( key );
+		if ( n == 0 ) n = patterns.match( key );
+
+		APERdb::Nodes v;
+		if ( variants && ( n == 0 || dynamic_cast<APERreply *>( n )->iscleared() ) ) alike.find( key, v );
+
+		if ( n && ! ( l.mode == reply && dynamic_cast<APERreply *>( n )->iscleared() ) )
+			n->write( std::cout );
+		else if ( ! v.empty() )
+		{
+			for ( APERdb::Nodes::iterator vtr = v.begin(); vtr != v.end(); ++vtr )
+			{
+				APERrecord r;
+				noderecord( l.mode, *vtr, r );
+				std::cout << formatrecord( l.mode, r ) << '\t' << *itr << '\n';
+			}
+		}
+		else
+		{
+			errnotify( ENOENTRY, *itr );
+			++missing;
+		}
+	}
+
+	std::cout.flush();
+
+	return ( missing == 0 && std::cout.good() );
+}
+
+/////////////////////////////////////////////////////
+//      canonicalizelinks                          //
+/////////////////////////////////////////////////////
+// load the links list from its files as written, canonicalizing every
+// key on the way in, and report how many keys that changed and how many
+// entries merged into others.  with rewrite the list is written back,
+// a sharded list resharded since keys can move between shards.
+
+// count the entries of a list file and those whose key isn't canonical.
+
+static bool countcanonical( const std::string &file, std::size_t &entries, std::size_t &rewritten )
+{
+	APERinput ifs;
+	if ( ! ifs.open( file ) ) { errnotify( ELFILE, file ); return ( false ); }
+
+	APERlinks n;
+	std::string s;
+
+	while ( getline( ifs.stream(), s ) )
+	{
+		trimspace( s, ENDS );
+		if ( s.empty() || s[0] == tokcomment ) continue;
+
+		std::string address;
+		std::istringstream iss( split( s ) );
+		iss >> address;
+
+		++entries;
+		if ( n.cleanup( address ) != address ) ++rewritten;
+	}
+
+	return ( ifs.close() );
+}
+
+bool canonicalizelinks( APERlist &l, bool rewrite )
+{
+	std::string file = l.file();
+	std::vector<std::string> files;
+	APERshards sh;
+
+	if ( issharded( file ) )
+	{
+		if ( ! readmanifest( file + shardsuffix, sh, &l.comments ) ) return ( false );
+
+		for ( unsigned int i = 0; i < sh.count; ++i )
+			files.push_back( file + shardsuffix + "/" + shardname( i ) );
+	}
+	else
+		files.push_back( file );
+
+	std::size_t entries = 0;
+	std::size_t rewritten = 0;
+
+	for ( std::vector<std::string>::iterator itr = files.begin(); itr != files.end(); ++itr )
+	{
+		if ( ! countcanonical( *itr, entries, rewritten ) ) return ( false );
+
+		APERinput ifs;
+		if ( ! ifs.open( *itr ) ) { errnotify( ELFILE, *itr ); return ( false ); }
+
+		bool ok = loadaperlinks( l, &ifs.stream() );
+		if ( ! ifs.close() || ! ok ) return ( false );
+
+		if ( itr == files.begin() ) l.listcodec = ifs.format();
+	}
+
+	std::cout << "entries\t" << entries << '\n';
+	std::cout << "rewritten\t" << rewritten << '\n';
+	std::cout << "collapsed\t" << entries - l.db.size() << '\n';
+	std::cout << "keys\t" << l.db.size() << '\n';
+
+	std::cout.flush();
+	if ( ! rewrite ) return ( std::cout.good() );
+
+	if ( sh.count ) return ( shardlist( l, sh.count, sh.by ) );
+
+	return ( writelistfile( l, file ) );
+}
+
+/////////////////////////////////////////////////////
+//      exportcolumnar                             //
+/////////////////////////////////////////////////////
+// write the chosen lists, or the entries of them seen in [since, until),
+// to file in the columnar layout.  each list is loaded once, and the
+// file is laid out in full before it's written so that it goes out a
+// column at a time.
+
+// the codec the file is written with when -z doesn't say.
+
+#if defined( APER_ZSTD )
+static const codec columncodec = zstd;
+#elif defined( APER_GZIP )
+static const codec columncodec = gzip;
+#else
+static const codec columncodec = plain;
+#endif
+
+// one list's columns as they're built.
+
+struct ColumnTable
+{
+	std::vector<uint32_t> domain;
+	std::vector<uint32_t> restoffsets;
+	std::string rest;
+	std::vector<uint32_t> date;
+	std::vector<uint8_t> types;
+	std::vector<uint8_t> cleared;
+};
+
+static std::string columndomain( datamode m, const std::string &key )
+{
+	std::string::size_type p = domainat( m, key );
+	return ( m == links ? key.substr( 0, p ) : key.substr( p ) );
+}
+
+static std::string columnrest( datamode m, const std::string &key )
+{
+	std::string::size_type p = domainat( m, key );
+	return ( m == links ? key.substr( p ) : key.substr( 0, p ) );
+}
+
+static uint64_t columnat( uint64_t &at, uint64_t bytes )
+{
+	uint64_t here = at;
+	at = ( at + bytes + 7 ) & ~static_cast<uint64_t>( 7 );
+	return ( here );
+}
+
+static void writecolumn( std::ostream &f, uint64_t &at, uint64_t offset, const void *p, std::size_t n )
+{
+	static const char zeros[ 8 ] = { 0 };
+
+	f.write( zeros, offset - at );
+	f.write( static_cast<const char *>( p ), n );
+	at = offset + n;
+}
+
+bool exportcolumnar( const std::string &file, std::bitset<nummodes> lists, const std::string &since,
+	const std::string &until, codec c )
+{
+	APERlist lr( reply ), ll( links ), lc( cleared );
+	APERlist *l[ nummodes ] = { &lr, &ll, &lc };
+	std::vector<APERrecord> records[ nummodes ];
+	std::vector<uint8_t> iscleared[ nummodes ];
+	std::map<std::string, uint32_t> dict;
+
+	for ( int m = 0; m < nummodes; ++m )
+	{
+		if ( ! lists.test( m ) ) continue;
+		if ( ! loadlocked( *l[ m ] ) ) return ( false );
+
+		APERdb::Nodes all;
+		l[ m ]->db.sorted( all );
+
+// reply entries cleared but never listed are kept aside from the list,
+// in address order too, so they're merged in.
+
+		const std::vector<APERrecord> &unlisted = l[ m ]->unlisted;
+		std::size_t u = 0;
+
+		for ( APERdb::Nodes::iterator itr = all.begin(); itr != all.end() || u < unlisted.size(); )
+		{
+			APERrecord r;
+			bool cleared = true;
+
+			if ( itr == all.end() || ( u < unlisted.size() && unlisted[ u ].address < (*itr)->address() ) )
+				r = unlisted[ u++ ];
+			else
+			{
+				noderecord( static_cast<datamode>( m ), *itr, r );
+				cleared = m == reply && dynamic_cast<const APERreply *>( *itr )->iscleared();
+				++itr;
+			}
+
+			if ( r.date < since || ( ! until.empty() && ! ( r.date < until ) ) ) continue;
+
+			records[ m ].push_back( r );
+			iscleared[ m ].push_back( cleared );
+			dict.insert( std::make_pair( columndomain( static_cast<datamode>( m ), r.address ), 0 ) );
+		}
+	}
+
+// the dictionary is numbered in order, so sorting by index sorts by
+// domain.
+
+	std::vector<uint32_t> wordoffsets( 1, 0 );
+	std::string wordbytes;
+	uint32_t word = 0;
+
+	for ( std::map<std::string, uint32_t>::iterator itr = dict.begin(); itr != dict.end(); ++itr )
+	{
+		itr->second = word++;
+		wordbytes += itr->first;
+		wordoffsets.push_back( wordbytes.size() );
+	}
+
+	ColumnTable t[ nummodes ];
+
+	for ( int m = 0; m < nummodes; ++m )
+	{
+		datamode mode = static_cast<datamode>( m );
+		std::size_t rows = records[ m ].size();
+
+		t[ m ].domain.reserve( rows );
+		t[ m ].restoffsets.reserve( rows + 1 );
+		t[ m ].restoffsets.push_back( 0 );
+		t[ m ].date.reserve( rows );
+		t[ m ].types.assign( rows, 0 );
+		t[ m ].cleared.swap( iscleared[ m ] );
+
+		for ( std::size_t i = 0; i < rows; ++i )
+		{
+			const APERrecord &r = records[ m ][ i ];
+
+			t[ m ].domain.push_back( dict[ columndomain( mode, r.address ) ] );
+			t[ m ].rest += columnrest( mode, r.address );
+			t[ m ].restoffsets.push_back( t[ m ].rest.size() );
+			t[ m ].date.push_back( atoi( r.date.c_str() ) );
+
+			for ( std::string::const_iterator a = r.addrt.begin(); a != r.addrt.end(); ++a )
+				if ( *a >= 'A' && *a <= 'E' ) t[ m ].types[ i ] |= 1 << ( *a - 'A' );
+		}
+
+		if ( t[ m ].rest.size() > std::numeric_limits<uint32_t>::max() )
+		{
+			errnotify( ECOLUMNAR, "too big for 32 bit offsets: " + listname( mode ) );
+			return ( false );
+		}
+	}
+
+	if ( wordbytes.size() > std::numeric_limits<uint32_t>::max() )
+	{
+		errnotify( ECOLUMNAR, "dictionary too big for 32 bit offsets" );
+		return ( false );
+	}
+
+// lay it out: the header, the dictionary, then each list's columns.
+
+	APERcolheader h;
+	memset( &h, 0, sizeof( h ) );
+	memcpy( h.magic, colmagic, sizeof( h.magic ) );
+	h.version = colversion;
+	h.tables = nummodes;
+
+	uint64_t at = 0;
+	columnat( at, sizeof( h ) );
+
+	h.words = dict.size();
+	h.wordoffsets = columnat( at, wordoffsets.size() * sizeof( uint32_t ) );
+	h.wordbytes = columnat( at, wordbytes.size() );
+
+	for ( int m = 0; m < nummodes; ++m )
+	{
+		APERcoltable &ct = h.table[ m ];
+		uint64_t rows = t[ m ].date.size();
+
+		ct.rows = rows;
+		ct.domain = columnat( at, rows * sizeof( uint32_t ) );
+		ct.restoffsets = columnat( at, ( rows + 1 ) * sizeof( uint32_t ) );
+		ct.restbytes = columnat( at, t[ m ].rest.size() );
+		ct.date = columnat( at, rows * sizeof( uint32_t ) );
+		ct.types = columnat( at, rows );
+		ct.cleared = columnat( at, rows );
+	}
+
+	h.size = at;
+
+	const char *tmpfile = tempnam( dirof( file ).c_str(), tmpprefix );
+
+	APERoutput out;
+	if ( ! out.open( tmpfile, c == keep ? columncodec : c ) ) { errnotify( EXFILE, tmpfile ); return ( false ); }
+
+	out.compare( file );
+
+	std::ostream &f = out.stream();
+	uint64_t pos = 0;
+
+	writecolumn( f, pos, 0, &h, sizeof( h ) );
+	writecolumn( f, pos, h.wordoffsets, &wordoffsets[ 0 ], wordoffsets.size() * sizeof( uint32_t ) );
+	writecolumn( f, pos, h.wordbytes, wordbytes.data(), wordbytes.size() );
+
+	for ( int m = 0; m < nummodes; ++m )
+	{
+		const APERcoltable &ct = h.table[ m ];
+		uint64_t rows = ct.rows;
+
+		writecolumn( f, pos, ct.domain, rows ? &t[ m ].domain[ 0 ] : 0, rows * sizeof( uint32_t ) );
+		writecolumn( f, pos, ct.restoffsets, &t[ m ].restoffsets[ 0 ], ( rows + 1 ) * sizeof( uint32_t ) );
+		writecolumn( f, pos, ct.restbytes, t[ m ].rest.data(), t[ m ].rest.size() );
+		writecolumn( f, pos, ct.date, rows ? &t[ m ].date[ 0 ] : 0, rows * sizeof( uint32_t ) );
+		writecolumn( f, pos, ct.types, rows ? &t[ m ].types[ 0 ] : 0, rows );
+		writecolumn( f, pos, ct.cleared, rows ? &t[ m ].cleared[ 0 ] : 0, rows );
+	}
+
+	writecolumn( f, pos, h.size, 0, 0 );
+
+	if ( ! out.close() )
+	{
+		errnotify( EXFILE, tmpfile );
+		if ( unlink( tmpfile ) != 0 ) errnotify( EXFILERM, tmpfile );
+		return ( false );
+	}
+
+	return ( commitaperfile( tmpfile, file, out.unchanged() ) );
+}
+
+/////////////////////////////////////////////////////
+//      liststats                                  //
+/////////////////////////////////////////////////////
+// counts over the chosen lists, written as text or json: entries,
+// cleared, reply types, age, month last seen and the top domains or
+// hosts.  each list is loaded once.  its entries are split evenly
+// between threads, each of which keeps its own tallies, and the tallies
+// are added up at the end.
+
+// ages, in days, as addresses2spamassassin.pl buckets them.  anything
+// older than the last is "older".
+
+static const unsigned int statsages[] = { 1, 7, 31, 186, 365 };
+static const char *const statsagenames[] = { "day", "week", "month", "6 months", "year", "older" };
+static const std::size_t numstatsages = sizeof( statsagenames ) / sizeof( statsagenames[ 0 ] );
+static const std::size_t numstatstypes = 5;	// reply types A to E
+
+struct StatsTally
+{
+	StatsTally( void ) : entries( 0 ), cleared( 0 )
+	{
+		std::fill( types, types + numstatstypes, 0 );
+		std::fill( ages, ages + numstatsages, 0 );
+	}
+
+	void add( const StatsTally &t );
+
+	std::size_t entries;
+	std::size_t cleared;
+	std::size_t types[ numstatstypes ];
+	std::size_t ages[ numstatsages ];
+	std::map<std::string, std::size_t> months;
+	std::map<std::string, std::size_t> domains;
+};
+
+void StatsTally::add( const StatsTally &t )
+{
+	entries += t.entries;
+	cleared += t.cleared;
+
+	for ( std::size_t i = 0; i < numstatstypes; ++i ) types[ i ] += t.types[ i ];
+	for ( std::size_t i = 0; i < numstatsages; ++i ) ages[ i ] += t.ages[ i ];
+
+	std::map<std::string, std::size_t>::const_iterator itr;
+	for ( itr = t.months.begin(); itr != t.months.end(); ++itr ) months[ itr->first ] += itr->second;
+	for ( itr = t.domains.begin(); itr != t.domains.end(); ++itr ) domains[ itr->first ] += itr->second;
+}
+
+struct StatsJob
+{
+	datamode m;
+	APERdb::Nodes nodes;
+	std::string agefrom[ numstatsages - 1 ];
+	std::vector<StatsTally> parts;
+};
+
+static void statsjob( std::size_t i, void *arg )
+{
+	StatsJob *job = static_cast<StatsJob *>( arg );
+	StatsTally &t = job->parts[ i ];
+
+	std::size_t n = job->nodes.size();
+	std::size_t lo = n * i / job->parts.size();
+	std::size_t hi = n * ( i + 1 ) / job->parts.size();
+
+	for ( std::size_t k = lo; k < hi; ++k )
+	{
+		const APERnode *node = job->nodes[ k ];
+		++t.entries;
+
+		if ( job->m == reply )
+		{
+			const APERreply *p = dynamic_cast<const APERreply *>( node );
+			if ( p->iscleared() ) { ++t.cleared; continue; }
+
+			std::string addrt = p->addrtype();
+
+			for ( std::string::iterator c = addrt.begin(); c != addrt.end(); ++c )
+				if ( *c >= 'A' && *c < static_cast<char>( 'A' + numstatstypes ) ) ++t.types[ *c - 'A' ];
+		}
+
+		std::string date = node->date();
+		std::size_t a = 0;
+		while ( a < numstatsages - 1 && date < job->agefrom[ a ] ) ++a;
+		++t.ages[ a ];
+
+		++t.months[ date.substr( 0, 6 ) ];
+
+		const std::string &key = node->address();
+		std::string::size_type p = domainat( job->m, key );
+		++t.domains[ job->m == links ? key.substr( 0, p ) : key.substr( p ) ];
+	}
+}
+
+static bool morecommon( const std::pair<std::size_t, std::string> &a, const std::pair<std::size_t, std::string> &b )
+{
+	return ( a.first > b.first || ( a.first == b.first && a.second < b.second ) );
+}
+
+static std::string jsonstring( const std::string &s )
+{
+	std::string j = "\"";
+
+	for ( std::string::const_iterator itr = s.begin(); itr != s.end(); ++itr )
+	{
+		unsigned char c = *itr;
+
+		if ( c == '"' || c == '\\' ) { j += '\\'; j += c; }
+		else if ( c < 0x20 )
+		{
+			char buf[ 8 ];
+			snprintf( buf, sizeof( buf ), "\\u%04x", c );
+			j += buf;
+		}
+		else j += c;
+	}
+
+	return ( j + "\"" );
+}
+
+// write one list's tallies.
+
+static void putstats( std::ostream &f, datamode m, const StatsTally &t, std::size_t top, bool json )
+{
+	std::vector<std::pair<std::size_t, std::string> > common;
+
+	for ( std::map<std::string, std::size_t>::const_iterator itr = t.domains.begin(); itr != t.domains.end(); ++itr )
+		common.push_back( std::make_pair( itr->second, itr->first ) );
+
+	top = std::min( top, common.size() );
+	std::partial_sort( common.begin(), common.begin() + top, common.end(), morecommon );
+
+	std::size_t active = t.entries - t.cleared;
+	double ratio = t.entries ? 100.0 * t.cleared / t.entries : 0;
+	const char *domain = ( m == links ) ? "host" : "domain";
+
+	char pct[ 32 ];
+	snprintf( pct, sizeof( pct ), "%.2f", ratio );
+
+	if ( ! json )
+	{
+		f << listname( m ) << '\n';
+		f << "\tentries\t" << t.entries << '\n';
+
+		if ( m == reply )
+		{
+			f << "\tactive\t" << active << '\n';
+			f << "\tcleared\t" << t.cleared << '\t' << pct << "%\n";
+
+			for ( std::size_t i = 0; i < numstatstypes; ++i )
+				f << "\ttype " << static_cast<char>( 'A' + i ) << '\t' << t.types[ i ] << '\n';
+		}
+
+		for ( std::size_t i = 0; i < numstatsages; ++i )
+			f << "\tage " << statsagenames[ i ] << '\t' << t.ages[ i ] << '\n';
+
+		for ( std::map<std::string, std::size_t>::const_iterator itr = t.months.begin(); itr != t.months.end(); ++itr )
+			f << "\tmonth " << itr->first.substr( 0, 4 ) << '-' << itr->first.substr( 4 ) << '\t' << itr->second << '\n';
+
+		for ( std::size_t i = 0; i < top; ++i )
+			f << '\t' << domain << ' ' << common[ i ].second << '\t' << common[ i ].first << '\n';
+
+		return;
+	}
+
+	f << jsonstring( listname( m ) ) << ": {\n";
+	f << "    \"entries\": " << t.entries << ",\n";
+
+	if ( m == reply )
+	{
+		f << "    \"active\": " << active << ",\n";
+		f << "    \"cleared\": " << t.cleared << ",\n";
+		f << "    \"clearedpercent\": " << pct << ",\n";
+		f << "    \"types\": {";
+
+		for ( std::size_t i = 0; i < numstatstypes; ++i )
+			f << ( i ? ", " : " " ) << '"' << static_cast<char>( 'A' + i ) << "\": " << t.types[ i ];
+
+		f << " },\n";
+	}
+
+	f << "    \"ages\": {";
+
+	for ( std::size_t i = 0; i < numstatsages; ++i )
+		f << ( i ? ", " : " " ) << jsonstring( statsagenames[ i ] ) << ": " << t.ages[ i ];
+
+	f << " },\n    \"months\": {";
+
+	for ( std::map<std::string, std::size_t>::const_iterator itr = t.months.begin(); itr != t.months.end(); ++itr )
+		f << ( itr == t.months.begin() ? " " : ", " ) << jsonstring( itr->first ) << ": " << itr->second;
+
+	f << " },\n    \"" << domain << "s\": [";
+
+	for ( std::size_t i = 0; i < top; ++i )
+		f << ( i ? ", " : " " ) << "[ " << jsonstring( common[ i ].second ) << ", " << common[ i ].first << " ]";
+
+	f << " ]\n  }";
+}
+
+bool liststats( std::bitset<nummodes> lists, std::size_t top, bool json )
+{
+	std::ostringstream out;
+	bool first = true;
+
+	if ( json ) out << "{\n";
+
+	for ( int m = 0; m < nummodes; ++m )
+	{
+		if ( ! lists.test( m ) ) continue;
+
+		APERlist l( static_cast<datamode>( m ) );
+		if ( ! loadlocked( l ) ) return ( false );
+
+		StatsJob job;
+		job.m = l.mode;
+		l.db.nodes( job.nodes );
+
+		for ( std::size_t i = 0; i < numstatsages - 1; ++i ) job.agefrom[ i ] = daysago( statsages[ i ] );
+
+		unsigned int threads = numthreads( job.nodes.size() );
+		job.parts.resize( threads );
+
+		if ( threads > 1 )
+			parallelfor( threads, statsjob, &job );
+		else
+			statsjob( 0, &job );
+
+		for ( std::size_t i = 1; i < job.parts.size(); ++i ) job.parts[ 0 ].add( job.parts[ i ] );
+
+// reply entries cleared but never listed are held outside the tree.
+
+		job.parts[ 0 ].entries += l.unlisted.size();
+		job.parts[ 0 ].cleared += l.unlisted.size();
+
+		if ( json ) out << ( first ? "  " : ",\n  " );
+		putstats( out, l.mode, job.parts[ 0 ], top, json );
+		first = false;
+	}
+
+	if ( json ) out << "\n}\n";
+
+	std::cout << out.str() << std::flush;
+
+	return ( std::cout.good() );
+}
+
+/////////////////////////////////////////////////////
+//      submitspool                                //
+/////////////////////////////////////////////////////
+// copy new data into the spool as is.  it's written under a hidden
+// name first so that ingest never sees half a file.  names sort in
+// the order files were submitted.
+
+bool submitspool( APERlist &l, std::string datafile )
+{
+	std::string spool = l.file() + spoolsuffix;
+
+	if ( mkdir( spool.c_str(), 0777 ) != 0 && errno != EEXIST )
+	{
+		errnotify( ESPOOL, spool );
+		return ( false );
+	}
+
+	int in = datafile.empty() ? 0 : open( datafile.c_str(), O_RDONLY );
+	if ( in < 0 ) { errnotify( EFILE, datafile ); return ( false ); }
+
+	struct timespec ts;
+	clock_gettime( CLOCK_REALTIME, &ts );
+
+	char name[ 64 ];
+	snprintf( name, sizeof( name ), "%011ld.%09ld.%ld",
+		static_cast<long>( ts.tv_sec ), static_cast<long>( ts.tv_nsec ), static_cast<long>( getpid() ) );
+
+	std::string tmpfile = spool + "/" + tmpprefix + name;
+	std::string file = spool + "/" + name;
+
+	int out = open( tmpfile.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666 );
+	if ( out < 0 )
+	{
+		errnotify( EXFILE, tmpfile );
+		if ( in > 0 ) close( in );
+		return ( false );
+	}
+
+	bool ok = true;
+	std::vector<char> buf( iobufsize );
+
+	for ( ;; )
+	{
+		ssize_t n = read( in, &buf[0], buf.size() );
+		if ( n < 0 && errno == EINTR ) continue;
+		if ( n < 0 ) { errnotify( EFILE, datafile.empty() ? "stdin" : datafile ); ok = false; }
+		if ( n <= 0 ) break;
+
+		for ( ssize_t w = 0; ok && w < n; )
+		{
+			ssize_t k = write( out, &buf[0] + w, n - w );
+			if ( k < 0 && errno == EINTR ) continue;
+			if ( k <= 0 ) { errnotify( EXFILE, tmpfile ); ok = false; break; }
+			w += k;
+		}
+
+		if ( ! ok ) break;
+	}
+
+	if ( in > 0 ) close( in );
+	if ( close( out ) != 0 ) ok = false;
+
+	if ( ! ok )
+	{
+		if ( unlink( tmpfile.c_str() ) != 0 ) errnotify( EXFILERM, tmpfile );
+		return ( false );
+	}
+
+	return ( commitaperfile( tmpfile.c_str(), file ) );
+}
+
+/////////////////////////////////////////////////////
+//      ingestspool                                //
+/////////////////////////////////////////////////////
+// merge every spooled file in one go.  the files are parsed in
+// parallel, then merged in the order they were submitted, so the
+// result is the same as adding them one at a time.  the caller holds
+// the list lock.
+
+struct StageJob
+{
+	const APERlist *list;
+	std::vector<APERstage> *stages;
+};
+
+static void stagejob( std::size_t i, void *arg )
+{
+	StageJob *j = static_cast<StageJob *>( arg );
+
+	stageuserfile( *j->list, ( *j->stages )[ i ] );
+}
+
+bool ingestspool( APERlist &l )
+{
+	std::string spool = l.file() + spoolsuffix;
+	std::vector<std::string> names;
+
+	DIR *dir = opendir( spool.c_str() );
+	if ( dir == 0 )
+	{
+		if ( errno == ENOENT ) return ( true );
+		errnotify( ESPOOL, spool );
+		return ( false );
+	}
+
+	for ( struct dirent *e; ( e = readdir( dir ) ) != 0; )
+	{
+		std::string name = e->d_name;
+
+		if ( name.empty() || name[0] == '.' ) continue;
+		if ( name.size() > 4 && name.compare( name.size() - 4, 4, ".bad" ) == 0 ) continue;
+
+		names.push_back( name );
+	}
+
+	closedir( dir );
+
+	if ( names.empty() ) return ( true );
+
+	std::sort( names.begin(), names.end() );
+
+	std::vector<APERstage> stages( names.size() );
+	for ( std::size_t i = 0; i < names.size(); ++i )
+		stages[ i ].file = spool + "/" + names[ i ];
+
+	if ( ! loadaperdb( l ) ) { errnotify( EAPERDB ); return ( false ); }
+
+	StageJob job = { &l, &stages };
+	parallelfor( stages.size(), stagejob, &job );
+
+	for ( std::vector<APERstage>::iterator itr = stages.begin(); itr != stages.end(); ++itr )
+	{
+		if ( itr->err == EOK && l.rejects && ! acceptstage( l, *itr ) ) itr->err = EREJECT;
+
+		if ( itr->err != EOK )
+		{
+			if ( itr->err != EREJECT ) errnotify( itr->err, itr->errinfo, itr->errline );
+			errnotify( EUSERDB, itr->file );
+
+			std::string bad = itr->file + ".bad";
+			if ( rename( itr->file.c_str(), bad.c_str() ) != 0 ) errnotify( ESPOOL, itr->file );
+
+			continue;
+		}
+
+		for ( std::vector<APERrecord>::iterator r = itr->records.begin(); r != itr->records.end(); ++r )
+		{
+			if ( ! mergeuserrecord( l, *r ) )
+			{
+				errnotify( EMEM, r->address );
+				return ( false );
+			}
+		}
+	}
+
+	if ( ! writeaperdb( l ) ) return ( false );
+
+// the list is safely written; spooled files left behind by a crash
+// here would merge again to the same result.
+
+	for ( std::vector<APERstage>::iterator itr = stages.begin(); itr != stages.end(); ++itr )
+	{
+		if ( itr->err != EOK ) continue;
+		if ( unlink( itr->file.c_str() ) != 0 ) errnotify( EXFILERM, itr->file );
+	}
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      issharded                                  //
+/////////////////////////////////////////////////////
+// a list has been sharded if its shard directory has a manifest.  the
+// shards are then the list, whatever else is lying around.
+
+bool issharded( const std::string &file )
+{
+	std::string manifest = file + shardsuffix + "/" + manifestfile;
+
+	return ( access( manifest.c_str(), F_OK ) == 0 );
+}
+
+/////////////////////////////////////////////////////
+//      shardname                                  //
+/////////////////////////////////////////////////////
+
+std::string shardname( unsigned int i )
+{
+	char name[ 16 ];
+	snprintf( name, sizeof( name ), "%04u", i );
+
+	return ( name );
+}
+
+/////////////////////////////////////////////////////
+//      readmanifest                               //
+/////////////////////////////////////////////////////
+// the manifest of a sharded list reads
+//
+//	# aper shards
+//	by hash|domain
+//	shards N
+//
+// followed by the list's leading comments.
+
+bool readmanifest( const std::string &dir, APERshards &sh, Comments *comments )
+{
+	std::string file = dir + "/" + manifestfile;
+
+	std::ifstream ifs( file.c_str() );
+	if ( ! ifs ) { errnotify( ESHARD, file ); return ( false ); }
+
+	std::string s;
+	linenum_type line = 1;
+	std::string header = std::string( 1, tokcomment ) + " aper shards";
+
+	if ( ! getline( ifs, s ) || trimspace( s, ENDS ) != header )
+		{ errnotify( ESHARD, file + ": missing \"" + header + "\"", line ); return ( false ); }
+
+	sh.by = byhash;
+	sh.count = 0;
+
+	while ( ++line, getline( ifs, s ) )
+	{
+		trimspace( s, ENDS );
+		if ( s.empty() ) continue;
+
+		if ( s[0] == tokcomment )
+		{
+			if ( comments ) comments->push_back( s );
+			continue;
+		}
+
+		std::string key, value;
+		std::istringstream iss( s );
+		iss >> key >> value;
+
+		if ( key == "by" && value == "hash" ) sh.by = byhash;
+		else if ( key == "by" && value == "domain" ) sh.by = bydomain;
+		else if ( key == "shards" && value.find_first_not_of( "0123456789" ) == std::string::npos )
+			sh.count = atoi( value.c_str() );
+		else
+			{ errnotify( ESHARD, file + ": " + s, line ); return ( false ); }
+	}
+
+	if ( sh.count == 0 || sh.count > maxshards )
+		{ errnotify( ESHARD, file + ": bad shard count" ); return ( false ); }
+
+	sh.dirty.assign( sh.count, false );
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      writemanifest                              //
+/////////////////////////////////////////////////////
+
+bool writemanifest( APERlist &l, const std::string &dir )
+{
+	const char *tmpfile = tempnam( dir.c_str(), tmpprefix );
+
+	std::ofstream ofs( tmpfile );
+	if ( ! ofs ) { errnotify( EXFILE, tmpfile ); return ( false ); }
+
+	ofs << tokcomment << " aper shards\n";
+	ofs << "by " << ( l.shards.by == bydomain ? "domain" : "hash" ) << '\n';
+	ofs << "shards " << l.shards.count << '\n';
+
+	for ( Comments::iterator itr = l.comments.begin(); itr != l.comments.end(); ++itr )
+		ofs << *itr << '\n';
+
+	ofs.close();
+
+	if ( ! ofs )
+	{
+		errnotify( EXFILE, tmpfile );
+		if ( unlink( tmpfile ) != 0 ) errnotify( EXFILERM, tmpfile );
+		return ( false );
+	}
+
+	return ( commitaperfile( tmpfile, dir + "/" + manifestfile ) );
+}
+
+/////////////////////////////////////////////////////
+//      loadshards                                 //
+/////////////////////////////////////////////////////
+// load every shard of a list at once, each into a list of its own, and
+// hand back all their nodes.  the caller owns the nodes, even when
+// loading fails.
+
+struct ShardLoad
+{
+	datamode mode;
+	std::string dir;
+	const APERshards *shards;
+	std::vector<APERlist *> parts;
+	std::vector<char> ok;
+	std::vector<codec> formats;
+};
+
+static void shardloadjob( std::size_t i, void *arg )
+{
+	ShardLoad &j = *static_cast<ShardLoad *>( arg );
+	APERlist &part = *j.parts[ i ];
+	std::string file = j.dir + "/" + shardname( i );
+
+	APERinput ifs;
+	if ( ! ifs.open( file ) ) { errnotify( ESHARD, file ); return; }
+
+	bool ok = false;
+
+	switch ( j.mode )
+	{
+		case reply:		ok = loadaperreply( part, &ifs.stream() ); break;
+		case links:		ok = loadaperlinks( part, &ifs.stream() ); break;
+		default:		ok = loadapercleared( part, &ifs.stream() ); break;
+	}
+
+	ok = ifs.close() && ok;
+	j.formats[ i ] = ifs.format();
+
+// an entry in the wrong shard would be written back to another shard
+// and then be found twice.
+
+	APERdb::Nodes v;
+	part.db.nodes( v );
+
+	for ( APERdb::Nodes::iterator itr = v.begin(); ok && itr != v.end(); ++itr )
+	{
+		if ( j.shards->of( j.mode, (*itr)->address() ) == i ) continue;
+		errnotify( ESHARD, file + ": " + (*itr)->address() + " belongs in " + shardname( j.shards->of( j.mode, (*itr)->address() ) ) );
+		ok = false;
+	}
+
+	j.ok[ i ] = ok;
+}
+
+bool loadshards( datamode m, const std::string &dir, const APERshards &sh, APERdb::Nodes &v, codec &format )
+{
+	ShardLoad job;
+	job.mode = m;
+	job.dir = dir;
+	job.shards = &sh;
+	job.ok.assign( sh.count, 0 );
+	job.formats.assign( sh.count, plain );
+
+	for ( unsigned int i = 0; i < sh.count; ++i )
+		job.parts.push_back( new APERlist( m ) );
+
+	parallelfor( sh.count, shardloadjob, &job );
+
+	bool ok = true;
+	v.clear();
+
+	for ( unsigned int i = 0; i < sh.count; ++i )
+	{
+		ok = ok && job.ok[ i ];
+
+		APERdb::Nodes n;
+		job.parts[ i ]->db.nodes( n );
+		job.parts[ i ]->db.release();
+		delete job.parts[ i ];
+
+		v.insert( v.end(), n.begin(), n.end() );
+	}
+
+	format = job.formats[ 0 ];
+
+	return ( ok );
+}
+
+/////////////////////////////////////////////////////
+//      writeshards                                //
+/////////////////////////////////////////////////////
+// write back the dirty shards of a list into dir, each sorted on its
+// own and committed with its own rename.
+
+struct ShardWrite
+{
+	APERlist *list;
+	std::string dir;
+	std::vector<APERdb::Nodes> shards;
+	std::vector<char> ok;
+};
+
+static void shardwritejob( std::size_t i, void *arg )
+{
+	ShardWrite &j = *static_cast<ShardWrite *>( arg );
+	APERlist &l = *j.list;
+
+	if ( ! l.shards.dirty[ i ] ) return;
+
+	APERdb::Nodes &v = j.shards[ i ];
+	sortnodes( v );
+
+	const char *tmpfile = tempnam( j.dir.c_str(), tmpprefix );
+
+	APERoutput out;
+	if ( ! out.open( tmpfile, l.outcodec == keep ? l.listcodec : l.outcodec ) )
+	{
+		errnotify( EXFILE, tmpfile );
+		j.ok[ i ] = 0;
+		return;
+	}
+
+	out.compare( j.dir + "/" + shardname( i ) );
+
+	for ( APERdb::Nodes::iterator itr = v.begin(); itr != v.end(); ++itr )
+		(*itr)->write( out.stream() );
+
+	if ( ! out.close() )
+	{
+		errnotify( EXFILE, tmpfile );
+		if ( unlink( tmpfile ) != 0 ) errnotify( EXFILERM, tmpfile );
+		j.ok[ i ] = 0;
+		return;
+	}
+
+	j.ok[ i ] = commitaperfile( tmpfile, j.dir + "/" + shardname( i ), out.unchanged() );
+}
+
+bool writeshards( APERlist &l, const std::string &dir )
+{
+	ShardWrite job;
+	job.list = &l;
+	job.dir = dir;
+	job.shards.resize( l.shards.count );
+	job.ok.assign( l.shards.count, 1 );
+
+	APERdb::Nodes v;
+	l.db.nodes( v );
+
+	for ( APERdb::Nodes::iterator itr = v.begin(); itr != v.end(); ++itr )
+	{
+		unsigned int i = l.shards.of( l.mode, (*itr)->address() );
+		if ( l.shards.dirty[ i ] ) job.shards[ i ].push_back( *itr );
+	}
+
+	parallelfor( l.shards.count, shardwritejob, &job );
+
+	if ( std::count( job.ok.begin(), job.ok.end(), 0 ) ) return ( false );
+
+	l.shards.dirty.assign( l.shards.count, false );
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      shardlist                                  //
+/////////////////////////////////////////////////////
+// split a loaded list into count shards.  the new layout is built off
+// to the side and renamed into place, then whatever the list was kept
+// in before is removed.
+
+bool shardlist( APERlist &l, unsigned int count, shardkey by )
+{
+	std::string file = l.file();
+	std::string dir = file + shardsuffix;
+	std::string newdir = tempnam( dirof( file ).c_str(), tmpprefix );
+
+	if ( mkdir( newdir.c_str(), 0777 ) != 0 ) { errnotify( ESHARD, newdir ); return ( false ); }
+
+	l.shards.by = by;
+	l.shards.count = count;
+	l.shards.dirty.assign( count, true );
+
+	if ( ! writeshards( l, newdir ) || ! writemanifest( l, newdir ) )
+	{
+		removeshards( newdir );
+		return ( false );
+	}
+
+	std::string olddir;
+
+	if ( access( dir.c_str(), F_OK ) == 0 )
+	{
+		olddir = tempnam( dirof( file ).c_str(), tmpprefix );
+		if ( rename( dir.c_str(), olddir.c_str() ) != 0 )
+		{
+			errnotify( ESHARD, dir );
+			removeshards( newdir );
+			return ( false );
+		}
+	}
+
+// put the old layout back if the new one can't take its place, or the
+// list is left under a temporary name.
+
+	if ( rename( newdir.c_str(), dir.c_str() ) != 0 )
+	{
+		errnotify( ESHARD, dir );
+		if ( ! olddir.empty() && rename( olddir.c_str(), dir.c_str() ) != 0 ) errnotify( ESHARD, olddir );
+		removeshards( newdir );
+		return ( false );
+	}
+
+	if ( ! olddir.empty() ) return ( removeshards( olddir ) );
+
+	if ( unlink( file.c_str() ) != 0 && errno != ENOENT )
+	{
+		errnotify( EXFILERM, file );
+		return ( false );
+	}
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      unshardlist                                //
+/////////////////////////////////////////////////////
+// write a sharded list in its single file form, to file or stdout.
+// with rewrite the list goes back to being kept that way.
+
+bool unshardlist( APERlist &l, std::string file, bool rewrite )
+{
+	if ( l.shards.count == 0 )
+	{
+		errnotify( ESHARD, l.file() + " is not sharded" );
+		return ( false );
+	}
+
+	if ( rewrite )
+	{
+		if ( ! writelistfile( l, l.file() ) ) return ( false );
+
+		l.shards = APERshards();
+
+		return ( removeshards( l.file() + shardsuffix ) );
+	}
+
+	if ( ! file.empty() ) return ( writelistfile( l, file ) );
+
+	putlist( l, std::cout );
+	std::cout.flush();
+
+	return ( std::cout.good() );
+}
+
+/////////////////////////////////////////////////////
+//      removeshards                               //
+/////////////////////////////////////////////////////
+
+bool removeshards( const std::string &dir )
+{
+	DIR *d = opendir( dir.c_str() );
+	if ( d == 0 ) { errnotify( EXFILERM, dir ); return ( false ); }
+
+	bool ok = true;
+
+	for ( struct dirent *e; ( e = readdir( d ) ) != 0; )
+	{
+		std::string name = e->d_name;
+		if ( name == "." || name == ".." ) continue;
+
+		std::string file = dir + "/" + name;
+		if ( unlink( file.c_str() ) != 0 ) { errnotify( EXFILERM, file ); ok = false; }
+	}
+
+	closedir( d );
+
+	if ( ok && rmdir( dir.c_str() ) != 0 ) { errnotify( EXFILERM, dir ); ok = false; }
+
+	return ( ok );
+}
+
+/////////////////////////////////////////////////////
+//      loadlocked                                 //
+/////////////////////////////////////////////////////
+// load a list for reading, holding its lock only while loading so that
+// a sharded list is never seen half written.
+
+bool loadlocked( APERlist &l )
+{
+	if ( ! l.lock.lock( l.lockfile() ) ) { errnotify( ELOCK, l.file() ); return ( false ); }
+	bool ok = loadaperdb( l );
+	l.lock.unlock();
+
+	if ( ! ok ) errnotify( EAPERDB, l.file() );
+
+	return ( ok );
+}
+
+/////////////////////////////////////////////////////
+//      activerecords                              //
+/////////////////////////////////////////////////////
+// the records of a loaded list as they would be written, in order.
+
+void activerecords( const APERlist &l, std::vector<APERrecord> &v )
+{
+	APERdb::Nodes nodes;
+	l.db.sorted( nodes );
+
+	v.clear();
+	v.reserve( nodes.size() );
+
+	for ( APERdb::Nodes::iterator itr = nodes.begin(); itr != nodes.end(); ++itr )
+	{
+		if ( l.mode == reply && dynamic_cast<APERreply *>( *itr )->iscleared() ) continue;
+
+		v.push_back( APERrecord() );
+		noderecord( l.mode, *itr, v.back() );
+	}
+}
+
+/////////////////////////////////////////////////////
+//      publishsnapshot                            //
+/////////////////////////////////////////////////////
+// build a snapshot of the reply and links lists next to file and rename
+// it into place.  readers still on the old snapshot keep a good copy
+// mapped until they see it marked superseded and move on.
+
+bool publishsnapshot( const std::string &file )
+{
+	std::vector<APERrecord> records[ nummodes ];
+
+	for ( int m = 0; m < nummodes; ++m )
+	{
+		if ( m == cleared ) continue;
+
+		APERlist l( static_cast<datamode>( m ) );
+		if ( ! loadlocked( l ) ) return ( false );
+
+		activerecords( l, records[ m ] );
+	}
+
+// lay out the header, then each list's buckets at half load, then the
+// strings.
+
+	APERsnapheader h;
+	memset( &h, 0, sizeof( h ) );
+	memcpy( h.magic, snapmagic, sizeof( h.magic ) );
+	h.version = snapversion;
+
+	uint64_t at = sizeof( h );
+
+	for ( int m = 0; m < nummodes; ++m )
+	{
+		uint64_t n = 1;
+		while ( n < 2 * records[ m ].size() ) n <<= 1;
+
+		h.table[ m ].buckets = at;
+		h.table[ m ].mask = n - 1;
+		h.table[ m ].count = records[ m ].size();
+		at += n * sizeof( APERsnapbucket );
+	}
+
+	uint64_t strings = at;
+
+	for ( int m = 0; m < nummodes; ++m )
+		for ( std::vector<APERrecord>::iterator itr = records[ m ].begin(); itr != records[ m ].end(); ++itr )
+			at += itr->address.size() + itr->addrt.size() + itr->date.size() + 3;
+
+	h.size = at;
+
+// the snapshot being replaced, if any, gives the generation and gets
+// marked once the new one is in place.
+
+	APERsnapheader *old = 0;
+	std::size_t oldsize = 0;
+
+	int fd = open( file.c_str(), O_RDWR );
+	if ( fd >= 0 )
+	{
+		struct stat st;
+		if ( fstat( fd, &st ) == 0 && st.st_size >= static_cast<off_t>( sizeof( h ) ) )
+		{
+			void *p = mmap( 0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+
+			if ( p != MAP_FAILED )
+			{
+				old = static_cast<APERsnapheader *>( p );
+				oldsize = st.st_size;
+				if ( memcmp( old->magic, snapmagic, sizeof( snapmagic ) ) == 0 ) h.generation = old->generation + 1;
+			}
+		}
+
+		close( fd );
+	}
+
+	std::vector<char> buf( h.size, 0 );
+	memcpy( &buf[0], &h, sizeof( h ) );
+
+	for ( int m = 0; m < nummodes; ++m )
+	{
+		APERsnaptable &t = h.table[ m ];
+		APERsnapbucket *b = reinterpret_cast<APERsnapbucket *>( &buf[ t.buckets ] );
+
+		for ( std::vector<APERrecord>::iterator itr = records[ m ].begin(); itr != records[ m ].end(); ++itr )
+		{
+			uint32_t hash = hash32( itr->address );
+			uint64_t i = hash & t.mask;
+			while ( b[ i ].entry != 0 ) i = ( i + 1 ) & t.mask;
+
+			b[ i ].hash = hash;
+			b[ i ].entry = strings;
+
+			std::string e = itr->address + '\0' + itr->addrt + '\0' + itr->date + '\0';
+			memcpy( &buf[ strings ], e.data(), e.size() );
+			strings += e.size();
+		}
+	}
+
+	const char *tmpfile = tempnam( dirof( file ).c_str(), tmpprefix );
+	bool ok = false;
+
+	fd = open( tmpfile, O_WRONLY | O_CREAT | O_EXCL, 0644 );
+	if ( fd >= 0 )
+	{
+		ok = true;
+
+		for ( std::size_t w = 0; ok && w < buf.size(); )
+		{
+			ssize_t k = write( fd, &buf[0] + w, buf.size() - w );
+			if ( k < 0 && errno == EINTR ) continue;
+			if ( k <= 0 ) ok = false;
+			else w += k;
+		}
+
+		if ( close( fd ) != 0 ) ok = false;
+	}
+
+	if ( ! ok )
+	{
+		errnotify( EXFILE, tmpfile );
+		unlink( tmpfile );
+	}
+	else
+		ok = commitaperfile( tmpfile, file );
+
+	if ( old )
+	{
+		if ( ok ) __sync_fetch_and_or( &old->superseded, 1 );
+		munmap( old, oldsize );
+	}
+
+	return ( ok );
+}
+
+/////////////////////////////////////////////////////
+//      mapsnapshot                                //
+/////////////////////////////////////////////////////
+// map a snapshot read only, after checking that it is one.
+
+bool mapsnapshot( const std::string &file, const char *&base, std::size_t &size )
+{
+	int fd = open( file.c_str(), O_RDONLY );
+	if ( fd < 0 ) return ( false );
+
+	struct stat st;
+	void *p = MAP_FAILED;
+
+	if ( fstat( fd, &st ) == 0 && st.st_size >= static_cast<off_t>( sizeof( APERsnapheader ) ) )
+		p = mmap( 0, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+
+	close( fd );
+	if ( p == MAP_FAILED ) return ( false );
+
+	const APERsnapheader *h = static_cast<const APERsnapheader *>( p );
+	bool ok = memcmp( h->magic, snapmagic, sizeof( snapmagic ) ) == 0 &&
+		h->version == snapversion && h->size == static_cast<uint64_t>( st.st_size );
+
+	for ( int m = 0; ok && m < nummodes; ++m )
+	{
+		const APERsnaptable &t = h->table[ m ];
+		ok = ( ( t.mask + 1 ) & t.mask ) == 0 && t.buckets + ( t.mask + 1 ) * sizeof( APERsnapbucket ) <= h->size;
+	}
+
+	if ( ! ok )
+	{
+		munmap( p, st.st_size );
+		return ( false );
+	}
+
+	base = static_cast<const char *>( p );
+	size = st.st_size;
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      APERmerkle::depthfor                       //
+/////////////////////////////////////////////////////
+// the depth that gives a list of so many entries no more than
+// merkleleaf to a leaf, short of maxmerkledepth.
+
+unsigned int APERmerkle::depthfor( std::size_t entries )
+{
+	unsigned int depth = 0;
+
+	while ( depth < maxmerkledepth && ( merkleleaf << depth ) < entries ) ++depth;
+
+	return ( depth );
+}
+
+/////////////////////////////////////////////////////
+//      APERmerkle::leaf                           //
+/////////////////////////////////////////////////////
+// the leaf a key belongs to, counted from 0.
+
+std::size_t APERmerkle::leaf( const std::string &key ) const
+{
+	return ( _depth ? hash32( key ) >> ( 32 - _depth ) : 0 );
+}
+
+/////////////////////////////////////////////////////
+//      APERmerkle::build                          //
+/////////////////////////////////////////////////////
+// v is a list's records in list order, as activerecords() gives them.
+// they're sorted into their leaves keeping that order.
+
+void APERmerkle::build( datamode m, const std::vector<APERrecord> &v, unsigned int depth )
+{
+	_depth = depth;
+
+	std::size_t n = leaves();
+	std::vector<std::size_t> of( v.size() );
+
+	_first.assign( n + 1, 0 );
+
+	for ( std::size_t i = 0; i < v.size(); ++i )
+	{
+		of[ i ] = leaf( v[ i ].address );
+		++_first[ of[ i ] + 1 ];
+	}
+
+	for ( std::size_t i = 0; i < n; ++i ) _first[ i + 1 ] += _first[ i ];
+
+	std::vector<std::size_t> at( _first.begin(), _first.end() - 1 );
+
+	_records.resize( v.size() );
+	for ( std::size_t i = 0; i < v.size(); ++i ) _records[ at[ of[ i ] ]++ ] = v[ i ];
+
+	_digest.assign( 2 * n, std::string() );
+	_count.assign( 2 * n, 0 );
+
+	for ( std::size_t i = 0; i < n; ++i )
+	{
+		std::string text;
+
+		for ( std::size_t j = _first[ i ]; j < _first[ i + 1 ]; ++j )
+			text += formatrecord( m, _records[ j ] ) + '\n';
+
+		_digest[ n + i ] = md5hex( text );
+		_count[ n + i ] = _first[ i + 1 ] - _first[ i ];
+	}
+
+	for ( std::size_t i = n - 1; i > 0; --i )
+	{
+		_digest[ i ] = md5hex( _digest[ 2 * i ] + _digest[ 2 * i + 1 ] );
+		_count[ i ] = _count[ 2 * i ] + _count[ 2 * i + 1 ];
+	}
+}
+
+/////////////////////////////////////////////////////
+//      APERmerkle::records                        //
+/////////////////////////////////////////////////////
+// add the records under a leaf node to v.
+
+void APERmerkle::records( std::size_t node, std::vector<APERrecord> &v ) const
+{
+	std::size_t i = node - leaves();
+
+	v.insert( v.end(), _records.begin() + _first[ i ], _records.begin() + _first[ i + 1 ] );
+}
+
+/////////////////////////////////////////////////////
+//      APERlocalpeer                              //
+/////////////////////////////////////////////////////
+
+bool APERlocalpeer::digests( const std::vector<std::size_t> &nodes, std::vector<std::string> &d )
+{
+	d.clear();
+
+	for ( std::vector<std::size_t>::const_iterator itr = nodes.begin(); itr != nodes.end(); ++itr )
+		d.push_back( _t.digest( *itr ) );
+
+	return ( true );
+}
+
+bool APERlocalpeer::records( const std::vector<std::size_t> &leaves, std::vector<APERrecord> &v )
+{
+	v.clear();
+
+	for ( std::vector<std::size_t>::const_iterator itr = leaves.begin(); itr != leaves.end(); ++itr )
+		_t.records( *itr, v );
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      APERremotepeer::open                       //
+/////////////////////////////////////////////////////
+// run the command by /bin/sh with one end of a socket pair for its
+// stdin and stdout, and wait for the server to say which list it has.
+// a socket rather than pipes so that a server going away is an error
+// from send() rather than SIGPIPE.
+
+bool APERremotepeer::open( const std::string &command )
+{
+	close();
+
+	int sv[ 2 ];
+	if ( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) != 0 ) { errnotify( ESYNC, command ); return ( false ); }
+
+	_pid = fork();
+
+	if ( _pid == 0 )
+	{
+		dup2( sv[ 1 ], 0 );
+		dup2( sv[ 1 ], 1 );
+		::close( sv[ 0 ] );
+		::close( sv[ 1 ] );
+
+		execl( "/bin/sh", "sh", "-c", command.c_str(), static_cast<char *>( 0 ) );
+		_exit( 127 );
+	}
+
+	::close( sv[ 1 ] );
+
+	if ( _pid < 0 )
+	{
+		::close( sv[ 0 ] );
+		errnotify( ESYNC, command );
+		return ( false );
+	}
+
+	_fd = sv[ 0 ];
+
+// the server's first line names the list and the depth of its tree.
+
+	std::string header = std::string( 1, tokcomment ) + " aper merkle " + listname( _m ) + ' ';
+	std::string s;
+
+	if ( getline( s ) && s.compare( 0, header.size(), header ) == 0 )
+	{
+		std::string n = s.substr( header.size() );
+
+		if ( ! n.empty() && n.size() <= 2 && n.find_first_not_of( "0123456789" ) == std::string::npos &&
+				( _depth = atoi( n.c_str() ) ) <= maxmerkledepth )
+			return ( true );
+	}
+
+	errnotify( ESYNC, "no \"" + header + "depth\" from " + command );
+	return ( false );
+}
+
+/////////////////////////////////////////////////////
+//      APERremotepeer::close                      //
+/////////////////////////////////////////////////////
+// hang up, which ends the server, and wait for the command.
+
+bool APERremotepeer::close( void )
+{
+	if ( _fd >= 0 ) ::close( _fd );
+	_fd = -1;
+
+	if ( _pid <= 0 ) return ( true );
+
+	int status = 0;
+	while ( waitpid( _pid, &status, 0 ) < 0 && errno == EINTR ) ;
+	_pid = -1;
+
+	return ( WIFEXITED( status ) && WEXITSTATUS( status ) == 0 );
+}
+
+/////////////////////////////////////////////////////
+//      APERremotepeer::digests                    //
+/////////////////////////////////////////////////////
+// "d node ..." is answered by a line of their digests.
+
+bool APERremotepeer::digests( const std::vector<std::size_t> &nodes, std::vector<std::string> &d )
+{
+	d.clear();
+
+	std::string s;
+	if ( ! request( 'd', nodes ) || ! getline( s ) ) { errnotify( ESYNC, "lost the server" ); return ( false ); }
+
+	std::istringstream is( s );
+	std::string digest;
+	while ( is >> digest ) d.push_back( digest );
+
+	if ( d.size() != nodes.size() ) { errnotify( ESYNC, "bad digests: " + s ); return ( false ); }
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      APERremotepeer::records                    //
+/////////////////////////////////////////////////////
+// "r leaf ..." is answered by the records under the leaves and a line
+// holding just ".".
+
+bool APERremotepeer::records( const std::vector<std::size_t> &leaves, std::vector<APERrecord> &v )
+{
+	v.clear();
+
+	if ( ! request( 'r', leaves ) ) { errnotify( ESYNC, "lost the server" ); return ( false ); }
+
+	std::string s;
+
+	while ( getline( s ) )
+	{
+		if ( s == "." ) return ( true );
+
+		APERrecord r;
+		errstate err = parserecord( _m, s, r, true );
+		if ( err != EOK ) { recorderror( err, r, 0 ); return ( false ); }
+
+		v.push_back( r );
+	}
+
+	errnotify( ESYNC, "lost the server" );
+	return ( false );
+}
+
+bool APERremotepeer::request( char op, const std::vector<std::size_t> &nodes )
+{
+	std::ostringstream os;
+	os << op;
+	for ( std::vector<std::size_t>::const_iterator itr = nodes.begin(); itr != nodes.end(); ++itr ) os << ' ' << *itr;
+	os << '\n';
+
+	std::string s = os.str();
+
+	for ( std::size_t w = 0; w < s.size(); )
+	{
+		ssize_t k = send( _fd, s.data() + w, s.size() - w, MSG_NOSIGNAL );
+		if ( k < 0 && errno == EINTR ) continue;
+		if ( k <= 0 ) return ( false );
+		w += k;
+	}
+
+	return ( true );
+}
+
+bool APERremotepeer::getline( std::string &s )
+{
+	for ( ;; )
+	{
+		std::string::size_type nl = _in.find( '\n', _at );
+
+		if ( nl != std::string::npos )
+		{
+			s.assign( _in, _at, nl - _at );
+			_at = nl + 1;
+			return ( true );
+		}
+
+		_in.erase( 0, _at );
+		_at = 0;
+
+		char buf[ 65536 ];
+		ssize_t k = recv( _fd, buf, sizeof( buf ), 0 );
+		if ( k < 0 && errno == EINTR ) continue;
+		if ( k <= 0 ) return ( false );
+
+		_in.append( buf, k );
+	}
+}
+
+/////////////////////////////////////////////////////
+//      dumpmerkle                                 //
+/////////////////////////////////////////////////////
+// write the tree of a loaded list down to depth levels below the root,
+// a node per line: its number, how many entries are under it and its
+// digest.
+
+bool dumpmerkle( APERlist &l, unsigned int depth )
+{
+	std::vector<APERrecord> v;
+	activerecords( l, v );
+
+	APERmerkle t;
+	t.build( l.mode, v, APERmerkle::depthfor( v.size() ) );
+
+	std::cout << tokcomment << " aper merkle " << listname( l.mode ) << ' ' << t.depth() << '\n';
+
+	depth = std::min( depth, t.depth() );
+
+	for ( std::size_t i = 1; i < ( static_cast<std::size_t>( 2 ) << depth ); ++i )
+		std::cout << i << '\t' << t.count( i ) << '\t' << t.digest( i ) << '\n';
+
+	std::cout.flush();
+
+	return ( std::cout.good() );
+}
+
+/////////////////////////////////////////////////////
+//      servesync                                  //
+/////////////////////////////////////////////////////
+// answer a sync at the other end of stdin and stdout from the list
+// here, until it hangs up.
+
+bool servesync( APERlist &l )
+{
+	if ( ! loadlocked( l ) ) return ( false );
+
+	std::vector<APERrecord> v;
+	activerecords( l, v );
+
+	APERmerkle t;
+	t.build( l.mode, v, APERmerkle::depthfor( v.size() ) );
+
+	std::cout << tokcomment << " aper merkle " << listname( l.mode ) << ' ' << t.depth() << std::endl;
+
+	std::string s;
+
+	while ( getline( std::cin, s ) )
+	{
+		std::istringstream is( s );
+		char op = 0;
+		std::size_t n;
+		std::vector<std::size_t> nodes;
+
+		is >> op;
+		while ( is >> n ) nodes.push_back( n );
+
+		bool ok = is.eof() && ( op == 'd' || op == 'r' );
+
+		for ( std::size_t i = 0; ok && i < nodes.size(); ++i )
+			ok = nodes[ i ] >= ( op == 'r' ? t.leaves() : 1 ) && nodes[ i ] < 2 * t.leaves();
+
+		if ( ! ok ) { errnotify( ESYNC, "bad request: " + s ); return ( false ); }
+
+		if ( op == 'd' )
+		{
+			for ( std::size_t i = 0; i < nodes.size(); ++i )
+				std::cout << ( i ? " " : "" ) << t.digest( nodes[ i ] );
+			std::cout << '\n';
+		}
+		else
+		{
+			v.clear();
+			for ( std::size_t i = 0; i < nodes.size(); ++i ) t.records( nodes[ i ], v );
+
+			for ( std::vector<APERrecord>::iterator itr = v.begin(); itr != v.end(); ++itr )
+				std::cout << formatrecord( l.mode, *itr ) << '\n';
+			std::cout << ".\n";
+		}
+
+		std::cout.flush();
+		if ( ! std::cout ) return ( false );
+	}
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      synclist                                   //
+/////////////////////////////////////////////////////
+// make a loaded list the same as the copy in dir, or the one served by
+// command, by comparing their trees from the root down and fetching
+// only the leaves that differ.  every entry here under those leaves,
+// cleared reply entries too, is replaced by the other copy's.  writes
+// what was compared and fetched to stdout.
+
+// list a record as given, with none of the rules for merging new data.
+
+static bool listrecord( APERlist &l, const APERrecord &r )
+{
+	APERnode *node = 0;
+
+	switch ( l.mode )
+	{
+		case reply:		node = new (std::nothrow) APERreply; break;
+		case links:		node = new (std::nothrow) APERlinks; break;
+		default:		node = new (std::nothrow) APERcleared; break;
+	}
+
+	if ( node == 0 ) return ( false );
+
+	node->address( r.address );
+	node->date( r.date );
+	if ( l.mode == reply ) dynamic_cast<APERreply *>( node )->addrtype( r.addrt );
+
+	if ( l.db.insert( node ) != node )
+	{
+		delete node;
+		return ( false );
+	}
+
+	l.touch( r.address );
+
+	return ( true );
+}
+
+bool synclist( APERlist &l, const std::string &dir, const std::string &command )
+{
+	std::vector<APERrecord> v;
+
+	APERlist src( l.mode, dir );
+	APERmerkle st;
+	APERlocalpeer local( st );
+	APERremotepeer remote( l.mode );
+	APERsyncpeer *peer = &local;
+
+// this list's lock is held, so syncing it with itself would wait for
+// ever.  the lock files are the same file however dir is written.
+
+	struct stat here, there;
+
+	if ( command.empty() && stat( l.lockfile().c_str(), &here ) == 0 && stat( src.lockfile().c_str(), &there ) == 0 &&
+			here.st_dev == there.st_dev && here.st_ino == there.st_ino )
+	{
+		errnotify( ESYNC, dir + " is this list" );
+		return ( false );
+	}
+
+	if ( command.empty() )
+	{
+		if ( ! loadlocked( src ) ) return ( false );
+
+		activerecords( src, v );
+		st.build( l.mode, v, APERmerkle::depthfor( v.size() ) );
+	}
+	else
+	{
+		if ( ! remote.open( command ) ) return ( false );
+		peer = &remote;
+	}
+
+// the tree here is built to the other copy's depth, so that a leaf
+// fetched from it is no bigger than that copy's size makes it.
+
+	activerecords( l, v );
+
+	APERmerkle t;
+	t.build( l.mode, v, peer->depth() );
+
+// a level at a time, ask only about the children of nodes that differ.
+
+	std::vector<std::size_t> nodes( 1, 1 ), differ;
+	std::size_t compared = 0;
+
+	for ( ;; )
+	{
+		std::vector<std::string> d;
+		if ( ! peer->digests( nodes, d ) ) return ( false );
+		compared += nodes.size();
+
+		differ.clear();
+		for ( std::size_t i = 0; i < nodes.size(); ++i )
+			if ( d[ i ] != t.digest( nodes[ i ] ) ) differ.push_back( nodes[ i ] );
+
+		if ( differ.empty() || differ[ 0 ] >= t.leaves() ) break;
+
+		nodes.clear();
+		for ( std::vector<std::size_t>::iterator itr = differ.begin(); itr != differ.end(); ++itr )
+		{
+			nodes.push_back( 2 * *itr );
+			nodes.push_back( 2 * *itr + 1 );
+		}
+	}
+
+	std::size_t replaced = 0;
+
+	if ( ! differ.empty() )
+	{
+		if ( ! peer->records( differ, v ) ) return ( false );
+
+		std::vector<bool> fetched( t.leaves(), false );
+
+		for ( std::vector<std::size_t>::iterator itr = differ.begin(); itr != differ.end(); ++itr )
+		{
+			fetched[ *itr - t.leaves() ] = true;
+			replaced += t.count( *itr );
+		}
+
+		APERdb::Nodes all;
+		l.db.nodes( all );
+
+		for ( APERdb::Nodes::iterator itr = all.begin(); itr != all.end(); ++itr )
+		{
+			std::string key = (*itr)->address();
+			if ( ! fetched[ t.leaf( key ) ] ) continue;
+
+			l.db.erase( key );
+			l.touch( key );
+		}
+
+		for ( std::vector<APERrecord>::iterator itr = v.begin(); itr != v.end(); ++itr )
+		{
+			if ( ! fetched[ t.leaf( itr->address ) ] || ! listrecord( l, *itr ) )
+			{
+				errnotify( ESYNC, "unexpected entry: " + itr->address );
+				return ( false );
+			}
+		}
+	}
+
+	if ( ! remote.close() ) { errnotify( ESYNC, "failed: " + command ); return ( false ); }
+
+	std::cout << compared << '\t' << differ.size() << '\t' << ( differ.empty() ? 0 : v.size() ) << '\t' << replaced << std::endl;
+
+	return ( differ.empty() || writeaperdb( l ) );
+}
+
+/////////////////////////////////////////////////////
+//      watchlists                                 //
+/////////////////////////////////////////////////////
+// wait for lists to change and run the commands built from them.  only
+// returns if watching fails.
+
+static void addshardwatch( int fd, datamode m, const std::string &file, std::map<int, datamode> &wds )
+{
+	std::string dir = file + shardsuffix;
+
+	int wd = inotify_add_watch( fd, dir.c_str(), IN_MOVED_TO | IN_CLOSE_WRITE );
+	if ( wd >= 0 ) wds[ wd ] = m;
+}
+
+bool watchlists( const std::string &conffile, unsigned int debounce )
+{
+	APERwatch w[ nummodes ];
+	std::string names[ nummodes ];
+
+	if ( ! readwatchconf( conffile, w ) ) return ( false );
+
+	for ( int m = 0; m < nummodes; ++m )
+	{
+		names[ m ] = APERlist( static_cast<datamode>( m ) ).name();
+		if ( w[ m ].watched && ! rebuildwatch( static_cast<datamode>( m ), w[ m ], false ) ) return ( false );
+	}
+
+	int fd = inotify_init();
+	if ( fd < 0 || inotify_add_watch( fd, tmpdir, IN_MOVED_TO | IN_CLOSE_WRITE ) < 0 )
+	{
+		errnotify( EWATCH, strerror( errno ) );
+		return ( false );
+	}
+
+	std::map<int, datamode> shardwds;
+
+	for ( int m = 0; m < nummodes; ++m )
+		addshardwatch( fd, static_cast<datamode>( m ), names[ m ], shardwds );
+
+	std::vector<char> buf( iobufsize );
+	bool pending = false;
+
+	for ( ;; )
+	{
+		struct pollfd p;
+		p.fd = fd;
+		p.events = POLLIN;
+
+		int r = poll( &p, 1, pending ? static_cast<int>( debounce ) : -1 );
+		if ( r < 0 && errno == EINTR ) continue;
+		if ( r < 0 ) break;
+
+// quiet for long enough, act on what changed.
+
+		if ( r == 0 )
+		{
+			if ( w[ cleared ].changed ) w[ reply ].changed = true;
+
+			for ( int m = 0; m < nummodes; ++m )
+			{
+				if ( w[ m ].changed && w[ m ].watched ) rebuildwatch( static_cast<datamode>( m ), w[ m ], true );
+				w[ m ].changed = false;
+			}
+
+			pending = false;
+			continue;
+		}
+
+		ssize_t n = read( fd, &buf[0], buf.size() );
+		if ( n < 0 && errno == EINTR ) continue;
+		if ( n <= 0 ) break;
+
+		for ( char *e = &buf[0]; e < &buf[0] + n; )
+		{
+			struct inotify_event *ev = reinterpret_cast<struct inotify_event *>( e );
+			e += sizeof( struct inotify_event ) + ev->len;
+
+			std::map<int, datamode>::iterator s = shardwds.find( ev->wd );
+
+			if ( s != shardwds.end() )
+			{
+				if ( ev->mask & IN_IGNORED )
+					shardwds.erase( s );
+				else
+					w[ s->second ].changed = pending = true;
+
+				continue;
+			}
+
+			std::string name = ev->len ? ev->name : "";
+
+			for ( int m = 0; m < nummodes; ++m )
+			{
+				if ( name == names[ m ] )
+					w[ m ].changed = pending = true;
+
+				if ( name == names[ m ] + shardsuffix )
+				{
+					addshardwatch( fd, static_cast<datamode>( m ), names[ m ], shardwds );
+					w[ m ].changed = pending = true;
+				}
+			}
+		}
+	}
+
+	errnotify( EWATCH, strerror( errno ) );
+	close( fd );
+
+	return ( false );
+}
+
+/////////////////////////////////////////////////////
+//      readwatchconf                              //
+/////////////////////////////////////////////////////
+// lines of "list command", comments and blank lines allowed.
+
+bool readwatchconf( const std::string &file, APERwatch w[] )
+{
+	std::ifstream ifs( file.c_str() );
+	if ( ! ifs ) { errnotify( EFILE, file ); return ( false ); }
+
+	std::string s;
+	linenum_type line = 0;
+	bool any = false;
+
+	while ( getline( ifs, s ) )
+	{
+		++line;
 		trimspace( s, ENDS );
 		if ( s.empty() ) continue;
+		if ( s[0] == tokcomment ) continue;
+
+		std::string::size_type p = s.find_first_of( " \t" );
+		std::string list = s.substr( 0, p );
+		std::string command = ( p == std::string::npos ) ? "" : s.substr( p );
+		trimspace( command, ENDS );
+
+		int m = 0;
+		while ( m < nummodes && listname( static_cast<datamode>( m ) ) != list ) ++m;
+
+		if ( m == nummodes || command.empty() )
+			{ errnotify( EWATCH, file + ": " + s, line ); return ( false ); }
+
+		w[ m ].watched = any = true;
+		w[ m ].commands.push_back( command );
+	}
+
+	if ( ! any ) { errnotify( EWATCH, file + ": nothing to watch" ); return ( false ); }
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      rebuildwatch                               //
+/////////////////////////////////////////////////////
+// reload a watched list and, with run, hand what changed since it was
+// last loaded to its commands.  a list that won't load is left as it
+// was, to be tried again on its next change.
+
+bool rebuildwatch( datamode m, APERwatch &w, bool run )
+{
+	APERlist l( m );
+	if ( ! loadlocked( l ) ) return ( false );
+
+	std::vector<APERrecord> v;
+	activerecords( l, v );
+
+	if ( ! run ) { w.records.swap( v ); return ( true ); }
+
+	const char *deltafile = tempnam( tmpdir, tmpprefix );
+
+	std::ofstream ofs( deltafile );
+	if ( ! ofs ) { errnotify( EXFILE, deltafile ); return ( false ); }
+
+	APERvectorrecords o( w.records );
+	APERvectorrecords n( v );
+	std::size_t changes = 0;
+
+	writedelta( m, o, n, m == reply ? &l : 0, ofs, &changes );
+	ofs.close();
+
+	bool ok = ofs.good();
+	if ( ! ok ) errnotify( EXFILE, deltafile );
+
+	if ( ok && changes > 0 )
+	{
+		std::ostringstream count;
+		count << changes;
+
+		setenv( "APER_LIST", listname( m ).c_str(), 1 );
+		setenv( "APER_DELTA", deltafile, 1 );
+		setenv( "APER_CHANGES", count.str().c_str(), 1 );
+
+		for ( std::vector<std::string>::iterator itr = w.commands.begin(); itr != w.commands.end(); ++itr )
+		{
+			if ( system( itr->c_str() ) != 0 )
+			{
+				errnotify( ERUN, *itr );
+				ok = false;
+			}
+		}
+	}
+
+	if ( unlink( deltafile ) != 0 ) errnotify( EXFILERM, deltafile );
+
+	w.records.swap( v );
+
+	return ( ok );
+}
+
+/////////////////////////////////////////////////////
+//      monotonicms                                //
+/////////////////////////////////////////////////////
+// milliseconds on a clock that only goes forward, for timeouts.
+
+long long monotonicms( void )
+{
+	struct timespec t;
+	clock_gettime( CLOCK_MONOTONIC, &t );
+
+	return ( static_cast<long long>( t.tv_sec ) * 1000 + t.tv_nsec / 1000000 );
+}
+
+/////////////////////////////////////////////////////
+//      listensocket                               //
+/////////////////////////////////////////////////////
+// a non-blocking socket bound to addr, listening if it's a stream.  -1
+// with errno set if not.
+
+int listensocket( int family, const struct sockaddr *addr, socklen_t len, int type )
+{
+	int fd = socket( family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+	if ( fd < 0 ) return ( -1 );
+
+	int on = 1;
+	if ( family != AF_UNIX ) setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof( on ) );
+
+	if ( bind( fd, addr, len ) != 0 || ( type == SOCK_STREAM && listen( fd, SOMAXCONN ) != 0 ) )
+	{
+		int err = errno;
+		close( fd );
+		errno = err;
+		return ( -1 );
+	}
+
+	return ( fd );
+}
+
+/////////////////////////////////////////////////////
+//      watchreply                                 //
+/////////////////////////////////////////////////////
+// a non-blocking inotify descriptor watching for the reply and cleared
+// lists, and their shards, to be replaced or written.  -1 if not.
+
+int watchreply( std::map<int, datamode> &shardwds )
+{
+	int fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+	if ( fd < 0 ) return ( -1 );
+
+	if ( inotify_add_watch( fd, tmpdir, IN_MOVED_TO | IN_CLOSE_WRITE ) < 0 )
+	{
+		close( fd );
+		return ( -1 );
+	}
+
+	addshardwatch( fd, reply, APERlist( reply ).name(), shardwds );
+	addshardwatch( fd, cleared, APERlist( cleared ).name(), shardwds );
+
+	return ( fd );
+}
+
+/////////////////////////////////////////////////////
+//      replychanged                               //
+/////////////////////////////////////////////////////
+// read what is waiting on a watchreply() descriptor, true if any of it
+// is about the reply or cleared lists.
+
+bool replychanged( int fd, std::vector<char> &buf, std::map<int, datamode> &shardwds )
+{
+	std::string names[] = { APERlist( reply ).name(), APERlist( cleared ).name() };
+	datamode modes[] = { reply, cleared };
+	bool changed = false;
+	ssize_t k;
+
+	while ( ( k = read( fd, &buf[0], buf.size() ) ) > 0 )
+	{
+		for ( char *e = &buf[0]; e < &buf[0] + k; )
+		{
+			struct inotify_event *ev = reinterpret_cast<struct inotify_event *>( e );
+			e += sizeof( struct inotify_event ) + ev->len;
+
+			std::map<int, datamode>::iterator s = shardwds.find( ev->wd );
+
+			if ( s != shardwds.end() )
+			{
+				if ( ev->mask & IN_IGNORED ) shardwds.erase( s );
+				else changed = true;
+				continue;
+			}
+
+			std::string name = ev->len ? ev->name : "";
+
+			for ( int m = 0; m < 2; ++m )
+			{
+				if ( name == names[ m ] ) changed = true;
+
+				if ( name == names[ m ] + shardsuffix )
+				{
+					addshardwatch( fd, modes[ m ], names[ m ], shardwds );
+					changed = true;
+				}
+			}
+		}
+	}
+
+	return ( changed );
+}
+
+/////////////////////////////////////////////////////
+//      servednsbl                                 //
+/////////////////////////////////////////////////////
+// answer dns blocklist queries for zone from the reply list in memory,
+// over udp and tcp, on one thread.  the list is reloaded whole and
+// swapped in once it has been replaced and things are quiet.  only
+// returns if serving fails.
+
+static void closednsconn( int ep, int fd, std::map<int, APERdnsconn> &conns )
+{
+	epoll_ctl( ep, EPOLL_CTL_DEL, fd, 0 );
+	close( fd );
+	conns.erase( fd );
+}
+
+// answer the whole queries a tcp client has sent and send what it will
+// take.  false once the client is done with.
+
+static bool servednsconn( int ep, int fd, APERdnsconn &c, const APERdnsbl &d, const std::vector<std::string> &zone, std::string &a )
+{
+	while ( c.in.size() >= 2 )
+	{
+		std::size_t n = ( static_cast<unsigned char>( c.in[0] ) << 8 ) | static_cast<unsigned char>( c.in[1] );
+		if ( c.in.size() < n + 2 ) break;
+
+		if ( answerdns( d, zone, reinterpret_cast<const unsigned char *>( c.in.data() ) + 2, n, a, 65535 ) )
+		{
+			c.out += static_cast<char>( a.size() >> 8 );
+			c.out += static_cast<char>( a.size() & 0xff );
+			c.out += a;
+		}
+
+		c.in.erase( 0, n + 2 );
+	}
+
+	while ( ! c.out.empty() )
+	{
+		ssize_t k = send( fd, c.out.data(), c.out.size(), MSG_NOSIGNAL );
+		if ( k < 0 && errno == EINTR ) continue;
+		if ( k < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) break;
+		if ( k <= 0 ) return ( false );
+
+		c.out.erase( 0, k );
+	}
+
+	struct epoll_event ev;
+	memset( &ev, 0, sizeof( ev ) );
+	ev.events = c.out.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT;
+	ev.data.fd = fd;
+	epoll_ctl( ep, EPOLL_CTL_MOD, fd, &ev );
+
+	return ( true );
+}
+
+bool servednsbl( const std::string &zone, const std::string &address, unsigned int port, unsigned int debounce )
+{
+	std::vector<std::string> origin;
+	std::istringstream labels( tolowercase( zone ) );
+
+	for ( std::string s; getline( labels, s, tokdns ); )
+	{
+		if ( s.size() > 63 ) { errnotify( EOPTION, zone ); return ( false ); }
+		if ( ! s.empty() ) origin.push_back( s );
+	}
+
+	APERdnsbl d;
+	if ( ! loaddnsbl( d ) ) return ( false );
+
+	std::ostringstream service;
+	service << port;
+
+	struct addrinfo hints, *ai = 0;
+	memset( &hints, 0, sizeof( hints ) );
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	int r = getaddrinfo( address.c_str(), service.str().c_str(), &hints, &ai );
+	if ( r != 0 ) { errnotify( EOPTION, address + ": " + gai_strerror( r ) ); return ( false ); }
+
+	int udp = listensocket( ai->ai_family, ai->ai_addr, ai->ai_addrlen, SOCK_DGRAM );
+	int tcp = udp < 0 ? -1 : listensocket( ai->ai_family, ai->ai_addr, ai->ai_addrlen, SOCK_STREAM );
+	freeaddrinfo( ai );
+
+	if ( tcp < 0 )
+	{
+		errnotify( EDNSBL, address + " port " + service.str() + ": " + strerror( errno ) );
+		if ( udp >= 0 ) close( udp );
+		return ( false );
+	}
+
+	std::map<int, datamode> shardwds;
+	int ino = watchreply( shardwds );
+	int ep = epoll_create( 1 );
+
+	if ( ino < 0 || ep < 0 )
+	{
+		errnotify( EDNSBL, strerror( errno ) );
+		return ( false );
+	}
+
+	int fds[] = { udp, tcp, ino };
+
+	for ( int i = 0; i < 3; ++i )
+	{
+		struct epoll_event ev;
+		memset( &ev, 0, sizeof( ev ) );
+		ev.events = EPOLLIN;
+		ev.data.fd = fds[ i ];
+
+		if ( epoll_ctl( ep, EPOLL_CTL_ADD, fds[ i ], &ev ) != 0 )
+		{
+			errnotify( EDNSBL, strerror( errno ) );
+			return ( false );
+		}
+	}
+
+	std::map<int, APERdnsconn> conns;
+	std::vector<char> buf( iobufsize );
+	std::string a;
+	struct epoll_event events[ 64 ];
+	long long reload = -1;		// when to reload, -1 if nothing changed
+	time_t swept = time( 0 );
+
+	for ( ;; )
+	{
+		long long now = monotonicms();
+		int timeout = reload < 0 ? 1000 : static_cast<int>( std::max( 0LL, reload - now ) );
+
+		int n = epoll_wait( ep, events, 64, timeout );
+		if ( n < 0 && errno == EINTR ) continue;
+		if ( n < 0 ) break;
+
+		for ( int i = 0; i < n; ++i )
+		{
+			int fd = events[ i ].data.fd;
+
+			if ( fd == udp )
+			{
+				for ( int j = 0; j < 64; ++j )
+				{
+					struct sockaddr_storage from;
+					socklen_t fromlen = sizeof( from );
+
+					ssize_t k = recvfrom( udp, &buf[0], buf.size(), 0, reinterpret_cast<struct sockaddr *>( &from ), &fromlen );
+					if ( k < 0 ) break;
+
+					if ( answerdns( d, origin, reinterpret_cast<const unsigned char *>( &buf[0] ), k, a, 512 ) )
+						sendto( udp, a.data(), a.size(), 0, reinterpret_cast<struct sockaddr *>( &from ), fromlen );
+				}
+			}
+			else if ( fd == tcp )
+			{
+				int c;
+
+				while ( ( c = accept4( tcp, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC ) ) >= 0 )
+				{
+					struct epoll_event ev;
+					memset( &ev, 0, sizeof( ev ) );
+					ev.events = EPOLLIN;
+					ev.data.fd = c;
+
+					if ( conns.size() >= dnsblclients || epoll_ctl( ep, EPOLL_CTL_ADD, c, &ev ) != 0 )
+					{
+						close( c );
+						continue;
+					}
+
+					conns[ c ].active = time( 0 );
+				}
+			}
+			else if ( fd == ino )
+			{
+				if ( replychanged( ino, buf, shardwds ) ) reload = monotonicms() + debounce;
+			}
+			else
+			{
+				std::map<int, APERdnsconn>::iterator c = conns.find( fd );
+				if ( c == conns.end() ) continue;
+
+				bool open = ( events[ i ].events & ( EPOLLERR | EPOLLHUP ) ) == 0;
+
+				while ( open && ( events[ i ].events & EPOLLIN ) )
+				{
+					ssize_t k = recv( fd, &buf[0], buf.size(), 0 );
+					if ( k < 0 && errno == EINTR ) continue;
+					if ( k < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) break;
+					if ( k <= 0 ) { open = false; break; }
+
+					c->second.in.append( &buf[0], k );
+					c->second.active = time( 0 );
+				}
+
+				if ( ! open || ! servednsconn( ep, fd, c->second, d, origin, a ) )
+					closednsconn( ep, fd, conns );
+			}
+		}
+
+// the list is reloaded between queries, so every answer comes from one
+// whole list or the other.  a list that won't load leaves the old one.
+
+		if ( reload >= 0 && monotonicms() >= reload )
+		{
+			reload = -1;
+			loaddnsbl( d );
+		}
+
+		time_t t = time( 0 );
+
+		if ( t != swept )
+		{
+			swept = t;
+
+			for ( std::map<int, APERdnsconn>::iterator c = conns.begin(); c != conns.end(); )
+			{
+				int fd = c->first;
+				++c;
+				if ( t - conns[ fd ].active > static_cast<time_t>( dnsblidle ) ) closednsconn( ep, fd, conns );
+			}
+		}
+	}
+
+	errnotify( EDNSBL, strerror( errno ) );
+
+	return ( false );
+}
+
+/////////////////////////////////////////////////////
+//      loaddnsbl                                  //
+/////////////////////////////////////////////////////
+// load the active reply entries into d, indexed by address and by the
+// md5 of the local part with the domain, as addresses2bindzone.pl names
+// them.  d is only changed if the list loads.
+
+bool loaddnsbl( APERdnsbl &d )
+{
+	APERlist l( reply );
+	if ( ! loadlocked( l ) ) return ( false );
+
+	APERdnsbl n;
+	activerecords( l, n.records );
+	n.hashed.reserve( n.records.size() );
+
+	for ( std::size_t i = 0; i < n.records.size(); ++i )
+	{
+		const std::string &s = n.records[ i ].address;
+		std::string::size_type at = s.find( tokmail );
+
+		if ( at != std::string::npos )
+			n.hashed.push_back( APERdnsbl::Hashed( md5hex( s.substr( 0, at ) ) + s.substr( at ), i ) );
+	}
+
+	std::sort( n.hashed.begin(), n.hashed.end() );
+
+	d.records.swap( n.records );
+	d.hashed.swap( n.hashed );
+	d.serial = time( 0 );
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      answerdns                                  //
+/////////////////////////////////////////////////////
+// build the answer to the query q in a, no bigger than size.  names in
+// the zone are
+//
+//		<local part>.@.<domain>				A 127.1.0.<types>, TXT lastseen:<date>
+//		<md5 of local part>.<domain>.md5	the same
+//
+// where types has a bit for each of A to E, from 1 up.  false if the
+// query isn't worth an answer.
+
+static void putdns16( std::string &a, unsigned int v )
+{
+	a += static_cast<char>( ( v >> 8 ) & 0xff );
+	a += static_cast<char>( v & 0xff );
+}
+
+static void putdns32( std::string &a, uint32_t v )
+{
+	putdns16( a, v >> 16 );
+	putdns16( a, v & 0xffff );
+}
+
+// a record owned by the name at offset owner, rdata to follow.
+
+static void putdnsrr( std::string &a, std::size_t owner, unsigned int type, uint32_t ttl, std::size_t rdlength )
+{
+	putdns16( a, 0xc000 | owner );
+	putdns16( a, type );
+	putdns16( a, dnsclassin );
+	putdns32( a, ttl );
+	putdns16( a, rdlength );
+}
+
+static void putdnssoa( std::string &a, std::size_t zone, uint32_t serial )
+{
+	const char hostmaster[] = "\012hostmaster";
+
+	putdnsrr( a, zone, dnstypesoa, dnsblnegttl, 2 + sizeof( hostmaster ) - 1 + 2 + 20 );
+	putdns16( a, 0xc000 | zone );
+	a.append( hostmaster, sizeof( hostmaster ) - 1 );
+	putdns16( a, 0xc000 | zone );
+	putdns32( a, serial );
+	putdns32( a, 3600 );		// refresh
+	putdns32( a, 600 );			// retry
+	putdns32( a, 43200 );		// expire
+	putdns32( a, dnsblnegttl );
+}
+
+static std::string joinlabels( const std::vector<std::string> &v, std::size_t first, std::size_t last )
+{
+	std::string s;
+
+	for ( std::size_t i = first; i < last; ++i )
+	{
+		if ( i > first ) s += tokdns;
+		s += v[ i ];
+	}
+
+	return ( s );
+}
+
+bool answerdns( const APERdnsbl &d, const std::vector<std::string> &zone, const unsigned char *q, std::size_t n, std::string &a, std::size_t size )
+{
+	if ( n < 12 || ( q[2] & 0x80 ) ) return ( false );
+
+	unsigned int opcode = ( q[2] >> 3 ) & 0x0f;
+	unsigned int qdcount = ( q[4] << 8 ) | q[5];
+
+// the question name, lowercased, and where each label starts.
+
+	std::vector<std::string> labels;
+	std::vector<std::size_t> at;
+	std::size_t p = 12;
+	bool ok = opcode == 0 && qdcount == 1;
+
+	while ( ok && p < n && q[ p ] != 0 )
+	{
+		std::size_t len = q[ p ];
+
+		if ( len > 63 || p + 1 + len >= n || p + 1 + len > 12 + 255 ) { ok = false; break; }
+
+		at.push_back( p );
+		labels.push_back( tolowercase( std::string( reinterpret_cast<const char *>( q ) + p + 1, len ) ) );
+		p += 1 + len;
+	}
+
+	if ( ok && p + 5 > n ) ok = false;
+
+	std::size_t end = ok ? p + 5 : 12;
+	unsigned int qtype = ok ? ( q[ p + 1 ] << 8 ) | q[ p + 2 ] : 0;
+	unsigned int qclass = ok ? ( q[ p + 3 ] << 8 ) | q[ p + 4 ] : 0;
+
+	a.assign( reinterpret_cast<const char *>( q ), end );
+	a[2] = static_cast<char>( 0x80 | ( q[2] & 0x79 ) );		// qr, opcode, rd
+	a[3] = 0;
+	a[4] = 0; a[5] = ok ? 1 : 0;
+	for ( int i = 6; i < 12; ++i ) a[ i ] = 0;
+
+	if ( ! ok ) { a[3] = opcode == 0 ? dnsformerr : dnsnotimp; return ( true ); }
+
+	bool inzone = labels.size() >= zone.size() && ( qclass == dnsclassin || qclass == dnsclassany );
+
+	for ( std::size_t i = 0; inzone && i < zone.size(); ++i )
+		inzone = labels[ labels.size() - zone.size() + i ] == zone[ i ];
+
+	if ( ! inzone ) { a[3] = dnsrefused; return ( true ); }
+
+	a[2] |= 0x04;		// aa
+
+	std::size_t names = labels.size() - zone.size();
+	std::size_t origin = names < at.size() ? at[ names ] : p;
+
+// find the entry named, by md5 or as given.
+
+	const APERrecord *r = 0;
+
+	if ( names >= 3 && labels[ names - 1 ] == "md5" )
+	{
+		APERdnsbl::Hashed key( labels[0] + tokmail + joinlabels( labels, 1, names - 1 ), 0 );
+		std::vector<APERdnsbl::Hashed>::const_iterator h = std::lower_bound( d.hashed.begin(), d.hashed.end(), key );
+
+		if ( h != d.hashed.end() && h->first == key.first ) r = &d.records[ h->second ];
+	}
+	else
+	{
+		std::size_t mail = 1;
+		while ( mail < names && labels[ mail ] != std::string( 1, tokmail ) ) ++mail;
+
+		if ( mail + 1 < names )
+		{
+			APERrecord key;
+			key.address = joinlabels( labels, 0, mail ) + tokmail + joinlabels( labels, mail + 1, names );
+
+			std::vector<APERrecord>::const_iterator e = std::lower_bound( d.records.begin(), d.records.end(), key, recordless );
+			if ( e != d.records.end() && e->address == key.address ) r = &*e;
+		}
+	}
+
+	unsigned int answers = 0;
+
+	if ( names == 0 && ( qtype == dnstypesoa || qtype == dnstypeany ) )
+	{
+		putdnssoa( a, origin, d.serial );
+		++answers;
+	}
+
+	if ( r && ( qtype == dnstypea || qtype == dnstypeany ) )
+	{
+		unsigned int types = 0;
+
+		for ( std::size_t i = 0; i < replytypes.size(); ++i )
+			if ( r->addrt.find( replytypes[ i ] ) != std::string::npos ) types |= 1 << i;
+
+		putdnsrr( a, 12, dnstypea, dnsblttl, 4 );
+		a += static_cast<char>( 127 );
+		a += static_cast<char>( 1 );
+		a += static_cast<char>( 0 );
+		a += static_cast<char>( types );
+		++answers;
+	}
+
+	if ( r && ( qtype == dnstypetxt || qtype == dnstypeany ) )
+	{
+		std::string txt = "lastseen:" + r->date;
+
+		putdnsrr( a, 12, dnstypetxt, dnsblttl, 1 + txt.size() );
+		a += static_cast<char>( txt.size() );
+		a += txt;
+		++answers;
+	}
+
+// no such name, or nothing of the type asked for: say so with the soa,
+// for resolvers to cache the miss.
+
+	if ( answers == 0 )
+	{
+		if ( r == 0 && names > 0 ) a[3] = dnsnxdomain;
+		putdnssoa( a, origin, d.serial );
+		a[9] = 1;
+	}
+	else
+		a[7] = answers;
+
+	if ( a.size() > size )
+	{
+		a.resize( end );
+		a[2] |= 0x02;		// tc
+		a[7] = 0; a[9] = 0;
+	}
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      servetable                                 //
+/////////////////////////////////////////////////////
+// answer postfix lookups from the reply list in memory, on one thread,
+// for any number of clients.  a client can speak either protocol:
+//
+//		get <key>					tcp_table, 200 <action> or 500
+//		name=value ... <blank line>	policy delegation, action=<action> or
+//									action=DUNNO
+//
+// a policy request is listed if its recipient or sender is.  requests
+// are answered in place in the client's buffers.  the list is reloaded
+// as dnsbl does.  only returns if serving fails.
+
+static void closetableconn( int ep, int fd, std::map<int, APERtableconn> &conns )
+{
+	epoll_ctl( ep, EPOLL_CTL_DEL, fd, 0 );
+	close( fd );
+	conns.erase( fd );
+}
+
+static void puttable( APERtableconn &c, const char *p, std::size_t n )
+{
+	memcpy( c.out + c.outlen, p, n );
+	c.outlen += n;
+}
+
+// decode tcp_table's %XX escapes in place, giving the new length.
+
+static std::size_t urldecode( char *p, std::size_t n )
+{
+	std::size_t k = 0;
+
+	for ( std::size_t i = 0; i < n; ++i )
+	{
+		if ( p[ i ] == '%' && i + 2 < n && isxdigit( p[ i + 1 ] ) && isxdigit( p[ i + 2 ] ) )
+		{
+			char hex[ 3 ] = { p[ i + 1 ], p[ i + 2 ], 0 };
+			p[ k++ ] = static_cast<char>( strtol( hex, 0, 16 ) );
+			i += 2;
+		}
+		else
+			p[ k++ ] = p[ i ];
+	}
+
+	return ( k );
+}
+
+static std::string urlencode( const std::string &s )
+{
+	const char hex[] = "0123456789ABCDEF";
+	std::string e;
+
+	for ( std::string::const_iterator itr = s.begin(); itr != s.end(); ++itr )
+	{
+		unsigned char c = *itr;
+
+		if ( c <= ' ' || c >= 0x7f || c == '%' ) { e += '%'; e += hex[ c >> 4 ]; e += hex[ c & 0x0f ]; }
+		else e += c;
+	}
+
+	return ( e );
+}
+
+// whether the address in p, lowercased in place, is in the list and
+// was seen on or after since.
+
+static bool tablelisted( const APERtable &t, char *p, std::size_t n, const std::string &since )
+{
+	for ( std::size_t i = 0; i < n; ++i ) p[ i ] = tolower( static_cast<unsigned char>( p[ i ] ) );
+
+	const APERrecord *r = findtable( t, p, n );
+
+	return ( r != 0 && r->date.compare( since ) >= 0 );
+}
+
+// answer the whole lines in a client's input while there's room for
+// the answers.  false if the input can never make a whole line.
+
+static bool answertable( APERtableconn &c, const APERtable &t, const std::string &since,
+	const std::string &found, const std::string &listed )
+{
+	std::size_t start = 0;
+
+	while ( c.outlen + found.size() + listed.size() <= sizeof( c.out ) )
+	{
+		char *line = c.in + start;
+		char *nl = static_cast<char *>( memchr( line, '\n', c.inlen - start ) );
+		if ( nl == 0 ) break;
+
+		std::size_t n = nl - line;
+		start += n + 1;
+		if ( n > 0 && line[ n - 1 ] == '\r' ) --n;
+
+		if ( n >= 4 && memcmp( line, "get ", 4 ) == 0 )
+		{
+			if ( tablelisted( t, line + 4, urldecode( line + 4, n - 4 ), since ) )
+				puttable( c, found.data(), found.size() );
+			else
+				puttable( c, "500 not listed\n", 15 );
+		}
+		else if ( n == 0 )
+		{
+			if ( c.listed )
+				puttable( c, listed.data(), listed.size() );
+			else
+				puttable( c, "action=DUNNO\n\n", 14 );
+
+			c.listed = false;
+		}
+		else
+		{
+			char *eq = static_cast<char *>( memchr( line, '=', n ) );
+
+			if ( eq == 0 )
+				puttable( c, "400 bad request\n", 16 );
+			else if ( ( eq - line == 9 && memcmp( line, "recipient", 9 ) == 0 ) ||
+					( eq - line == 6 && memcmp( line, "sender", 6 ) == 0 ) )
+				c.listed = tablelisted( t, eq + 1, line + n - eq - 1, since ) || c.listed;
+		}
+	}
+
+	memmove( c.in, c.in + start, c.inlen - start );
+	c.inlen -= start;
+
+// a full buffer without a whole line in it never will have one.
+
+	return ( c.inlen < sizeof( c.in ) || memchr( c.in, '\n', c.inlen ) != 0 );
+}
+
+// answer the whole lines a client has sent and send the answers, a
+// bufferful at a time, until no whole line is left or the client won't
+// take more.  false once the client is done with: on an error, or once
+// it has stopped sending and has all its answers.
+
+static bool servetableconn( int ep, int fd, APERtableconn &c, const APERtable &t, const std::string &since,
+	const std::string &found, const std::string &listed )
+{
+	bool blocked = false;
+
+	do
+	{
+		if ( ! answertable( c, t, since, found, listed ) ) return ( false );
+
+		std::size_t sent = 0;
+
+		while ( sent < c.outlen )
+		{
+			ssize_t k = send( fd, c.out + sent, c.outlen - sent, MSG_NOSIGNAL );
+			if ( k < 0 && errno == EINTR ) continue;
+			if ( k < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) { blocked = true; break; }
+			if ( k <= 0 ) return ( false );
+
+			sent += k;
+		}
+
+		memmove( c.out, c.out + sent, c.outlen - sent );
+		c.outlen -= sent;
+	}
+	while ( ! blocked && memchr( c.in, '\n', c.inlen ) != 0 );
+
+	if ( c.eof && c.outlen == 0 ) return ( false );
+
+// stop reading while answers are backed up, so there's room for them.
+
+	struct epoll_event ev;
+	memset( &ev, 0, sizeof( ev ) );
+	ev.events = c.outlen == 0 ? EPOLLIN : EPOLLOUT;
+	ev.data.fd = fd;
+	epoll_ctl( ep, EPOLL_CTL_MOD, fd, &ev );
+
+	return ( true );
+}
+
+bool servetable( const std::string &address, unsigned int port, int maxage, const std::string &action, unsigned int debounce )
+{
+	APERtable t;
+	if ( ! loadtable( t ) ) return ( false );
+
+	std::string found = "200 " + urlencode( action ) + "\n";
+	std::string listed = "action=" + action + "\n\n";
+
+	if ( action.empty() || action.find( '\n' ) != std::string::npos || found.size() + listed.size() > tabledout / 2 )
+		{ errnotify( EOPTION, "--action " + action ); return ( false ); }
+
+// a path is a unix socket, anything else an address to go with port.
+
+	int lfd;
+	std::ostringstream where;
+
+	if ( address.find( '/' ) != std::string::npos )
+	{
+		struct sockaddr_un sun;
+		memset( &sun, 0, sizeof( sun ) );
+		sun.sun_family = AF_UNIX;
+
+		if ( address.size() >= sizeof( sun.sun_path ) ) { errnotify( EOPTION, "--listen " + address ); return ( false ); }
+		strcpy( sun.sun_path, address.c_str() );
+
+		unlink( address.c_str() );
+		lfd = listensocket( AF_UNIX, reinterpret_cast<struct sockaddr *>( &sun ), sizeof( sun ), SOCK_STREAM );
+		where << address;
+	}
+	else
+	{
+		where << port;
+
+		struct addrinfo hints, *ai = 0;
+		memset( &hints, 0, sizeof( hints ) );
+		hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+		hints.ai_socktype = SOCK_STREAM;
+
+		int r = getaddrinfo( address.c_str(), where.str().c_str(), &hints, &ai );
+		if ( r != 0 ) { errnotify( EOPTION, address + ": " + gai_strerror( r ) ); return ( false ); }
+
+		lfd = listensocket( ai->ai_family, ai->ai_addr, ai->ai_addrlen, SOCK_STREAM );
+		freeaddrinfo( ai );
+
+		where.str( address + " port " + where.str() );
+	}
+
+	if ( lfd < 0 )
+	{
+		errnotify( ETABLED, where.str() + ": " + strerror( errno ) );
+		return ( false );
+	}
+
+	std::map<int, datamode> shardwds;
+	int ino = watchreply( shardwds );
+	int ep = epoll_create( 1 );
+
+	if ( ino < 0 || ep < 0 )
+	{
+		errnotify( ETABLED, strerror( errno ) );
+		return ( false );
+	}
+
+	int fds[] = { lfd, ino };
+
+	for ( int i = 0; i < 2; ++i )
+	{
+		struct epoll_event ev;
+		memset( &ev, 0, sizeof( ev ) );
+		ev.events = EPOLLIN;
+		ev.data.fd = fds[ i ];
+
+		if ( epoll_ctl( ep, EPOLL_CTL_ADD, fds[ i ], &ev ) != 0 )
+		{
+			errnotify( ETABLED, strerror( errno ) );
+			return ( false );
+		}
+	}
+
+	std::map<int, APERtableconn> conns;
+	std::vector<char> buf( iobufsize );
+	struct epoll_event events[ 64 ];
+	long long reload = -1;		// when to reload, -1 if nothing changed
+	time_t swept = time( 0 );
+	std::string since = maxage < 0 ? "" : daysago( maxage );
+
+	for ( ;; )
+	{
+		long long now = monotonicms();
+		int timeout = reload < 0 ? 1000 : static_cast<int>( std::max( 0LL, reload - now ) );
+
+		int n = epoll_wait( ep, events, 64, timeout );
+		if ( n < 0 && errno == EINTR ) continue;
+		if ( n < 0 ) break;
+
+		for ( int i = 0; i < n; ++i )
+		{
+			int fd = events[ i ].data.fd;
+
+			if ( fd == lfd )
+			{
+				int c;
+
+				while ( ( c = accept4( lfd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC ) ) >= 0 )
+				{
+					struct epoll_event ev;
+					memset( &ev, 0, sizeof( ev ) );
+					ev.events = EPOLLIN;
+					ev.data.fd = c;
+
+					if ( conns.size() >= tabledclients || epoll_ctl( ep, EPOLL_CTL_ADD, c, &ev ) != 0 )
+					{
+						close( c );
+						continue;
+					}
+
+					APERtableconn &tc = conns[ c ];
+					tc.inlen = tc.outlen = 0;
+					tc.listed = false;
+					tc.eof = false;
+					tc.active = time( 0 );
+				}
+			}
+			else if ( fd == ino )
+			{
+				if ( replychanged( ino, buf, shardwds ) ) reload = monotonicms() + debounce;
+			}
+			else
+			{
+				std::map<int, APERtableconn>::iterator c = conns.find( fd );
+				if ( c == conns.end() ) continue;
+
+				APERtableconn &tc = c->second;
+				bool open = ( events[ i ].events & EPOLLERR ) == 0;
+
+// a client that has shut down its side is still answered what it sent.
+
+				while ( open && ! tc.eof && ( events[ i ].events & ( EPOLLIN | EPOLLHUP ) ) && tc.inlen < sizeof( tc.in ) )
+				{
+					ssize_t k = recv( fd, tc.in + tc.inlen, sizeof( tc.in ) - tc.inlen, 0 );
+					if ( k < 0 && errno == EINTR ) continue;
+					if ( k < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) break;
+					if ( k == 0 ) { tc.eof = true; break; }
+					if ( k < 0 ) { open = false; break; }
+
+					tc.inlen += k;
+					tc.active = time( 0 );
+				}
+
+				if ( ! open || ! servetableconn( ep, fd, tc, t, since, found, listed ) )
+					closetableconn( ep, fd, conns );
+			}
+		}
+
+		if ( reload >= 0 && monotonicms() >= reload )
+		{
+			reload = -1;
+			loadtable( t );
+		}
+
+		time_t sec = time( 0 );
+
+		if ( sec != swept )
+		{
+			swept = sec;
+			if ( maxage >= 0 ) since = daysago( maxage );
+
+			for ( std::map<int, APERtableconn>::iterator c = conns.begin(); c != conns.end(); )
+			{
+				int fd = c->first;
+				++c;
+				if ( sec - conns[ fd ].active > static_cast<time_t>( tabledidle ) ) closetableconn( ep, fd, conns );
+			}
+		}
+	}
+
+	errnotify( ETABLED, strerror( errno ) );
+
+	return ( false );
+}
+
+/////////////////////////////////////////////////////
+//      loadtable                                  //
+/////////////////////////////////////////////////////
+// load the active reply entries into t, hashed at half load.  t is only
+// changed if the list loads.
+
+bool loadtable( APERtable &t )
+{
+	APERlist l( reply );
+	if ( ! loadlocked( l ) ) return ( false );
+
+	APERtable n;
+	activerecords( l, n.records );
+
+	uint32_t size = 1;
+	while ( size < 2 * n.records.size() ) size <<= 1;
+
+	n.slots.assign( size, 0 );
+	n.mask = size - 1;
+
+	for ( std::size_t i = 0; i < n.records.size(); ++i )
+	{
+		const std::string &a = n.records[ i ].address;
+		uint32_t s = hash32( a.data(), a.size() ) & n.mask;
+
+		while ( n.slots[ s ] != 0 ) s = ( s + 1 ) & n.mask;
+		n.slots[ s ] = i + 1;
+	}
+
+	t.records.swap( n.records );
+	t.slots.swap( n.slots );
+	t.mask = n.mask;
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      findtable                                  //
+/////////////////////////////////////////////////////
+// the entry for the address in p, 0 if there isn't one.
+
+const APERrecord *findtable( const APERtable &t, const char *p, std::size_t n )
+{
+	for ( uint32_t s = hash32( p, n ) & t.mask; t.slots[ s ] != 0; s = ( s + 1 ) & t.mask )
+	{
+		const APERrecord &r = t.records[ t.slots[ s ] - 1 ];
+		if ( r.address.size() == n && memcmp( r.address.data(), p, n ) == 0 ) return ( &r );
+	}
+
+	return ( 0 );
+}
+
+/////////////////////////////////////////////////////
+//      writespamassassin                          //
+/////////////////////////////////////////////////////
+// spamassassin rules matching the active reply entries seen since a
+// date, written to file or stdout.  each kind of rule gets as few
+// patterns as the size bound allows: addresses are grouped by domain
+// and each domain's local parts are written as a trie, so a shared
+// prefix or domain is only matched once.  with check set, every pattern
+// is compiled and tried against each of its addresses before anything
+// is written.
+
+// which reply types make which rules, as addresses2spamassassin.pl
+// sorts them.  reply-to and from are scored together.
+
+struct SAkind
+{
+	char type;
+	const char *header;		// 0 for body rules
+	bool combined;			// part of the reply-to or from rule
+	const char *describe;
+};
+
+static const SAkind sakinds[] =
+{
+	{ 'A', "Reply-To", true, 0 },
+	{ 'B', "From", true, 0 },
+	{ 'C', 0, false, "Phishing addresses in body" },
+	{ 'E', "From", false, "Phishing other addresses" }
+};
+
+// an address can't run on from what comes before or after the match.
+
+static const char saleft[] = "(?:^|[^a-z0-9._%+-])";
+static const char saright[] = "(?:[^a-z0-9-]|$)";
+
+// what a rule adds around its alternation.  the shortest --max-rule
+// taken must leave room inside it; the array can't be declared if not.
+
+static const std::size_t saoverhead = sizeof( saleft ) + sizeof( saright ) + 4;
+typedef char saminrulefits[ saminrule > saoverhead ? 1 : -1 ];
+
+static bool sakindof( char type, const std::string &addrt )
+{
+	bool a = addrt.find( 'A' ) != std::string::npos;
+	bool b = addrt.find( 'B' ) != std::string::npos;
+	bool has = addrt.find( type ) != std::string::npos;
+
+	switch ( type )
+	{
+		case 'C':	return ( has && ! a && ! b );
+		case 'E':	return ( has && ! b );
+		default:	return ( has );
+	}
+}
+
+// only what is special to perl, or to spamassassin's parser, is escaped.
+// posix regex gives some other escapes meanings of their own.
+
+static std::string saescape( const std::string &s )
+{
+	std::string e;
+
+	for ( std::string::const_iterator itr = s.begin(); itr != s.end(); ++itr )
+	{
+		if ( strchr( "\\^$.|?*+()[]{}/@#", *itr ) ) e += '\\';
+		e += *itr;
+	}
+
+	return ( e );
+}
+
+// the pattern for v[lo..hi), sorted and unique, from position from on:
+// their common prefix, then an alternation of what follows, branching
+// on the next character.
+
+static std::string satrie( const std::vector<std::string> &v, std::size_t lo, std::size_t hi, std::size_t from )
+{
+	const std::string &first = v[ lo ];
+	const std::string &last = v[ hi - 1 ];
+
+	std::size_t p = from;
+	while ( p < first.size() && p < last.size() && first[ p ] == last[ p ] ) ++p;
+
+	std::string prefix = saescape( first.substr( from, p - from ) );
+	if ( hi - lo == 1 ) return ( prefix );
+
+// sorted, so a string that ends here comes first.
+
+	bool optional = ( first.size() == p );
+	bool chars = true;
+	std::vector<std::string> branches;
+
+	for ( std::size_t i = optional ? lo + 1 : lo; i < hi; )
+	{
+		std::size_t j = i + 1;
+		while ( j < hi && v[ j ][ p ] == v[ i ][ p ] ) ++j;
+
+		if ( j - i == 1 && v[ i ].size() == p + 1 && isalnum( static_cast<unsigned char>( v[ i ][ p ] ) ) )
+			branches.push_back( v[ i ].substr( p, 1 ) );
+		else
+		{
+			chars = false;
+			branches.push_back( satrie( v, i, j, p ) );
+		}
+
+		i = j;
+	}
+
+	std::string alt;
+	bool atom = true;
+
+	if ( branches.size() == 1 )
+	{
+		alt = branches[ 0 ];
+		atom = chars;
+	}
+	else
+	{
+		for ( std::size_t i = 0; i < branches.size(); ++i )
+			alt += ( i == 0 || chars ? "" : "|" ) + branches[ i ];
+
+		alt = chars ? "[" + alt + "]" : "(?:" + alt + ")";
+	}
+
+	if ( optional ) alt = atom ? alt + "?" : "(?:" + alt + ")?";
+
+	return ( prefix + alt );
+}
+
+// one domain's addresses as pieces of at most room bytes, halving the
+// local parts until they fit.  an address that doesn't fit on its own
+// is left out, and said so.
+
+static void sapieces( const std::string &domain, const std::vector<std::string> &locals,
+	std::size_t lo, std::size_t hi, std::size_t room, std::vector<APERsarule> &pieces )
+{
+	std::string pattern = satrie( locals, lo, hi, 0 ) + saescape( domain );
+
+	if ( pattern.size() > room && hi - lo > 1 )
+	{
+		std::size_t mid = lo + ( hi - lo ) / 2;
+		sapieces( domain, locals, lo, mid, room, pieces );
+		sapieces( domain, locals, mid, hi, room, pieces );
+		return;
+	}
+
+	if ( pattern.size() > room )
+	{
+		errnotify( ESARULES, "too long for --max-rule, left out: " + locals[ lo ] + domain );
+		return;
+	}
+
+	pieces.push_back( APERsarule() );
+	pieces.back().pattern.swap( pattern );
+
+	for ( std::size_t i = lo; i < hi; ++i ) pieces.back().addresses.push_back( locals[ i ] + domain );
+}
+
+// the kind's addresses as rules of at most maxrule bytes.
+
+static void sarules( const std::vector<APERrecord> &records, char type, const std::string &since,
+	std::size_t maxrule, std::vector<APERsarule> &rules )
+{
+	typedef std::map<std::string, std::vector<std::string> > Domains;
+	Domains domains;
+
+	for ( std::vector<APERrecord>::const_iterator itr = records.begin(); itr != records.end(); ++itr )
+	{
+		if ( itr->date < since || ! sakindof( type, itr->addrt ) ) continue;
+
+		std::string::size_type at = itr->address.rfind( tokmail );
+		if ( at == std::string::npos ) at = itr->address.size();
+
+		domains[ itr->address.substr( at ) ].push_back( itr->address.substr( 0, at ) );
+	}
+
+	std::size_t room = maxrule - saoverhead;
+	std::vector<APERsarule> pieces;
+
+	for ( Domains::iterator itr = domains.begin(); itr != domains.end(); ++itr )
+	{
+		std::sort( itr->second.begin(), itr->second.end() );
+		sapieces( itr->first, itr->second, 0, itr->second.size(), room, pieces );
+	}
+
+	rules.clear();
+
+	for ( std::size_t i = 0; i < pieces.size(); ++i )
+	{
+		if ( rules.empty() || rules.back().pattern.size() + pieces[ i ].pattern.size() + 1 > room )
+			rules.push_back( APERsarule() );
+
+		APERsarule &r = rules.back();
+		if ( ! r.pattern.empty() ) r.pattern += '|';
+		r.pattern += pieces[ i ].pattern;
+		r.addresses.insert( r.addresses.end(), pieces[ i ].addresses.begin(), pieces[ i ].addresses.end() );
+	}
+
+	for ( std::vector<APERsarule>::iterator itr = rules.begin(); itr != rules.end(); ++itr )
+		itr->pattern = saleft + ( "(?:" + itr->pattern + ")" ) + saright;
+}
+
+// compile a rule as posix extended, which it is once its groups don't
+// capture, and make sure it matches each of its addresses.
+
+static bool sacheck( const APERsarule &r )
+{
+	std::string re;
+
+	for ( std::size_t i = 0; i < r.pattern.size(); ++i )
+	{
+		if ( r.pattern.compare( i, 3, "(?:" ) == 0 ) { re += '('; i += 2; }
+		else re += r.pattern[ i ];
+	}
+
+	regex_t x;
+	int err = regcomp( &x, re.c_str(), REG_EXTENDED | REG_ICASE | REG_NOSUB );
+
+	if ( err != 0 )
+	{
+		char msg[ 256 ];
+		regerror( err, &x, msg, sizeof( msg ) );
+		errnotify( ESARULES, std::string( "pattern does not compile: " ) + msg );
+		return ( false );
+	}
+
+	bool ok = true;
+
+	for ( std::vector<std::string>::const_iterator itr = r.addresses.begin(); ok && itr != r.addresses.end(); ++itr )
+	{
+		std::string header = "Someone <" + *itr + ">";
+
+		if ( regexec( &x, header.c_str(), 0, 0, 0 ) != 0 )
+		{
+			errnotify( ESARULES, "pattern does not match " + *itr );
+			ok = false;
+		}
+	}
+
+	regfree( &x );
+
+	return ( ok );
+}
+
+bool writespamassassin( const std::string &file, const std::string &since, std::size_t maxrule, bool check )
+{
+	APERlist l( reply );
+	if ( ! loadlocked( l ) ) return ( false );
+
+	std::vector<APERrecord> records;
+	activerecords( l, records );
+
+	std::ostringstream cf;
+	std::string seen = since.empty() ? "" : " seen since " + since;
+	std::vector<std::string> combined;
+
+	for ( std::size_t k = 0; k < sizeof( sakinds ) / sizeof( sakinds[ 0 ] ); ++k )
+	{
+		const SAkind &kind = sakinds[ k ];
+
+		std::vector<APERsarule> rules;
+		sarules( records, kind.type, since, maxrule, rules );
+		if ( rules.empty() ) continue;
+
+		std::ostringstream name;
+		name << ( kind.combined ? "__" : "" ) << sarulename << '_' << kind.type;
+
+		cf << "meta " << name.str() << " (";
+
+		for ( std::size_t i = 0; i < rules.size(); ++i )
+			cf << ( i ? " || " : "" ) << "__" << sarulename << '_' << kind.type << '_' << i + 1;
+
+		cf << ")\n";
+
+		for ( std::size_t i = 0; i < rules.size(); ++i )
+		{
+			if ( check && ! sacheck( rules[ i ] ) ) return ( false );
+
+			cf << ( kind.header ? "header " : "body " ) << "__" << sarulename << '_' << kind.type << '_' << i + 1 << ' ';
+			if ( kind.header ) cf << kind.header << " =~ ";
+			cf << '/' << rules[ i ].pattern << "/i\n";
+		}
+
+		if ( kind.combined )
+		{
+			combined.push_back( name.str() );
+			continue;
+		}
+
+		cf << "score " << name.str() << ' ' << sascore << '\n';
+		cf << "describe " << name.str() << ' ' << kind.describe << seen << '\n';
+	}
+
+	if ( ! combined.empty() )
+	{
+		cf << "meta " << sarulename << " (";
+		for ( std::size_t i = 0; i < combined.size(); ++i ) cf << ( i ? " || " : "" ) << combined[ i ];
+		cf << ")\n";
+
+		cf << "score " << sarulename << ' ' << sascore << '\n';
+		cf << "describe " << sarulename << " Phishing From and Reply-To addresses" << seen << '\n';
+	}
+
+	if ( file.empty() )
+	{
+		std::cout << cf.str() << std::flush;
+		if ( ! std::cout ) { errnotify( EFILE, "stdout" ); return ( false ); }
+		return ( true );
+	}
+
+	const char *tmpfile = tempnam( dirof( file ).c_str(), tmpprefix );
+
+	APERoutput out;
+	if ( ! out.open( tmpfile, plain ) ) { errnotify( EXFILE, tmpfile ); return ( false ); }
+
+	out.compare( file );
+
+	out.stream() << cf.str();
+
+	if ( ! out.close() )
+	{
+		errnotify( EXFILE, tmpfile );
+		if ( unlink( tmpfile ) != 0 ) errnotify( EXFILERM, tmpfile );
+		return ( false );
+	}
+
+	return ( commitaperfile( tmpfile, file, out.unchanged() ) );
+}
+
+/////////////////////////////////////////////////////
+//      APERlist::APERlist                         //
+/////////////////////////////////////////////////////
+
+APERlist::APERlist( datamode m, const std::string &d ) :
+	mode( m ), dir( d ), listcodec( plain ), outcodec( keep ),
+	rejects( 0 ), maxerrors( 1.0 ), ordered( false )
+{}
+
+/////////////////////////////////////////////////////
+//      APERlist::name                             //
+/////////////////////////////////////////////////////
+// the list's file name, without the directory.
+
+std::string APERlist::name( void ) const
+{
+	switch ( mode )
+	{
+		case links:		return ( linksfile );
+		case cleared:	return ( replyclearedfile );
+		default:		return ( replyfile );
+	}
+}
+
+/////////////////////////////////////////////////////
+//      APERlist::clearedon                        //
+/////////////////////////////////////////////////////
+// when an address was cleared, if it was.  works for the cleared list
+// and for a reply list loaded with its cleared list.
+
+bool APERlist::clearedon( const std::string &address, std::string &date ) const
+{
+	APERnode *n = db.find( address );
+
+	if ( n && ( mode == cleared || dynamic_cast<APERreply *>( n )->iscleared() ) )
+	{
+		date = n->date();
+		return ( true );
+	}
+
+	const APERrecord *c = findunlisted( address );
+	if ( c ) date = c->date;
+
+	return ( c != 0 );
+}
+
+/////////////////////////////////////////////////////
+//      APERlist::findunlisted                     //
+/////////////////////////////////////////////////////
+
+const APERrecord *APERlist::findunlisted( const std::string &address ) const
+{
+	APERrecord key;
+	key.address = address;
+
+	std::vector<APERrecord>::const_iterator itr = std::lower_bound( unlisted.begin(), unlisted.end(), key, recordless );
+	if ( itr == unlisted.end() || itr->address != address ) return ( 0 );
+
+	return ( &*itr );
+}
+
+/////////////////////////////////////////////////////
+//      APERlist::path                             //
+/////////////////////////////////////////////////////
+// where a file belonging to the list lives.
+
+std::string APERlist::path( const std::string &file ) const
+{
+	if ( dir.empty() ) return ( file );
+
+	return ( dir + "/" + file );
+}
+
+/////////////////////////////////////////////////////
+//      APERshards::of                             //
+/////////////////////////////////////////////////////
+// which shard holds key.  the hash is the same whatever the word size,
+// so a layout reads the same everywhere.  by domain the key is
+// cut down to its registered domain, taken as the last two labels, or
+// three under the common country second levels (co.uk, com.au, ...).
+
+unsigned int APERshards::of( datamode m, const std::string &key ) const
+{
+	std::string k = key;
+
+	if ( by == bydomain )
+	{
+		std::string::size_type p;
+
+		if ( m == links )
+		{
+			p = k.find_first_of( "/?#" );
+			if ( p != std::string::npos ) k.erase( p );
+			p = k.rfind( ':' );
+			if ( p != std::string::npos ) k.erase( p );
+		}
+
+		p = k.rfind( tokmail );
+		if ( p != std::string::npos ) k.erase( 0, p + 1 );
+
+		p = k.rfind( tokdns );
+		std::string::size_type q = ( p == std::string::npos || p == 0 ) ? std::string::npos : k.rfind( tokdns, p - 1 );
+
+		if ( q != std::string::npos )
+		{
+			std::string sld = k.substr( q + 1, p - q - 1 );
+
+			if ( k.size() - p == 3 && q > 0 && ( sld == "co" || sld == "com" ||
+					sld == "net" || sld == "org" || sld == "ac" || sld == "gov" || sld == "edu" ) )
+				q = k.rfind( tokdns, q - 1 );
+
+			if ( q != std::string::npos ) k.erase( 0, q + 1 );
+		}
+	}
+
+	return ( hash32( k ) % count );
+}
+
+/////////////////////////////////////////////////////
+//      APERnode::APERnode                         //
+/////////////////////////////////////////////////////
+
+APERnode::APERnode( std::string d ) : _date( d ) {}
+
+APERnode::APERnode( void ) {}
+
+/////////////////////////////////////////////////////
+//      APERnode::isvaliddate                      //
+/////////////////////////////////////////////////////
+// a valid date has the form YYYYMMDD consisting of all digits.
+// valid formats are strings in the set (00000000, 99999999] and
+// evalute to a valid date for the system.
+//
+// valid dates are between 20:45:52  UTC,  December  13,  1901
+// and 03:14:07 UTC,  January 19, 2038 .
+//
+// there is a lot of overkill here but it helps in strange ways.
+
+bool APERnode::isvaliddate( std::string date ) const
+{
+	if ( date.empty() ) return ( false );
+	if ( date.size() != 8 ) return ( false );
+
+	std::string Y( date.substr( 0, 4 ) );
+	std::string M( date.substr( 4, 2 ) );
+	std::string D( date.substr( 6, 2 ) );
+
+	std::string digits = "0123456789";
+	if ( Y.find_first_not_of( digits ) != std::string::npos ) return ( false );
+	if ( M.find_first_not_of( digits ) != std::string::npos ) return ( false );
+	if ( D.find_first_not_of( digits ) != std::string::npos ) return ( false );
+
+	int y( atoi( Y.c_str() ) );
+	int m( atoi( M.c_str() ) );
+	int d( atoi( D.c_str() ) );
+
+	if ( y * m * d == 0 ) return ( false );
+	if ( m < 1 || m > 12 ) return ( false );
+	if ( d < 1 || d > 31 ) return ( false );
+
+	struct tm t;
+
+	t.tm_year = y - 1900;
+	t.tm_mon = m - 1;
+	t.tm_mday = d;
+	t.tm_hour = 0;
+	t.tm_min = 0;
+	t.tm_sec = 1;
+	t.tm_isdst = -1;
+
+	return ( mktime( &t ) != -1 ); 
+}
+
+/////////////////////////////////////////////////////
+//      APERnode::isnewer                          //
+/////////////////////////////////////////////////////
+// is the node newer than the date given?
+
+bool APERnode::isnewer( std::string date ) const
+{
+	if ( _date > date ) return ( true );
+	if ( _date == date || _date < date ) return ( false );
+}
+
+/////////////////////////////////////////////////////
+//      APERreply::APERreply                       //
+/////////////////////////////////////////////////////
+
+APERreply::APERreply( void ) : _iscleared( false ) {}
+
+/////////////////////////////////////////////////////
+//      AEPRreply::write                           //
+/////////////////////////////////////////////////////
+
+void APERreply::write( std::ostream &f )
+{
+	if ( ! iscleared() ) f << address() << tokcsv << addrtype() << tokcsv << date() << '\n';
+}
+
+/////////////////////////////////////////////////////
+//      APERreply::isvalidaddress                  //
+/////////////////////////////////////////////////////
+// lame check of email address format.
+// basically, something@more.here ==> good format.
+// there are no RFC-compliant checks (except one).
+
+bool APERreply::isvalidaddress( std::string address ) const
+{
+	if ( address.empty() ) return ( false );
+
+	std::string::size_type d = address.find( tokmail );
+
+	if ( d == std::string::npos ) return ( false );
+
+	if ( d > 0 && d < address.size() - 1 )
+	{
+		std::string host = address.substr( d );
+
+		d = host.find( tokdns );
+		if ( d == std::string::npos ) return ( false );
+
+// try catching a typo...
+		if ( host.find( ".." ) != std::string::npos ) return ( false );
+
+// assume host looks like @xxxx.yyyy with '@' at position 0.
+// we don't want tokdns at 0 or 1 or at the end.
+
+		if ( d > 1 && d < host.size() - 1 )
+		{
+// if we got this far then there is something after tokmail
+// RFC1123 and RFC952 specify host names start with a letter or digit.
+			if ( ! isalnum( host.at( 1 ) ) )
+			{
+				// some hosts begin with other symbols
+				std::string::size_type p = host.find_first_of( "-" );
+				if ( p != 1 ) return ( false );
+			}
+
+// some may argue this violates RFCs since a host FQDN, terminating with a dot,
+// is valid syntax.  while this may be true, we need to make the user aware
+// by rejecting it since it could be a typo or something else. this also
+// facilitates some level of sanity with entries in the database since
+// 'a@b.c.' is nearly always 'a@b.c' though literally they're different and
+// would result in different entries in the database.  also, the use of FQDN
+// in a phish may be useful in indentifying phishware, so don't hide the fact
+// in an automated cleanup.
+			if ( host.at( host.size() - 1 ) != tokdns ) return ( true );
+		}
+	}
+
+	return ( false );
+}
+
+/////////////////////////////////////////////////////
+//      APERreply::addrtype                        //
+/////////////////////////////////////////////////////
+
+std::string APERreply::addrtype( void ) const
+{
+	AddrT::iterator itr = _addrt.begin();
+	AddrT::iterator itrE = _addrt.end();
+	std::string s;
+
+	while ( itr != itrE )
+		s += *itr++;
+
+	return ( s );
+}
+
+void APERreply::addrtype( std::string addrt )
+{
+	std::string::iterator itr = addrt.begin();
+	std::string::iterator itrE = addrt.end();
+
+	while ( itr != itrE )
+	{
+		_addrt.insert( std::toupper( *itr ) );
+		++itr;
+	}
+}
+
+/////////////////////////////////////////////////////
+//      APERreply::isvalidaddrtype                 //
+/////////////////////////////////////////////////////
+
+bool APERreply::isvalidaddrtype( std::string addrt ) const
+{
+	if ( addrt.empty() ) return ( false );
+
+	std::transform( addrt.begin(), addrt.end(), addrt.begin(), toupper );
+
+	return ( !( addrt.find_first_not_of( replytypes ) != std::string::npos) );
+}
+
+/////////////////////////////////////////////////////
+//      APERlinks::APERlinks                       //
+/////////////////////////////////////////////////////
+
+APERlinks::APERlinks( void ) {}
+
+/////////////////////////////////////////////////////
+//      APERlinks::write                           //
+/////////////////////////////////////////////////////
+
+void APERlinks::write( std::ostream &f )
+{
+	f << address() << tokcsv << date() << '\n';
+}
+
+/////////////////////////////////////////////////////
+//      APERlinks::isvalidaddress                  //
+/////////////////////////////////////////////////////
+// lame check of web host address.  full URL not validated in any way.
+// basically, some.host/more ==> good format.
+// there are no RFC-compliant checks (except one).
+// assumes address cleanup already done.
+
+bool APERlinks::isvalidaddress( std::string address ) const
+{
+	if ( address.empty() ) return ( false );
+
+// check for embedded URLs.
+// this also catches misbehaved cut-and-pastes. :-)
+//	if ( address.find( "://" ) != std::string::npos ) return ( false );
+
+// wildcard entries are checked a label and segment at a time.  a label
+// is "*" or has no "*" in it, and something has to be literal.
+
+	if ( APERlinkpatterns::ispattern( address ) )
+	{
+		std::vector<std::string> labels, segments;
+		APERlinkpatterns::splitkey( address, labels, segments );
+
+		bool literal = false;
+
+		for ( std::vector<std::string>::iterator itr = labels.begin(); itr != labels.end(); ++itr )
+		{
+			if ( itr->empty() || ( *itr != "*" && itr->find( '*' ) != std::string::npos ) ) return ( false );
+			if ( *itr != "*" ) literal = true;
+		}
+
+		for ( std::vector<std::string>::iterator itr = segments.begin(); itr != segments.end(); ++itr )
+			if ( *itr != "*" ) literal = true;
+
+		return ( literal );
+	}
+
+// check host part of url.  at this time we don't care about the rest.
+
+	std::string host = address;
+	std::string::size_type p = address.find_first_of( "/?#" );
+	if ( p != std::string::npos )
+		host = address.substr( 0, p );
+
+	if ( host.empty() ) return ( false );
+
+	std::string::size_type d = host.find( tokdns );
+	if ( d == std::string::npos ) return ( false );
+
+// RFC1123 and RFC952 specify host names start with a letter or digit.
+	if ( ! isalnum( host[0] ) )
+	{
+		// some hosts begin with other symbols
+		std::string::size_type p = host.find_first_of( "-" );
+		if ( p != 0 ) return ( false );
+	}
+
+// try catching a typo
+	if ( host.find( ".." ) != std::string::npos ) return ( false );
+
+// see FQDN discussion in APERreply::isvalidaddress()
+	if ( host.at( host.size() - 1 ) != tokdns ) return ( true );
+
+	return ( false );
+}
+
+/////////////////////////////////////////////////////
+//      APERlinks::cleanup                         //
+/////////////////////////////////////////////////////
+// transform url to its canonical key, so that the many ways of writing
+// one page are listed once:
+//
+//	http and https schemes, their userinfo, fragment and default port
+//	dropped
+//	host lowercased, a leading "www." dropped
+//	escapes of unreserved characters decoded, the rest in upper case
+//	empty, "." and ".." path segments resolved, trailing slash dropped
+//	empty query dropped, a query on the root keeps its slash
+//
+// urls with other schemes are left alone for the validators to judge.
+
+// decode the escapes of characters that never need escaping (RFC3986
+// 2.3) and write the others in upper case.  with lower, everything
+// outside the escapes is lowercased too.
+
+static std::string pctnormal( const std::string &s, bool lower )
+{
+	static const char hex[] = "0123456789ABCDEF";
+	std::string out;
+	out.reserve( s.size() );
+
+	for ( std::string::size_type i = 0; i < s.size(); ++i )
+	{
+		unsigned char c = s[ i ];
+
+		if ( c == '%' && i + 2 < s.size() && isxdigit( s[ i + 1 ] ) && isxdigit( s[ i + 2 ] ) )
+		{
+			c = strtol( s.substr( i + 1, 2 ).c_str(), 0, 16 );
+			i += 2;
+
+			if ( ! isalnum( c ) && std::string( "-._~" ).find( c ) == std::string::npos )
+			{
+				out += '%';
+				out += hex[ c >> 4 ];
+				out += hex[ c & 0x0f ];
+				continue;
+			}
+		}
+
+		out += lower ? tolower( c ) : c;
+	}
+
+	return ( out );
+}
+
+std::string APERlinks::cleanup( std::string url )
+{
+	if ( url.empty() ) return ( url );
+
+	std::string::size_type p;
+
+// remove scheme
+// RFC3986 states the scheme can be uppercase but apps should produce
+// lowercase for consistency and documents that present schemes should
+// do so in lowercase.
+
+	std::string scheme;
+	std::string h( "://" );
+
+	p = url.find( h );
+	if ( p != std::string::npos )
+	{
+		std::string s = tolowercase( url.substr( 0, p ) );
+
+		// we only nuke ordinary web schemes at the beginning,
+		// not embedded URLs (those found as extra info, etc).
+		// address validators should flag a bad addr if :// is found.
+		if ( s == "http" || s == "https" )
+		{
+			scheme = s;
+			url.erase( 0, p + h.size() );
+		}
+		else if ( ! s.empty() && isalpha( s[0] ) &&
+				s.find_first_not_of( "abcdefghijklmnopqrstuvwxyz0123456789+.-" ) == std::string::npos )
+			return ( url );
+	}
+
+// the fragment never leaves the browser.  split the rest into host
+// ("authority" in RFC lingo), path and query.  RFC3986 specifies
+// termination chars.
+
+	p = url.find( '#' );
+	if ( p != std::string::npos ) url.erase( p );
+
+	std::string host, path, query;
+
+	p = url.find_first_of( "/?" );
+	host = url.substr( 0, p );
+
+	if ( p != std::string::npos )
+	{
+		std::string::size_type q = url.find( '?', p );
+		path = url.substr( p, q == std::string::npos ? q : q - p );
+		if ( q != std::string::npos ) query = url.substr( q + 1 );
+	}
+
+// userinfo only serves to disguise the real host, as in
+// http://www.bank.com@evil.example/.  without a scheme it's an email
+// address listed as a link, and stays.
+
+	p = host.rfind( tokmail );
+	if ( p != std::string::npos && ! scheme.empty() ) host.erase( 0, p + 1 );
+
+// the port, unless it's the scheme's own (http if none was given)
+
+	p = host.rfind( ':' );
+	if ( p != std::string::npos && host.find( ']', p ) == std::string::npos &&
+			host.find_first_not_of( "0123456789", p + 1 ) == std::string::npos )
+	{
+		std::string port = host.substr( p + 1 );
+		port.erase( 0, std::min( port.find_first_not_of( '0' ), port.size() ) );
+		host.erase( p );
+
+		if ( ! port.empty() && port != ( scheme == "https" ? "443" : "80" ) ) host += ':' + port;
+	}
+
+	host = pctnormal( host, true );
+
+	if ( host.compare( 0, 4, "www." ) == 0 && host.find( tokdns, 4 ) != std::string::npos )
+		host.erase( 0, 4 );
+
+// resolve the path a segment at a time.  doubled slashes leave empty
+// segments, which go along with the trailing slash.
+
+	url = host;
+
+	std::vector<std::string> segments;
+	path = pctnormal( path, false );
+
+	for ( p = 0; p < path.size(); )
+	{
+		std::string::size_type q = path.find( '/', p );
+		if ( q == std::string::npos ) q = path.size();
+
+		std::string s = path.substr( p, q - p );
+		p = q + 1;
+
+		if ( s.empty() || s == "." ) continue;
+
+		if ( s == ".." )
+		{
+			if ( ! segments.empty() ) segments.pop_back();
+		}
+		else
+			segments.push_back( s );
+	}
+
+	for ( std::vector<std::string>::iterator itr = segments.begin(); itr != segments.end(); ++itr )
+		url += '/' + *itr;
+
+	query = pctnormal( query, false );
+	if ( query.empty() ) return ( url );
+
+	if ( segments.empty() ) url += '/';
+
+	return ( url + '?' + query );
+}
+
+/////////////////////////////////////////////////////
+//      APERcleared::APERcleared                   //
+/////////////////////////////////////////////////////
+
+APERcleared::APERcleared( void ) {}
+
+/////////////////////////////////////////////////////
+//      APERcleared::write                         //
+/////////////////////////////////////////////////////
+
+void APERcleared::write( std::ostream &f )
+{
+	f << address() << tokcsv << date() << '\n';
+}
+
+/////////////////////////////////////////////////////
+//      APERcleared::isvalidaddess                 //
+/////////////////////////////////////////////////////
+
+bool APERcleared::isvalidaddress( std::string address ) const
+{
+	APERreply n;
+
+	return ( n.isvalidaddress( address ) );
+}
+
+/////////////////////////////////////////////////////
+//      APERdb::APERdb                             //
+/////////////////////////////////////////////////////
+
+APERdb::APERdb( void ) : _used( 0 ) {}
+
+APERdb::~APERdb( void )
+{
+	for ( std::vector<Bucket>::iterator itr = _b.begin(); itr != _b.end(); ++itr )
+		delete itr->node;
+}
+
+/////////////////////////////////////////////////////
+//      APERdb::insert                             //
+/////////////////////////////////////////////////////
+// add node under its address unless the address is already there.
+// returns whichever node ends up in the table, so the caller can tell
+// if it still owns the node it passed in.
+
+APERnode *APERdb::insert( APERnode *node )
+{
+	if ( ( _used + 1 ) * 4 > _b.size() * 3 ) grow();
+
+	const std::string &key = node->address();
+	std::size_t h = hash( key );
+	std::size_t mask = _b.size() - 1;
+
+	for ( std::size_t i = h & mask; ; i = ( i + 1 ) & mask )
+	{
+		Bucket &b = _b[ i ];
+
+		if ( b.node == 0 )
+		{
+			b.hash = h;
+			b.node = node;
+			++_used;
+			_dates[ node->date() ].insert( node );
+			return ( node );
+		}
+
+		if ( b.hash == h && b.node->address() == key )
+			return ( b.node );
+	}
+}
+
+/////////////////////////////////////////////////////
+//      APERdb::find                               //
+/////////////////////////////////////////////////////
+
+APERnode *APERdb::find( const std::string &key ) const
+{
+	if ( _used == 0 ) return ( 0 );
+
+	std::size_t h = hash( key );
+	std::size_t mask = _b.size() - 1;
+
+	for ( std::size_t i = h & mask; _b[ i ].node != 0; i = ( i + 1 ) & mask )
+	{
+		if ( _b[ i ].hash == h && _b[ i ].node->address() == key )
+			return ( _b[ i ].node );
+	}
+
+	return ( 0 );
+}
+
+/////////////////////////////////////////////////////
+//      APERdb::erase                              //
+/////////////////////////////////////////////////////
+// remove and delete the node for key.  later entries of the probe run
+// are shifted back so that lookups never need tombstones.
+
+bool APERdb::erase( const std::string &key )
+{
+	if ( _used == 0 ) return ( false );
+
+	std::size_t h = hash( key );
+	std::size_t mask = _b.size() - 1;
+	std::size_t i = h & mask;
+
+	while ( _b[ i ].node != 0 && ! ( _b[ i ].hash == h && _b[ i ].node->address() == key ) )
+		i = ( i + 1 ) & mask;
+
+	if ( _b[ i ].node == 0 ) return ( false );
+
+	Dates::iterator d = _dates.find( _b[ i ].node->date() );
+	d->second.erase( _b[ i ].node );
+	if ( d->second.empty() ) _dates.erase( d );
+
+	delete _b[ i ].node;
+	_b[ i ].node = 0;
+	--_used;
+
+	for ( std::size_t j = ( i + 1 ) & mask; _b[ j ].node != 0; j = ( j + 1 ) & mask )
+	{
+		std::size_t k = _b[ j ].hash & mask;
+
+// leave the entry alone if its home slot lies cyclically in (i, j].
+
+		bool stays = ( i < j ) ? ( k > i && k <= j ) : ( k > i || k <= j );
+		if ( stays ) continue;
+
+		_b[ i ] = _b[ j ];
+		_b[ j ].node = 0;
+		i = j;
+	}
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      APERdb::redate                             //
+/////////////////////////////////////////////////////
+// change the date of a node in the table.  dates are only ever changed
+// through here once a node is in, to keep it in the right bucket.
+
+void APERdb::redate( APERnode *node, const std::string &date )
+{
+	if ( node->date() == date ) return;
+
+	Dates::iterator d = _dates.find( node->date() );
+	d->second.erase( node );
+	if ( d->second.empty() ) _dates.erase( d );
+
+	node->date( date );
+	_dates[ date ].insert( node );
+}
+
+/////////////////////////////////////////////////////
+//      APERdb::nodes                              //
+/////////////////////////////////////////////////////
+// all nodes in no particular order.
+
+void APERdb::nodes( Nodes &v ) const
+{
+	v.clear();
+	v.reserve( _used );
+
+	for ( std::vector<Bucket>::const_iterator itr = _b.begin(); itr != _b.end(); ++itr )
+		if ( itr->node ) v.push_back( itr->node );
+}
+
+/////////////////////////////////////////////////////
+//      APERdb::sorted                             //
+/////////////////////////////////////////////////////
+// all nodes in address order.  this is plain byte order, the same order
+// the lists have always been written in.
+
+void APERdb::sorted( Nodes &v ) const
+{
+	nodes( v );
+	sortnodes( v );
+}
+
+/////////////////////////////////////////////////////
+//      APERdb::dated                              //
+/////////////////////////////////////////////////////
+// the nodes last seen in [from, to), in no particular order, taken only
+// from the buckets of those dates.  empty bounds are open.  dates are
+// YYYYMMDD, so string order is date order.
+
+void APERdb::dated( const std::string &from, const std::string &to, Nodes &v ) const
+{
+	v.clear();
+
+	Dates::const_iterator itr = from.empty() ? _dates.begin() : _dates.lower_bound( from );
+	Dates::const_iterator itrE = to.empty() ? _dates.end() : _dates.lower_bound( to );
+
+	for ( ; itr != itrE; ++itr )
+		v.insert( v.end(), itr->second.begin(), itr->second.end() );
+}
+
+/////////////////////////////////////////////////////
+//      APERdb::release                            //
+/////////////////////////////////////////////////////
+// forget every node without deleting it, once they've been handed on.
+
+void APERdb::release( void )
+{
+	_b.clear();
+	_dates.clear();
+	_used = 0;
+}
+
+/////////////////////////////////////////////////////
+//      APERdb::hash                               //
+/////////////////////////////////////////////////////
+// FNV-1a.  addresses are short so anything fancier is wasted.
+
+std::size_t APERdb::hash( const std::string &key )
+{
+	std::size_t h = static_cast<std::size_t>( 14695981039346656037ULL );
+
+	for ( std::string::const_iterator itr = key.begin(); itr != key.end(); ++itr )
+	{
+		h ^= static_cast<unsigned char>( *itr );
+		h *= static_cast<std::size_t>( 1099511628211ULL );
+	}
+
+	return ( h );
+}
+
+/////////////////////////////////////////////////////
+//      APERdb::grow                               //
+/////////////////////////////////////////////////////
+
+void APERdb::grow( void )
+{
+	std::vector<Bucket> old;
+	old.swap( _b );
+
+	Bucket empty = { 0, 0 };
+	_b.assign( old.empty() ? 1024 : old.size() * 2, empty );
+
+	std::size_t mask = _b.size() - 1;
+
+	for ( std::vector<Bucket>::iterator itr = old.begin(); itr != old.end(); ++itr )
+	{
+		if ( itr->node == 0 ) continue;
+
+		std::size_t i = itr->hash & mask;
+		while ( _b[ i ].node != 0 ) i = ( i + 1 ) & mask;
+		_b[ i ] = *itr;
+	}
+}
+
+/////////////////////////////////////////////////////
+//      APERlinkpatterns                           //
+/////////////////////////////////////////////////////
+
+APERlinkpatterns::APERlinkpatterns( void ) : _s( 1 ), _count( 0 ) {}
+
+/////////////////////////////////////////////////////
+//      APERlinkpatterns::ispattern                //
+/////////////////////////////////////////////////////
+// a key is a pattern if a whole host label or path segment is "*" and
+// there's no query.  a "*" anywhere else is just a character.
+
+bool APERlinkpatterns::ispattern( const std::string &key )
+{
+	if ( key.find( '?' ) != std::string::npos ) return ( false );
+
+	std::vector<std::string> labels, segments;
+	splitkey( key, labels, segments );
+
+	return ( std::find( labels.begin(), labels.end(), "*" ) != labels.end() ||
+		std::find( segments.begin(), segments.end(), "*" ) != segments.end() );
+}
+
+/////////////////////////////////////////////////////
+//      APERlinkpatterns::splitkey                 //
+/////////////////////////////////////////////////////
+// the labels of a key's host, top level first, and its path segments.
+// any query is left off.
+
+void APERlinkpatterns::splitkey( const std::string &key, std::vector<std::string> &labels,
+	std::vector<std::string> &segments )
+{
+	labels.clear();
+	segments.clear();
+
+	std::string::size_type h = key.find_first_of( "/?" );
+	if ( h == std::string::npos ) h = key.size();
+
+	for ( std::string::size_type p = 0; p <= h; )
+	{
+		std::string::size_type q = key.find( tokdns, p );
+		if ( q == std::string::npos || q > h ) q = h;
+
+		labels.push_back( key.substr( p, q - p ) );
+		p = q + 1;
+	}
+
+	std::reverse( labels.begin(), labels.end() );
+
+	std::string::size_type e = key.find( '?', h );
+	if ( e == std::string::npos ) e = key.size();
+
+	for ( std::string::size_type p = h + 1; p < e; )
+	{
+		std::string::size_type q = key.find( '/', p );
+		if ( q == std::string::npos || q > e ) q = e;
+
+		if ( q > p ) segments.push_back( key.substr( p, q - p ) );
+		p = q + 1;
+	}
+}
+
+/////////////////////////////////////////////////////
+//      APERlinkpatterns::build                    //
+/////////////////////////////////////////////////////
+
+void APERlinkpatterns::build( const APERdb &db )
+{
+	APERdb::Nodes v;
+	db.nodes( v );
+
+	_s.assign( 1, State() );
+	_count = 0;
+
+	for ( APERdb::Nodes::iterator itr = v.begin(); itr != v.end(); ++itr )
+		if ( ispattern( (*itr)->address() ) ) add( *itr );
+}
+
+/////////////////////////////////////////////////////
+//      APERlinkpatterns::add                      //
+/////////////////////////////////////////////////////
+// the node stays the list's.  states are kept by index since adding
+// them moves the others.
+
+void APERlinkpatterns::add( APERnode *node )
+{
+	std::vector<std::string> labels, segments;
+	splitkey( node->address(), labels, segments );
+
+	std::size_t s = 0;
+
+	for ( std::vector<std::string>::iterator itr = labels.begin(); itr != labels.end(); ++itr )
+		s = child( s, *itr );
+
+	if ( _s[ s ].path == 0 )
+	{
+		_s.push_back( State() );
+		_s[ s ].path = _s.size() - 1;
+	}
+
+	s = _s[ s ].path;
+	++_count;
+
+	for ( std::size_t i = 0; i < segments.size(); ++i )
+	{
+		if ( segments[ i ] == "*" && i == segments.size() - 1 )
+		{
+			_s[ s ].rest = node;
+			return;
+		}
+
+		s = child( s, segments[ i ] );
+	}
+
+	_s[ s ].entry = node;
+}
+
+std::size_t APERlinkpatterns::child( std::size_t s, const std::string &token )
+{
+	std::size_t c = ( token == "*" ) ? _s[ s ].star : 0;
+
+	if ( token != "*" )
+	{
+		std::map<std::string, std::size_t>::iterator itr = _s[ s ].next.find( token );
+		if ( itr != _s[ s ].next.end() ) c = itr->second;
+	}
+
+	if ( c != 0 ) return ( c );
+
+	_s.push_back( State() );
+	c = _s.size() - 1;
+
+	if ( token == "*" ) _s[ s ].star = c;
+	else _s[ s ].next[ token ] = c;
+
+	return ( c );
+}
+
+/////////////////////////////////////////////////////
+//      APERlinkpatterns::match                    //
+/////////////////////////////////////////////////////
+// the pattern matching a canonical key, if any.  literal labels and
+// segments are tried before "*", so the most specific pattern wins.
+
+APERnode *APERlinkpatterns::match( const std::string &key ) const
+{
+	if ( _count == 0 ) return ( 0 );
+
+	std::vector<std::string> labels, segments;
+	splitkey( key, labels, segments );
+
+	return ( matchhost( 0, labels, 0, segments ) );
+}
+
+APERnode *APERlinkpatterns::matchhost( std::size_t s, const std::vector<std::string> &labels, std::size_t i,
+	const std::vector<std::string> &segments ) const
+{
+	const State &t = _s[ s ];
+
+	if ( i == labels.size() ) return ( t.path ? matchpath( t.path, segments, 0 ) : 0 );
+
+	APERnode *n = 0;
+
+	std::map<std::string, std::size_t>::const_iterator itr = t.next.find( labels[ i ] );
+	if ( itr != t.next.end() ) n = matchhost( itr->second, labels, i + 1, segments );
+
+	for ( std::size_t j = i + 1; n == 0 && t.star && j <= labels.size(); ++j )
+		n = matchhost( t.star, labels, j, segments );
+
+	return ( n );
+}
+
+APERnode *APERlinkpatterns::matchpath( std::size_t s, const std::vector<std::string> &segments, std::size_t i ) const
+{
+	const State &t = _s[ s ];
+
+	if ( i == segments.size() ) return ( t.entry ? t.entry : t.rest );
+
+	APERnode *n = 0;
+
+	std::map<std::string, std::size_t>::const_iterator itr = t.next.find( segments[ i ] );
+	if ( itr != t.next.end() ) n = matchpath( itr->second, segments, i + 1 );
+
+	if ( n == 0 && t.star ) n = matchpath( t.star, segments, i + 1 );
+
+	return ( n ? n : t.rest );
+}
+
+/////////////////////////////////////////////////////
+//      APERvariants::fold                         //
+/////////////////////////////////////////////////////
+// the form an address and its look-alikes share: the local part loses
+// any plus tag, its dots at providers that ignore them, and characters
+// drawn like others are read as those.  keys are lowercased already.
+
+// providers that ignore dots in the local part, under the domain they
+// deliver for.
+
+static const struct { const char *domain; const char *as; } dotless[] =
+{
+	{ "gmail.com", "gmail.com" },
+	{ "googlemail.com", "gmail.com" },
+	{ 0, 0 }
+};
+
+// what look-alikes are read as, tried in order at each character:
+// UTF-8 Cyrillic and Greek letters drawn like Latin ones, then ASCII.
+
+static const struct { const char *from; const char *to; } confusables[] =
+{
+	{ "\xd0\xb0", "a" }, { "\xd0\xb5", "e" }, { "\xd0\xbe", "o" },
+	{ "\xd1\x80", "p" }, { "\xd1\x81", "c" }, { "\xd1\x83", "y" },
+	{ "\xd1\x85", "x" }, { "\xd1\x95", "s" }, { "\xd1\x96", "i" },
+	{ "\xd1\x98", "j" }, { "\xce\xbf", "o" },
+	{ "rn", "m" }, { "vv", "w" }, { "0", "o" }, { "1", "l" },
+	{ 0, 0 }
+};
+
+std::string APERvariants::fold( const std::string &address )
+{
+	std::string::size_type at = address.rfind( tokmail );
+	if ( at == std::string::npos ) return ( address );
+
+	std::string local = address.substr( 0, at );
+	std::string domain = address.substr( at + 1 );
+
+	std::string::size_type plus = local.find( '+' );
+	if ( plus != std::string::npos && plus > 0 ) local.erase( plus );
+
+	for ( std::size_t i = 0; dotless[ i ].domain; ++i )
+	{
+		if ( domain != dotless[ i ].domain ) continue;
+
+		local.erase( std::remove( local.begin(), local.end(), tokdns ), local.end() );
+		domain = dotless[ i ].as;
+		break;
+	}
+
+	std::string folded;
+	folded.reserve( local.size() + 1 + domain.size() );
+
+	for ( std::size_t p = 0; p < local.size(); )
+	{
+		std::size_t i = 0;
+		while ( confusables[ i ].from && local.compare( p, strlen( confusables[ i ].from ), confusables[ i ].from ) != 0 ) ++i;
+
+		if ( confusables[ i ].from )
+		{
+			folded += confusables[ i ].to;
+			p += strlen( confusables[ i ].from );
+		}
+		else
+			folded += local[ p++ ];
+	}
+
+	return ( folded + tokmail + domain );
+}
+
+/////////////////////////////////////////////////////
+//      APERvariants::build                        //
+/////////////////////////////////////////////////////
+
+void APERvariants::build( const APERdb &db )
+{
+	APERdb::Nodes v;
+	db.nodes( v );
+
+	_b.clear();
+	_used = 0;
+
+	for ( APERdb::Nodes::iterator itr = v.begin(); itr != v.end(); ++itr )
+		add( *itr );
+}
+
+/////////////////////////////////////////////////////
+//      APERvariants::add                          //
+/////////////////////////////////////////////////////
+// open addressing as APERdb does, except that a folded form can have
+// any number of entries.
+
+void APERvariants::add( APERnode *node )
+{
+	if ( ( _used + 1 ) * 4 > _b.size() * 3 ) grow();
+
+	uint32_t h = hash32( fold( node->address() ) );
+	std::size_t mask = _b.size() - 1;
+	std::size_t i = h & mask;
+
+	while ( _b[ i ].node != 0 ) i = ( i + 1 ) & mask;
+
+	_b[ i ].hash = h;
+	_b[ i ].node = node;
+	++_used;
+}
+
+void APERvariants::grow( void )
+{
+	std::vector<Bucket> old;
+	old.swap( _b );
+
+	Bucket empty = { 0, 0 };
+	_b.assign( old.empty() ? 1024 : old.size() * 2, empty );
+
+	std::size_t mask = _b.size() - 1;
+
+	for ( std::vector<Bucket>::iterator itr = old.begin(); itr != old.end(); ++itr )
+	{
+		if ( itr->node == 0 ) continue;
+
+		std::size_t i = itr->hash & mask;
+		while ( _b[ i ].node != 0 ) i = ( i + 1 ) & mask;
+		_b[ i ] = *itr;
+	}
+}
+
+/////////////////////////////////////////////////////
+//      APERvariants::find                         //
+/////////////////////////////////////////////////////
+// the listed entries folding the same as address, in address order.
+
+void APERvariants::find( const std::string &address, APERdb::Nodes &v ) const
+{
+	v.clear();
+	if ( _used == 0 ) return;
+
+	std::string key = fold( address );
+	uint32_t h = hash32( key );
+	std::size_t mask = _b.size() - 1;
+
+	for ( std::size_t i = h & mask; _b[ i ].node != 0; i = ( i + 1 ) & mask )
+	{
+		if ( _b[ i ].hash != h || fold( _b[ i ].node->address() ) != key ) continue;
+
+		APERreply *p = dynamic_cast<APERreply *>( _b[ i ].node );
+		if ( p && p->iscleared() ) continue;
+
+		v.push_back( _b[ i ].node );
+	}
+
+	sortnodes( v );
+}
+
+/////////////////////////////////////////////////////
+//      APERlock::lock                             //
+/////////////////////////////////////////////////////
+// waits for any other aper working on the same list.
+
+bool APERlock::lock( const std::string &lockfile )
+{
+	unlock();
+
+	_fd = open( lockfile.c_str(), O_RDWR | O_CREAT, 0666 );
+	if ( _fd < 0 ) return ( false );
+
+	while ( flock( _fd, LOCK_EX ) != 0 )
+	{
+		if ( errno == EINTR ) continue;
+
+		unlock();
+		return ( false );
+	}
+
+	return ( true );
+}
+
+void APERlock::unlock( void )
+{
+	if ( _fd < 0 ) return;
+
+	close( _fd );
+	_fd = -1;
+}
+
+/////////////////////////////////////////////////////
+//      APERinput::APERinput                       //
+/////////////////////////////////////////////////////
+
+APERinput::APERinput( void ) :
+	_fd( -1 ), _codec( plain ), _nmagic( 0 ), _threaded( false ),
+	_failed( false ), _is( &_buf )
+{
+}
+
+APERinput::~APERinput( void )
+{
+	close();
+}
+
+/////////////////////////////////////////////////////
+//      APERinput::open                            //
+/////////////////////////////////////////////////////
+// sniff the first bytes for a compression magic number.  small plain
+// files are read directly.  anything else gets a thread to read, and
+// decode if need be, ahead of the parser.
+
+bool APERinput::open( const std::string &file )
+{
+	_file = file.empty() ? "stdin" : file;
+	_fd = file.empty() ? 0 : ::open( file.c_str(), O_RDONLY );
+	if ( _fd < 0 ) return ( false );
+
+	while ( _nmagic < sizeof( _magic ) )
+	{
+		ssize_t n = read( _fd, _magic + _nmagic, sizeof( _magic ) - _nmagic );
+		if ( n < 0 && errno == EINTR ) continue;
+		if ( n <= 0 ) break;
+		_nmagic += n;
+	}
+
+	const unsigned char *m = reinterpret_cast<const unsigned char *>( _magic );
+
+	if ( _nmagic >= 2 && m[0] == 0x1f && m[1] == 0x8b )
+		_codec = gzip;
+	else if ( _nmagic >= 4 && m[0] == 0x28 && m[1] == 0xb5 && m[2] == 0x2f && m[3] == 0xfd )
+		_codec = zstd;
+
+	struct stat st;
+
+	if ( _codec == plain && fstat( _fd, &st ) == 0 && S_ISREG( st.st_mode ) &&
+			st.st_size < static_cast<off_t>( 2 * inputblock ) )
+	{
+		_buf.attach( _fd, _magic, _nmagic );
+		return ( true );
+	}
+
+#ifndef APER_GZIP
+	if ( _codec == gzip ) { errnotify( ECODEC, "gzip: " + _file ); return ( false ); }
+#endif
+#ifndef APER_ZSTD
+	if ( _codec == zstd ) { errnotify( ECODEC, "zstd: " + _file ); return ( false ); }
+#endif
+
+	_blocks.reset();
+
+	if ( pthread_create( &_tid, 0, reader, this ) != 0 )
+	{
+		if ( _codec != plain ) return ( false );
+
+		_buf.attach( _fd, _magic, _nmagic );
+		return ( true );
+	}
+
+	_threaded = true;
+	_is.rdbuf( &_blocks );
+
+	return ( true );
+}
+
+/////////////////////////////////////////////////////
+//      APERinput::close                           //
+/////////////////////////////////////////////////////
+// false if the data could not be decoded.  giving up on a stream
+// before its end isn't a decoding error.
+
+bool APERinput::close( void )
+{
+	if ( _threaded )
+	{
+		_blocks.abandon();
+		pthread_join( _tid, 0 );
+		_threaded = false;
+		_is.rdbuf( &_buf );
+
+		if ( _failed ) errnotify( _codec == plain ? EFILE : EDECODE, _file );
+	}
+
+	if ( _fd > 0 ) ::close( _fd );
+	_fd = -1;
+
+	bool ok = ! _failed;
+	_failed = false;
+
+	return ( ok );
+}
+
+/////////////////////////////////////////////////////
+//      APERinput::reader                          //
+/////////////////////////////////////////////////////
+// reader thread, filling blocks until the input ends or the parser
+// gives up on it.
+
+void *APERinput::reader( void *arg )
+{
+	APERinput *in = static_cast<APERinput *>( arg );
+	bool ok;
+
+	switch ( in->_codec )
+	{
+		case gzip:	ok = in->decodegzip(); break;
+		case zstd:	ok = in->decodezstd(); break;
+		default:	ok = in->readplain(); break;
+	}
 
-		if ( s[0] == tokcomment )
-			comments.push_back( s );
-		else
-			break;
+	if ( ! ok && ! in->_blocks.abandoned() ) in->_failed = true;
+
+	in->_blocks.finish( in->_failed );
+
+	return ( 0 );
+}
+
+/////////////////////////////////////////////////////
+//      APERinput::readplain                       //
+/////////////////////////////////////////////////////
+// read(2) straight into the blocks, the magic bytes first.
+
+bool APERinput::readplain( void )
+{
+	std::size_t room;
+	char *p = _blocks.space( room );
+	if ( p == 0 ) return ( false );
+
+	std::memcpy( p, _magic, _nmagic );
+	_blocks.commit( _nmagic );
+
+	for ( ;; )
+	{
+		if ( ( p = _blocks.space( room ) ) == 0 ) return ( false );
+
+		ssize_t n = read( _fd, p, room );
+		if ( n < 0 && errno == EINTR ) continue;
+		if ( n < 0 ) return ( false );
+		if ( n == 0 ) return ( true );
+
+		_blocks.commit( n );
 	}
+}
 
-	if ( f->good() )
+/////////////////////////////////////////////////////
+//      APERinput::decodegzip                      //
+/////////////////////////////////////////////////////
+// concatenated gzip members are decoded as one stream, like gunzip.
+
+bool APERinput::decodegzip( void )
+{
+#ifdef APER_GZIP
+	std::vector<char> in( iobufsize );
+	z_stream zs;
+	std::memset( &zs, 0, sizeof( zs ) );
+
+	if ( inflateInit2( &zs, 15 + 32 ) != Z_OK ) return ( false );
+
+	std::memcpy( &in[0], _magic, _nmagic );
+	zs.next_in = reinterpret_cast<Bytef *>( &in[0] );
+	zs.avail_in = _nmagic;
+
+	bool ok = true, ended = false;
+
+	while ( ok )
 	{
-		do
+		if ( zs.avail_in == 0 )
 		{
-			if ( s[0] == tokcomment ) continue;
+			ssize_t n = read( _fd, &in[0], in.size() );
+			if ( n < 0 && errno == EINTR ) continue;
+			if ( n < 0 ) { ok = false; break; }
+			if ( n == 0 ) { ok = ended; break; }
 
-			trimspace( s, ENDS );
-			if ( s.empty() ) continue;
+			zs.next_in = reinterpret_cast<Bytef *>( &in[0] );
+			zs.avail_in = n;
+		}
 
-			std::string address, date;
+		if ( ended )
+		{
+			inflateReset( &zs );
+			ended = false;
+		}
 
-			std::istringstream iss( split( s ) );
-			iss >> address >> date;
+		std::size_t room;
+		char *out = _blocks.space( room );
+		if ( out == 0 ) { ok = false; break; }
 
-			APERcleared *node = new (std::nothrow) APERcleared;
+		zs.next_out = reinterpret_cast<Bytef *>( out );
+		zs.avail_out = room;
 
-			errstate err = ( node ) ? EOK : EMEM;
-			if ( err == EOK && ! node->isvalidaddress( address ) )
-				err = errnotify( EADDRESS, address, line );
-			if ( err == EOK && ! node->isvaliddate( date ) )
-				err = errnotify( EDATE, date, line );
+		int r = inflate( &zs, Z_NO_FLUSH );
+		if ( r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR ) { ok = false; break; }
+		if ( r == Z_STREAM_END ) ended = true;
 
-			if ( err != EOK )
-			{
-				delete node;
-				return ( false );
-			}
+		_blocks.commit( room - zs.avail_out );
+	}
 
-			address = tolowercase( address );
-			node->address( address );
-			node->date( date );
+	inflateEnd( &zs );
 
-			if ( aperdb.count( address ) == 0 )
-			{
-				aperdb[ address ] = node;
-			}
-			else
-			{
-				delete node;
+	return ( ok );
+#else
+	return ( false );
+#endif
+}
 
-				if ( ! aperdb[ address ]->isnewer( date ) )
-					aperdb[ address ]->date( date );
-			}
+/////////////////////////////////////////////////////
+//      APERinput::decodezstd                      //
+/////////////////////////////////////////////////////
+
+bool APERinput::decodezstd( void )
+{
+#ifdef APER_ZSTD
+	std::vector<char> in( iobufsize );
+	ZSTD_DStream *zds = ZSTD_createDStream();
+
+	if ( zds == 0 ) return ( false );
+	ZSTD_initDStream( zds );
+
+	std::memcpy( &in[0], _magic, _nmagic );
+	ZSTD_inBuffer zin = { &in[0], _nmagic, 0 };
+
+	bool ok = true;
+	std::size_t r = 0;
+
+	while ( ok )
+	{
+		if ( zin.pos == zin.size )
+		{
+			ssize_t n = read( _fd, &in[0], in.size() );
+			if ( n < 0 && errno == EINTR ) continue;
+			if ( n < 0 ) { ok = false; break; }
+			if ( n == 0 ) { ok = ( r == 0 ); break; }
+
+			zin.size = n;
+			zin.pos = 0;
 		}
-		while ( ++line, getline( *f, s ) );
+
+		std::size_t room;
+		char *out = _blocks.space( room );
+		if ( out == 0 ) { ok = false; break; }
+
+		ZSTD_outBuffer zout = { out, room, 0 };
+
+		r = ZSTD_decompressStream( zds, &zout, &zin );
+		if ( ZSTD_isError( r ) ) { ok = false; break; }
+
+		_blocks.commit( zout.pos );
 	}
 
-	return ( true );
+	ZSTD_freeDStream( zds );
+
+	return ( ok );
+#else
+	return ( false );
+#endif
 }
 
 /////////////////////////////////////////////////////
-//      loadaperlinks                              //
+//      APERinput::fdbuf                           //
 /////////////////////////////////////////////////////
+// minimal read buffer over a descriptor.  any bytes already taken off
+// the descriptor are handed back first.
 
-bool loadaperlinks( std::istream *f )
+void APERinput::fdbuf::attach( int fd, const char *p, std::size_t n )
 {
-	std::string s;
-	linenum_type line = 0;
+	_fd = fd;
+	std::memcpy( _buf, p, n );
+	setg( _buf, _buf, _buf + n );
+}
 
-	while ( getline( *f, s ) )
+int APERinput::fdbuf::underflow( void )
+{
+	if ( gptr() < egptr() ) return ( traits_type::to_int_type( *gptr() ) );
+	if ( _fd < 0 ) return ( traits_type::eof() );
+
+	ssize_t n;
+	do n = read( _fd, _buf, sizeof( _buf ) ); while ( n < 0 && errno == EINTR );
+	if ( n <= 0 ) return ( traits_type::eof() );
+
+	setg( _buf, _buf, _buf + n );
+
+	return ( traits_type::to_int_type( *gptr() ) );
+}
+
+/////////////////////////////////////////////////////
+//      APERinput::blockbuf                        //
+/////////////////////////////////////////////////////
+// the reader fills a block through space() and commit(), and it's
+// handed over once full or at the end.  the parser gives a block back
+// when it asks for the next, so the reader is held up only while it is
+// a whole block ahead.
+
+APERinput::blockbuf::blockbuf( void )
+{
+	pthread_mutex_init( &_lock, 0 );
+	pthread_cond_init( &_cond, 0 );
+	reset();
+}
+
+APERinput::blockbuf::~blockbuf( void )
+{
+	pthread_cond_destroy( &_cond );
+	pthread_mutex_destroy( &_lock );
+}
+
+void APERinput::blockbuf::reset( void )
+{
+	_in = _out = _full = 0;
+	_filled = 0;
+	_filling = _holding = _ended = _failed = _abandoned = false;
+	setg( 0, 0, 0 );
+}
+
+char *APERinput::blockbuf::space( std::size_t &n )
+{
+	if ( ! _filling )
 	{
-		++line;
-		trimspace( s, ENDS );
-		if ( s.empty() ) continue;
+		pthread_mutex_lock( &_lock );
+		while ( _full == 2 && ! _abandoned ) pthread_cond_wait( &_cond, &_lock );
+		bool abandoned = _abandoned;
+		pthread_mutex_unlock( &_lock );
 
-		if ( s[0] == tokcomment )
-			comments.push_back( s );
-		else
-			break;
+		if ( abandoned ) return ( 0 );
+
+		if ( _block[ _in ].empty() ) _block[ _in ].resize( inputblock );
+		_filling = true;
+		_filled = 0;
 	}
 
-	if ( f->good() )
+	n = _block[ _in ].size() - _filled;
+
+	return ( &_block[ _in ][ _filled ] );
+}
+
+void APERinput::blockbuf::commit( std::size_t n )
+{
+	_filled += n;
+	if ( _filled == _block[ _in ].size() ) publish();
+}
+
+void APERinput::blockbuf::publish( void )
+{
+	pthread_mutex_lock( &_lock );
+	_size[ _in ] = _filled;
+	_in ^= 1;
+	++_full;
+	_filling = false;
+	pthread_cond_broadcast( &_cond );
+	pthread_mutex_unlock( &_lock );
+}
+
+void APERinput::blockbuf::finish( bool failed )
+{
+	if ( _filling && _filled > 0 ) publish();
+	_filling = false;
+
+	pthread_mutex_lock( &_lock );
+	_ended = true;
+	_failed = failed;
+	pthread_cond_broadcast( &_cond );
+	pthread_mutex_unlock( &_lock );
+}
+
+void APERinput::blockbuf::abandon( void )
+{
+	pthread_mutex_lock( &_lock );
+	_abandoned = true;
+	pthread_cond_broadcast( &_cond );
+	pthread_mutex_unlock( &_lock );
+}
+
+bool APERinput::blockbuf::abandoned( void )
+{
+	pthread_mutex_lock( &_lock );
+	bool abandoned = _abandoned;
+	pthread_mutex_unlock( &_lock );
+
+	return ( abandoned );
+}
+
+int APERinput::blockbuf::underflow( void )
+{
+	if ( gptr() < egptr() ) return ( traits_type::to_int_type( *gptr() ) );
+
+	pthread_mutex_lock( &_lock );
+
+	if ( _holding )
 	{
-		do
-		{
-			if ( s[0] == tokcomment ) continue;
+		_holding = false;
+		_out ^= 1;
+		--_full;
+		pthread_cond_broadcast( &_cond );
+	}
 
-			trimspace( s, ENDS );
-			if ( s.empty() ) continue;
+	while ( _full == 0 && ! _ended ) pthread_cond_wait( &_cond, &_lock );
 
-			std::string address, date;
+	bool more = _full > 0;
+	bool failed = _failed;
 
-			std::istringstream iss( split( s ) );
-			iss >> address >> date;
+	if ( more )
+	{
+		_holding = true;
+		char *p = &_block[ _out ][0];
+		setg( p, p, p + _size[ _out ] );
+	}
 
-			APERlinks *node = new (std::nothrow) APERlinks;
-			errstate err = EOK;
+	pthread_mutex_unlock( &_lock );
 
-			if ( node )
-			{
-				address = node->cleanup( address );
-			}
-			else
-			{
-				err = EMEM;
-			}
+// istream turns an exception from its streambuf into badbit, which
+// fails the getline() in progress.
 
-			if ( err == EOK && ! node->isvalidaddress( address ) )
-				err = errnotify( EADDRESS, address, line );
-			if ( err == EOK && ! node->isvaliddate( date ) )
-				err = errnotify( EDATE, date, line );
+	if ( ! more && failed ) throw std::ios_base::failure( "input failed" );
+	if ( ! more ) return ( traits_type::eof() );
 
-			if ( err != EOK )
+	return ( traits_type::to_int_type( *gptr() ) );
+}
+
+/////////////////////////////////////////////////////
+//      APERoutput::APERoutput                     //
+/////////////////////////////////////////////////////
+
+APERoutput::APERoutput( void ) : _fd( -1 ), _codec( plain ), _os( &_buf ) {}
+
+APERoutput::~APERoutput( void )
+{
+	close();
+}
+
+/////////////////////////////////////////////////////
+//      APERoutput::open                           //
+/////////////////////////////////////////////////////
+
+bool APERoutput::open( const char *file, codec c )
+{
+#ifndef APER_GZIP
+	if ( c == gzip ) { errnotify( ECODEC, "gzip" ); return ( false ); }
+#endif
+#ifndef APER_ZSTD
+	if ( c == zstd ) { errnotify( ECODEC, "zstd" ); return ( false ); }
+#endif
+
+	_fd = ::open( file, O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+	if ( _fd < 0 ) return ( false );
+
+	_codec = c;
+
+	return ( _buf.open( _fd, c ) );
+}
+
+/////////////////////////////////////////////////////
+//      APERoutput::close                          //
+/////////////////////////////////////////////////////
+// false if anything at all went wrong writing the file.
+
+bool APERoutput::close( void )
+{
+	if ( _fd < 0 ) return ( false );
+
+	bool ok = _buf.finish() && _os;
+	if ( ::close( _fd ) != 0 ) ok = false;
+	_fd = -1;
+
+	if ( ! ok && _codec != plain ) errnotify( EENCODE );
+
+	return ( ok );
+}
+
+/////////////////////////////////////////////////////
+//      APERoutput::codecbuf                       //
+/////////////////////////////////////////////////////
+
+APERoutput::codecbuf::codecbuf( void ) : _fd( -1 ), _codec( plain ), _failed( false ),
+	_cmpfd( -1 ), _same( false ), _buf( outputblock ), _zbuf( outputblock )
+#ifdef APER_ZSTD
+	, _zcs( 0 )
+#endif
+{}
+
+APERoutput::codecbuf::~codecbuf( void )
+{
+	if ( _cmpfd >= 0 ) ::close( _cmpfd );
+}
+
+bool APERoutput::codecbuf::open( int fd, codec c )
+{
+	_fd = fd;
+	_codec = c;
+	_failed = false;
+	setp( &_buf[0], &_buf[0] + _buf.size() );
+
+#ifdef APER_GZIP
+	if ( c == gzip )
+	{
+		std::memset( &_zs, 0, sizeof( _zs ) );
+		if ( deflateInit2( &_zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+			return ( false );
+	}
+#endif
+#ifdef APER_ZSTD
+	if ( c == zstd )
+	{
+		_zcs = ZSTD_createCStream();
+		if ( _zcs == 0 || ZSTD_isError( ZSTD_initCStream( _zcs, 19 ) ) ) return ( false );
+	}
+#endif
+
+	return ( true );
+}
+
+int APERoutput::codecbuf::overflow( int c )
+{
+	if ( ! put( pbase(), pptr() - pbase(), false ) ) return ( traits_type::eof() );
+	setp( &_buf[0], &_buf[0] + _buf.size() );
+
+	if ( ! traits_type::eq_int_type( c, traits_type::eof() ) )
+		sputc( traits_type::to_char_type( c ) );
+
+	return ( traits_type::not_eof( c ) );
+}
+
+int APERoutput::codecbuf::sync( void )
+{
+	if ( ! put( pbase(), pptr() - pbase(), false ) ) return ( -1 );
+	setp( &_buf[0], &_buf[0] + _buf.size() );
+
+	return ( 0 );
+}
+
+bool APERoutput::codecbuf::finish( void )
+{
+	if ( _fd < 0 ) return ( false );
+
+	bool ok = put( pbase(), pptr() - pbase(), true );
+	setp( &_buf[0], &_buf[0] + _buf.size() );
+
+// the same only if the old file ends here too.
+
+	char c;
+	if ( _same && read( _cmpfd, &c, 1 ) != 0 ) _same = false;
+	if ( _cmpfd >= 0 ) { ::close( _cmpfd ); _cmpfd = -1; }
+	if ( ! ok ) _same = false;
+
+#ifdef APER_GZIP
+	if ( _codec == gzip ) deflateEnd( &_zs );
+#endif
+#ifdef APER_ZSTD
+	if ( _codec == zstd ) { ZSTD_freeCStream( _zcs ); _zcs = 0; }
+#endif
+
+	_fd = -1;
+
+	return ( ok );
+}
+
+/////////////////////////////////////////////////////
+//      APERoutput::codecbuf::put                  //
+/////////////////////////////////////////////////////
+// run n bytes through the encoder, flushing it all on the last call.
+
+bool APERoutput::codecbuf::put( const char *p, std::size_t n, bool last )
+{
+	if ( _failed ) return ( false );
+
+	switch ( _codec )
+	{
+#ifdef APER_GZIP
+		case gzip:
+		{
+			_zs.next_in = reinterpret_cast<Bytef *>( const_cast<char *>( p ) );
+			_zs.avail_in = n;
+
+			int r;
+			do
 			{
-				delete node;
-				return ( false );
+				_zs.next_out = reinterpret_cast<Bytef *>( &_zbuf[0] );
+				_zs.avail_out = _zbuf.size();
+
+				r = deflate( &_zs, last ? Z_FINISH : Z_NO_FLUSH );
+				if ( r == Z_STREAM_ERROR ) { _failed = true; break; }
+
+				if ( ! writeall( &_zbuf[0], _zbuf.size() - _zs.avail_out ) ) break;
 			}
+			while ( _zs.avail_out == 0 || ( last && r != Z_STREAM_END ) );
+		}
+			break;
+#endif
 
-			node->address( address );
-			node->date( date );
+#ifdef APER_ZSTD
+		case zstd:
+		{
+			ZSTD_inBuffer zin = { p, n, 0 };
 
-			if ( aperdb.count( address ) == 0 )
+			while ( zin.pos < zin.size )
 			{
-				aperdb[ address ] = node;
+				ZSTD_outBuffer zout = { &_zbuf[0], _zbuf.size(), 0 };
+
+				std::size_t r = ZSTD_compressStream( _zcs, &zout, &zin );
+				if ( ZSTD_isError( r ) ) { _failed = true; break; }
+
+				if ( ! writeall( &_zbuf[0], zout.pos ) ) break;
 			}
-			else
+
+			for ( std::size_t r = 1; last && r != 0 && ! _failed; )
 			{
-				delete node;
+				ZSTD_outBuffer zout = { &_zbuf[0], _zbuf.size(), 0 };
+
+				r = ZSTD_endStream( _zcs, &zout );
+				if ( ZSTD_isError( r ) ) { _failed = true; break; }
 
-				if ( ! aperdb[ address ]->isnewer( date ) )
-					aperdb[ address ]->date( date );
+				writeall( &_zbuf[0], zout.pos );
 			}
 		}
-		while ( ++line, getline( *f, s ) );
+			break;
+#endif
+
+		default:
+			static_cast<void>( last );	// nothing to flush without an encoder
+			writeall( p, n );
+			break;
+	}
+
+	return ( ! _failed );
+}
+
+bool APERoutput::codecbuf::writeall( const char *p, std::size_t n )
+{
+	if ( _same ) match( p, n );
+
+	while ( n > 0 )
+	{
+		ssize_t w = write( _fd, p, n );
+		if ( w < 0 && errno == EINTR ) continue;
+		if ( w <= 0 ) { _failed = true; return ( false ); }
+
+		p += w;
+		n -= w;
 	}
 
 	return ( true );
 }
 
 /////////////////////////////////////////////////////
-//      loaduserdb                                 //
+//      APERoutput::codecbuf::compare              //
 /////////////////////////////////////////////////////
+// compare what's written with file, which needn't exist.
 
-bool loaduserdb( std::string datafile )
+void APERoutput::codecbuf::compare( const std::string &file )
 {
-	std::istream *f = &std::cin;
-	std::ifstream ifs;
-
-	if ( ! datafile.empty() )
-	{
-		ifs.open( datafile.c_str() );
-		if ( ! ifs )
-		{
-			errnotify( EFILE, datafile );
-			return ( false );
-		}
-		f = &ifs;
-	}
+	if ( _cmpfd >= 0 ) ::close( _cmpfd );
 
-	bool status = true;
+	_cmpfd = ::open( file.c_str(), O_RDONLY );
+	_same = ( _cmpfd >= 0 );
+}
 
-	if ( dbmode.test( reply ) ) status = loaduserreply( f );
-	if ( dbmode.test( links ) ) status = loaduserlinks( f );
-	if ( dbmode.test( cleared ) ) status = loadusercleared( f );
+void APERoutput::codecbuf::match( const char *p, std::size_t n )
+{
+	_cmp.resize( std::min( n, iobufsize ) );
 
-	if ( *f != std::cin )
-		ifs.close();
-	else
-		f->ignore( std::numeric_limits<int>::max() );
+	while ( _same && n > 0 )
+	{
+		ssize_t r = read( _cmpfd, &_cmp[0], std::min( n, _cmp.size() ) );
+		if ( r < 0 && errno == EINTR ) continue;
 
-	return ( status );
+		if ( r <= 0 || memcmp( p, &_cmp[0], r ) != 0 ) _same = false;
+		else { p += r; n -= r; }
+	}
 }
 
 /////////////////////////////////////////////////////
-//      loaduserreply                              //
+//      trimspace                                  //
 /////////////////////////////////////////////////////
+// no cleverness here, just plain brute force trimming.
 
-bool loaduserreply( std::istream *f )
+std::string trimspace( std::string &s, trimspec trim )
 {
-	std::string s;
-	linenum_type line = 0;
+	if ( s.empty() ) return s;
 
-	while ( getline( *f, s ) )
+	switch ( trim )
 	{
-		++line;
-		trimspace( s, ALL );
-		if ( s.empty() ) continue;
-		if ( s[0] == tokcomment ) continue;
-			
-		std::string address, addrt, date;
-		
-		std::istringstream iss( split( s ) );
-		iss >> address >> addrt >> date;
+		case ALL:
+		{
+			std::string::iterator itr = s.begin();
+			std::string::iterator itrE = s.end();
+			std::string t;
 
-		APERreply *node = new (std::nothrow) APERreply;
+			while ( itr != itrE )
+			{
+				if ( ! isspace( *itr ) ) t += *itr;
+				++itr;
+			}
 
-		errstate err = ( node ) ? EOK : EMEM;
-		if ( err == EOK && ! node->isvalidaddress( address ) )
-			err = errnotify( EADDRESS, address, line );
-		if ( err == EOK && ! node->isvalidaddrtype( addrt ) )
-			err = errnotify( EATYPE, addrt, line );
-		if ( err == EOK && ! node->isvaliddate( date ) )
-			err = errnotify( EDATE, date, line );
+			s = t;
+		}
+			break;
 
-		if ( err != EOK )
+		case ENDS:
 		{
-			delete node;
-			return ( false );
-		}
+			std::string::iterator itr = s.begin();
+			std::string::iterator itrE = s.end();
 
-		address = tolowercase( address );
-		node->address( address );
-		node->addrtype( addrt );
-		node->date( date );
+			while ( itr != itrE )
+			{
+				if ( ! isspace( *itr ) ) break;
+				++itr;
+			}
 
-		if ( aperdb.count( address ) == 0 )
-		{
-			aperdb[ address ] = node;
-		}
-		else
-		{
-			APERreply *p = dynamic_cast<APERreply *>( aperdb[ address ] );
+			if ( itr == itrE ) break;
+
+			std::string t = s.substr( s.find( *itr ) );
+
+			std::string::reverse_iterator ritr = t.rbegin();
+			std::string::reverse_iterator ritrE = t.rend();
 
-			if ( node->isnewer( p->date() ) )
+			while ( ritr != ritrE )
 			{
-				if ( p->iscleared() ) p->unclear();
-				p->date( date );
+				if ( ! isspace( *ritr ) ) break;
+				++ritr;
 			}
 
-			if ( p->addrtype() != addrt ) p->addrtype( addrt );
+// at this point the reverse iterator must be pointing to
+// a non-space char since the earlier while() stopped at one.
 
-			delete node;
+			t.resize( t.find_last_of( *ritr ) + 1 );
+			s = t;
 		}
+			break;
 	}
 
-	return ( true );
+	return s;
 }
 
 /////////////////////////////////////////////////////
-//      loaduserlinks                              //
+//      split                                      //
 /////////////////////////////////////////////////////
+// not as powerful as the perl split, but it does what we need.
 
-bool loaduserlinks( std::istream *f )
+std::string split( std::string s, char c )
 {
-	std::string s;
-	linenum_type line = 0;
-
-	while ( getline( *f, s ) )
-	{
-		++line;
-		if ( s.empty() ) continue;
-		if ( s[0] == tokcomment ) continue;
-
-		std::string address, date;
-
-		std::istringstream iss( split( s ) );
-		iss >> address >> date;
-
-		APERlinks *node = new (std::nothrow) APERlinks;
-		errstate err = EOK;
+	trimspace( s, ALL );
+	std::replace( s.begin(), s.end(), c, toksplit );
+	return ( s );
+}
 
-		if ( node )
-		{
-			address = node->cleanup( address );
-		}
-		else
-		{
-			err = EMEM;
-		}
+/////////////////////////////////////////////////////
+//      tolowercase                                //
+/////////////////////////////////////////////////////
 
-		if ( err == EOK && ! node->isvalidaddress( address ) )
-			err = errnotify( EADDRESS, address, line );
-		if ( err == EOK && ! node->isvaliddate( date ) )
-			err = errnotify( EDATE, date, line );
+std::string tolowercase( std::string s )
+{
+	std::transform( s.begin(), s.end(), s.begin(), tolower );
+	return ( s );
+}
 
-		if ( err != EOK )
-		{
-			delete node;
-			return ( false );
-		}
+/////////////////////////////////////////////////////
+//      hash32                                     //
+/////////////////////////////////////////////////////
+// 32 bit FNV-1a, for hashes that are kept in files.
 
-		node->address( address );
-		node->date( date );
+uint32_t hash32( const std::string &s )
+{
+	return ( hash32( s.data(), s.size() ) );
+}
 
-		if ( aperdb.count( address ) == 0 )
-		{
-			aperdb[ address ] = node;
-		}
-		else
-		{
-			delete node;
+uint32_t hash32( const char *p, std::size_t n )
+{
+	uint32_t h = 2166136261U;
 
-			if ( ! aperdb[ address ]->isnewer( date ) )
-				aperdb[ address ]->date( date );
-		}
+	for ( std::size_t i = 0; i < n; ++i )
+	{
+		h ^= static_cast<unsigned char>( p[ i ] );
+		h *= 16777619U;
 	}
-		
-	return ( true );
+
+	return ( h );
 }
 
 /////////////////////////////////////////////////////
-//      loadusercleared                            //
+//      md5hex                                     //
 /////////////////////////////////////////////////////
+// md5 (rfc 1321) of s in lowercase hex, as perl's md5_hex gives it.
 
-bool loadusercleared( std::istream *f )
+static void md5block( uint32_t h[ 4 ], const unsigned char *p )
 {
-	std::string s;
-	linenum_type line = 0;
+	static const uint32_t k[ 64 ] =
+	{
+		0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+		0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+		0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+		0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+		0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+		0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+		0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+		0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+	};
 
-	while ( getline( *f, s ) )
+	static const unsigned int s[ 16 ] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+	uint32_t w[ 16 ];
+	for ( unsigned int i = 0; i < 16; ++i )
+		w[ i ] = p[ 4 * i ] | ( p[ 4 * i + 1 ] << 8 ) | ( p[ 4 * i + 2 ] << 16 ) | ( static_cast<uint32_t>( p[ 4 * i + 3 ] ) << 24 );
+
+	uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+
+	for ( unsigned int i = 0; i < 64; ++i )
 	{
-		++line;
-		trimspace( s, ENDS );
-		if ( s.empty() ) continue;
-		if ( s[0] == tokcomment ) continue;
+		uint32_t f;
+		unsigned int g;
 
-		std::string address, date;
+		if ( i < 16 ) { f = ( b & c ) | ( ~b & d ); g = i; }
+		else if ( i < 32 ) { f = ( d & b ) | ( ~d & c ); g = ( 5 * i + 1 ) % 16; }
+		else if ( i < 48 ) { f = b ^ c ^ d; g = ( 3 * i + 5 ) % 16; }
+		else { f = c ^ ( b | ~d ); g = ( 7 * i ) % 16; }
 
-		std::istringstream iss( split( s ) );
-		iss >> address >> date;
+		unsigned int r = s[ ( i / 16 ) * 4 + i % 4 ];
 
-		APERcleared *node = new (std::nothrow) APERcleared;
+		f += a + k[ i ] + w[ g ];
+		a = d;
+		d = c;
+		c = b;
+		b += ( f << r ) | ( f >> ( 32 - r ) );
+	}
 
-		errstate err = ( node ) ? EOK : EMEM;
-		if ( err == EOK && ! node->isvalidaddress( address ) )
-			err = errnotify( EADDRESS, address, line );
-		if ( err == EOK && ! node->isvaliddate( date ) )
-			err = errnotify( EDATE, date, line );
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+}
 
-		if ( err != EOK )
-		{
-			delete node;
-			return ( false );
-		}
+std::string md5hex( const std::string &s )
+{
+	uint32_t h[ 4 ] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	uint64_t bits = static_cast<uint64_t>( s.size() ) * 8;
 
-		address = tolowercase( address );
-		node->address( address );
-		node->date( date );
+	std::string m = s;
+	m += static_cast<char>( 0x80 );
+	while ( m.size() % 64 != 56 ) m += '\0';
+	for ( unsigned int i = 0; i < 8; ++i ) m += static_cast<char>( ( bits >> ( 8 * i ) ) & 0xff );
 
-		if ( aperdb.count( address ) == 0 )
-		{
-			aperdb[ address ] = node;
-		}
-		else
-		{
-			delete node;
+	for ( std::size_t i = 0; i < m.size(); i += 64 )
+		md5block( h, reinterpret_cast<const unsigned char *>( m.data() ) + i );
 
-			if ( ! aperdb[ address ]->isnewer( date ) )
-				aperdb[ address ]->date( date );
-		}
+	const char hex[] = "0123456789abcdef";
+	std::string out;
+
+	for ( unsigned int i = 0; i < 16; ++i )
+	{
+		unsigned int c = ( h[ i / 4 ] >> ( 8 * ( i % 4 ) ) ) & 0xff;
+		out += hex[ c >> 4 ];
+		out += hex[ c & 0x0f ];
 	}
-		
-	return ( true );
+
+	return ( out );
 }
 
 /////////////////////////////////////////////////////
-//      writeaperdb                                //
+//      listkey                                    //
 /////////////////////////////////////////////////////
+// an address or link to look up, normalized the way entries are.
 
-bool writeaperdb( void )
+std::string listkey( datamode m, std::string key )
 {
-	const char *tmpfile = tempnam( tmpdir, tmpprefix );
-
-	std::ofstream ofs( tmpfile );
-	if ( ! ofs )
+	if ( m == links )
 	{
-		errnotify( EXFILE, tmpfile );
-		return ( false );
+		APERlinks n;
+		return ( n.cleanup( key ) );
 	}
 
-	for ( Comments::iterator itr = comments.begin(); itr != comments.end(); ++itr )
-		ofs << *itr << std::endl;
-
-	for ( APERdb::iterator itr = aperdb.begin(); itr != aperdb.end(); ++itr )
-		itr->second->write( ofs );
-
-	ofs.close();
+	return ( tolowercase( trimspace( key, ALL ) ) );
+}
 
-	std::string s;
-	if ( dbmode.test( reply ) ) s = replyfile;
-	if ( dbmode.test( links ) ) s = linksfile;
-	if ( dbmode.test( cleared ) ) s = replyclearedfile;
+/////////////////////////////////////////////////////
+//      domainat                                   //
+/////////////////////////////////////////////////////
+// where a key splits into its domain and the rest: after the last @ of
+// an address, before the path of a link.
 
-	if ( rename( tmpfile, s.c_str() ) != 0 )
+std::string::size_type domainat( datamode m, const std::string &key )
+{
+	if ( m == links )
 	{
-		errnotify( EWAPERDB, s );
-		if ( unlink( tmpfile ) != 0 ) errnotify( EXFILERM, tmpfile );
-		return ( false );
+		std::string::size_type p = key.find_first_of( "/?#" );
+		return ( p == std::string::npos ? key.size() : p );
 	}
 
-	return ( true );
+	std::string::size_type p = key.rfind( tokmail );
+	return ( p == std::string::npos ? 0 : p + 1 );
 }
 
 /////////////////////////////////////////////////////
-//      APERnode::APERnode                         //
+//      daysago                                    //
 /////////////////////////////////////////////////////
+// the date, as YYYYMMDD, the given number of days before today.
 
-APERnode::APERnode( std::string d ) : _date( d ) {}
+std::string daysago( unsigned int days )
+{
+	time_t now = time( 0 );
+	struct tm t;
 
-APERnode::APERnode( void ) {}
+	localtime_r( &now, &t );
+	t.tm_mday -= days;
+	t.tm_hour = 12;		// stay clear of DST edges
+	t.tm_isdst = -1;
+	mktime( &t );
+
+	char buf[ 16 ];
+	strftime( buf, sizeof( buf ), "%Y%m%d", &t );
+
+	return ( buf );
+}
 
 /////////////////////////////////////////////////////
-//      APERnode::isvaliddate                      //
+//      numthreads                                 //
 /////////////////////////////////////////////////////
-// a valid date has the form YYYYMMDD consisting of all digits.
-// valid formats are strings in the set (00000000, 99999999] and
-// evalute to a valid date for the system.
-//
-// valid dates are between 20:45:52  UTC,  December  13,  1901
-// and 03:14:07 UTC,  January 19, 2038 .
-//
-// there is a lot of overkill here but it helps in strange ways.
+// how many threads a job of the given size deserves.
 
-bool APERnode::isvaliddate( std::string date ) const
+unsigned int numthreads( std::size_t jobsize )
 {
-	if ( date.empty() ) return ( false );
-	if ( date.size() != 8 ) return ( false );
+	if ( jobsize < minparallel ) return ( 1 );
 
-	std::string Y( date.substr( 0, 4 ) );
-	std::string M( date.substr( 4, 2 ) );
-	std::string D( date.substr( 6, 2 ) );
+	long n = sysconf( _SC_NPROCESSORS_ONLN );
+	if ( n < 1 ) return ( 1 );
 
-	std::string digits = "0123456789";
-	if ( Y.find_first_not_of( digits ) != std::string::npos ) return ( false );
-	if ( M.find_first_not_of( digits ) != std::string::npos ) return ( false );
-	if ( D.find_first_not_of( digits ) != std::string::npos ) return ( false );
+	return ( std::min( static_cast<unsigned int>( n ), maxthreads ) );
+}
 
-	int y( atoi( Y.c_str() ) );
-	int m( atoi( M.c_str() ) );
-	int d( atoi( D.c_str() ) );
+/////////////////////////////////////////////////////
+//      sortnodes                                  //
+/////////////////////////////////////////////////////
+// sort nodes by address.  big lists are cut into one run per thread,
+// the runs sorted concurrently and then merged pairwise.
 
-	if ( y * m * d == 0 ) return ( false );
-	if ( m < 1 || m > 12 ) return ( false );
-	if ( d < 1 || d > 31 ) return ( false );
+struct SortRun
+{
+	APERdb::Nodes::iterator first, middle, last;
+};
 
-	struct tm t;
+static bool nodeless( const APERnode *a, const APERnode *b )
+{
+	return ( a->address() < b->address() );
+}
 
-	t.tm_year = y - 1900;
-	t.tm_mon = m - 1;
-	t.tm_mday = d;
-	t.tm_hour = 0;
-	t.tm_min = 0;
-	t.tm_sec = 1;
-	t.tm_isdst = -1;
+static void *sortrun( void *arg )
+{
+	SortRun *r = static_cast<SortRun *>( arg );
 
-	return ( mktime( &t ) != -1 ); 
-}
+	if ( r->middle == r->last )
+		std::sort( r->first, r->last, nodeless );
+	else
+		std::inplace_merge( r->first, r->middle, r->last, nodeless );
 
-/////////////////////////////////////////////////////
-//      APERnode::isnewer                          //
-/////////////////////////////////////////////////////
-// is the node newer than the date given?
+	return ( 0 );
+}
 
-bool APERnode::isnewer( std::string date ) const
+static void runsorts( std::vector<SortRun> &runs )
 {
-	if ( _date > date ) return ( true );
-	if ( _date == date || _date < date ) return ( false );
+	std::vector<pthread_t> tids( runs.size() );
+	std::vector<bool> started( runs.size(), false );
+
+	for ( std::size_t i = 0; i < runs.size(); ++i )
+		started[ i ] = ( pthread_create( &tids[ i ], 0, sortrun, &runs[ i ] ) == 0 );
+
+	for ( std::size_t i = 0; i < runs.size(); ++i )
+	{
+		if ( started[ i ] )
+			pthread_join( tids[ i ], 0 );
+		else
+			sortrun( &runs[ i ] );
+	}
 }
 
-/////////////////////////////////////////////////////
-//      APERreply::APERreply                       //
-/////////////////////////////////////////////////////
+void sortnodes( APERdb::Nodes &v )
+{
+	unsigned int n = numthreads( v.size() );
 
-APERreply::APERreply( void ) : _iscleared( false ) {}
+	if ( n < 2 )
+	{
+		std::sort( v.begin(), v.end(), nodeless );
+		return;
+	}
 
-/////////////////////////////////////////////////////
-//      AEPRreply::write                           //
-/////////////////////////////////////////////////////
+	std::vector<APERdb::Nodes::iterator> bounds;
+	for ( unsigned int i = 0; i < n; ++i )
+		bounds.push_back( v.begin() + v.size() * i / n );
+	bounds.push_back( v.end() );
+
+	std::vector<SortRun> runs;
+
+	for ( std::size_t i = 0; i + 1 < bounds.size(); ++i )
+	{
+		SortRun r;
+		r.first = bounds[ i ];
+		r.middle = r.last = bounds[ i + 1 ];
+		runs.push_back( r );
+	}
+
+	runsorts( runs );
 
-void APERreply::write( std::ostream &f )
-{
-	if ( ! iscleared() )
+// merge neighbouring runs until only one is left.  an odd run out
+// just waits for the next pass.
+
+	while ( bounds.size() > 2 )
 	{
-		std::string s = address() + tokcsv + addrtype() + tokcsv + date();
-		if ( ! s.empty() ) f << s << std::endl;
+		std::vector<APERdb::Nodes::iterator> next;
+		runs.clear();
+
+		for ( std::size_t i = 0; i + 1 < bounds.size(); i += 2 )
+		{
+			next.push_back( bounds[ i ] );
+			if ( i + 2 >= bounds.size() ) continue;
+
+			SortRun r;
+			r.first = bounds[ i ];
+			r.middle = bounds[ i + 1 ];
+			r.last = bounds[ i + 2 ];
+			runs.push_back( r );
+		}
+		next.push_back( v.end() );
+
+		runsorts( runs );
+		bounds.swap( next );
 	}
 }
 
 /////////////////////////////////////////////////////
-//      APERreply::isvalidaddress                  //
+//      parallelfor                                //
 /////////////////////////////////////////////////////
-// lame check of email address format.
-// basically, something@more.here ==> good format.
-// there are no RFC-compliant checks (except one).
+// run job( i, arg ) for every i in [0, n) on a handful of threads.
+// jobs are handed out one at a time, so uneven jobs balance out.
 
-bool APERreply::isvalidaddress( std::string address ) const
+struct ParallelFor
 {
-	if ( address.empty() ) return ( false );
-
-	std::string::size_type d = address.find( tokmail );
+	void ( *job )( std::size_t, void * );
+	void *arg;
+	std::size_t n;
+	std::size_t next;
+	pthread_mutex_t mutex;
+};
 
-	if ( d == std::string::npos ) return ( false );
+static void *parallelworker( void *arg )
+{
+	ParallelFor *p = static_cast<ParallelFor *>( arg );
 
-	if ( d > 0 && d < address.size() - 1 )
+	for ( ;; )
 	{
-		std::string host = address.substr( d );
+		pthread_mutex_lock( &p->mutex );
+		std::size_t i = p->next++;
+		pthread_mutex_unlock( &p->mutex );
 
-		d = host.find( tokdns );
-		if ( d == std::string::npos ) return ( false );
+		if ( i >= p->n ) break;
+		p->job( i, p->arg );
+	}
 
-// try catching a typo...
-		if ( host.find( ".." ) != std::string::npos ) return ( false );
+	return ( 0 );
+}
 
-// assume host looks like @xxxx.yyyy with '@' at position 0.
-// we don't want tokdns at 0 or 1 or at the end.
+void parallelfor( std::size_t n, void ( *job )( std::size_t, void * ), void *arg )
+{
+	ParallelFor p;
+	p.job = job;
+	p.arg = arg;
+	p.n = n;
+	p.next = 0;
+	pthread_mutex_init( &p.mutex, 0 );
 
-		if ( d > 1 && d < host.size() - 1 )
-		{
-// if we got this far then there is something after tokmail
-// RFC1123 and RFC952 specify host names start with a letter or digit.
-			if ( ! isalnum( host.at( 1 ) ) )
-			{
-				// some hosts begin with other symbols
-				std::string::size_type p = host.find_first_of( "-" );
-				if ( p != 1 ) return ( false );
-			}
+	unsigned int threads = std::min( static_cast<std::size_t>( maxthreads ), n );
+	std::vector<pthread_t> tids;
 
-// some may argue this violates RFCs since a host FQDN, terminating with a dot,
-// is valid syntax.  while this may be true, we need to make the user aware
-// by rejecting it since it could be a typo or something else. this also
-// facilitates some level of sanity with entries in the database since
-// 'a@b.c.' is nearly always 'a@b.c' though literally they're different and
-// would result in different entries in the database.  also, the use of FQDN
-// in a phish may be useful in indentifying phishware, so don't hide the fact
-// in an automated cleanup.
-			if ( host.at( host.size() - 1 ) != tokdns ) return ( true );
-		}
+	for ( unsigned int i = 1; i < threads; ++i )
+	{
+		pthread_t t;
+		if ( pthread_create( &t, 0, parallelworker, &p ) == 0 ) tids.push_back( t );
 	}
 
-	return ( false );
+	parallelworker( &p );
+
+	for ( std::vector<pthread_t>::iterator itr = tids.begin(); itr != tids.end(); ++itr )
+		pthread_join( *itr, 0 );
+
+	pthread_mutex_destroy( &p.mutex );
 }
 
+
+
 /////////////////////////////////////////////////////
-//      APERreply::addrtype                        //
+//      C interface                                //
 /////////////////////////////////////////////////////
+// see aper.h.  a handle is a list plus room for the record last handed
+// back, so the strings given to the caller stay put between calls.
 
-std::string APERreply::addrtype( void ) const
+struct aper_list
 {
-	AddrT::iterator itr = _addrt.begin();
-	AddrT::iterator itrE = _addrt.end();
-	std::string s;
+	aper_list( datamode m, const std::string &d ) :
+		list( m, d ), loaded( false ), update( false ), indexed( false ), varindexed( false ) {}
+
+	APERlist list;
+	APERrecord rec;
+	bool loaded;
+	bool update;
+	APERlinkpatterns patterns;	// built on the first lookup that needs it
+	bool indexed;
+	APERvariants variants;		// likewise, then kept up to date by aper_add()
+	bool varindexed;
+};
 
-	while ( itr != itrE )
-		s += *itr++;
+static void aperrecord( aper_list *l, const APERnode *n, aper_record *r )
+{
+	noderecord( l->list.mode, n, l->rec );
+	r->cleared = 0;
 
-	return ( s );
+	if ( l->list.mode == reply )
+		r->cleared = dynamic_cast<const APERreply *>( n )->iscleared();
+
+	r->address = l->rec.address.c_str();
+	r->type = l->rec.addrt.c_str();
+	r->date = l->rec.date.c_str();
 }
 
-void APERreply::addrtype( std::string addrt )
+aper_list *aper_open( int list, const char *dir )
 {
-	std::string::iterator itr = addrt.begin();
-	std::string::iterator itrE = addrt.end();
+	datamode m;
 
-	while ( itr != itrE )
+	switch ( list )
 	{
-		_addrt.insert( std::toupper( *itr ) );
-		++itr;
+		case APER_REPLY:	m = reply; break;
+		case APER_LINKS:	m = links; break;
+		case APER_CLEARED:	m = cleared; break;
+		default:			return ( 0 );
 	}
-}
 
-/////////////////////////////////////////////////////
-//      APERreply::isvalidaddrtype                 //
-/////////////////////////////////////////////////////
+	return ( new (std::nothrow) aper_list( m, dir ? dir : "" ) );
+}
 
-bool APERreply::isvalidaddrtype( std::string addrt ) const
+int aper_load( aper_list *l, int update )
 {
-	if ( addrt.empty() ) return ( false );
+	if ( l->loaded ) return ( EUSE );
 
-	std::transform( addrt.begin(), addrt.end(), addrt.begin(), toupper );
+	if ( update && ! l->list.lock.lock( l->list.lockfile() ) )
+		return ( errnotify( ELOCK, l->list.file() ) );
 
-	return ( !( addrt.find_first_not_of( replytypes ) != std::string::npos) );
+	if ( ! loadaperdb( l->list ) )
+	{
+		l->list.lock.unlock();
+		return ( EAPERDB );
+	}
+
+	l->loaded = true;
+	l->update = update;
+
+	return ( EOK );
 }
 
-/////////////////////////////////////////////////////
-//      APERlinks::APERlinks                       //
-/////////////////////////////////////////////////////
+int aper_add( aper_list *l, const char *entry )
+{
+	if ( ! l->loaded ) return ( EUSE );
 
-APERlinks::APERlinks( void ) {}
+	std::string s = entry;
+	if ( ! userline( l->list.mode, s ) ) return ( EOK );
 
-/////////////////////////////////////////////////////
-//      APERlinks::write                           //
-/////////////////////////////////////////////////////
+	APERrecord r;
 
-void APERlinks::write( std::ostream &f )
-{
-	std::string s = address() + tokcsv + date();
-	if ( ! s.empty() ) f << s << std::endl;
-}
+	errstate err = parserecord( l->list.mode, s, r, false );
+	if ( err != EOK ) return ( recorderror( err, r, 0 ) );
 
-/////////////////////////////////////////////////////
-//      APERlinks::isvalidaddress                  //
-/////////////////////////////////////////////////////
-// lame check of web host address.  full URL not validated in any way.
-// basically, some.host/more ==> good format.
-// there are no RFC-compliant checks (except one).
-// assumes address cleanup already done.
+	bool added = l->varindexed && l->list.db.find( r.address ) == 0;
 
-bool APERlinks::isvalidaddress( std::string address ) const
-{
-	if ( address.empty() ) return ( false );
+	if ( ! mergeuserrecord( l->list, r ) ) return ( errnotify( EMEM, r.address ) );
+	if ( l->list.mode == links && APERlinkpatterns::ispattern( r.address ) ) l->indexed = false;
 
-// check for embedded URLs.
-// this also catches misbehaved cut-and-pastes. :-)
-//	if ( address.find( "://" ) != std::string::npos ) return ( false );
+	if ( added )
+	{
+		APERnode *n = l->list.db.find( r.address );
+		if ( n ) l->variants.add( n );
+	}
 
-// check host part of url.  at this time we don't care about the rest.
+	return ( EOK );
+}
 
-	std::string host = address;
-	std::string::size_type p = address.find_first_of( "/?#" );
-	if ( p != std::string::npos )
-		host = address.substr( 0, p );
+int aper_query( aper_list *l, const char *address, aper_record *r )
+{
+	if ( ! l->loaded ) return ( EUSE );
 
-	if ( host.empty() ) return ( false );
+	std::string key = listkey( l->list.mode, address );
 
-	std::string::size_type d = host.find( tokdns );
-	if ( d == std::string::npos ) return ( false );
+	APERnode *n = l->list.db.find( key );
 
-// RFC1123 and RFC952 specify host names start with a letter or digit.
-	if ( ! isalnum( host[0] ) )
+	if ( n == 0 && l->list.mode == links )
 	{
-		// some hosts begin with other symbols
-		std::string::size_type p = host.find_first_of( "-" );
-		if ( p != 0 ) return ( false );
+		if ( ! l->indexed ) l->patterns.build( l->list.db );
+		l->indexed = true;
+
+		n = l->patterns.match( key );
 	}
 
-// try catching a typo
-	if ( host.find( ".." ) != std::string::npos ) return ( false );
+	if ( n == 0 ) return ( ENOENTRY );
 
-// see FQDN discussion in APERreply::isvalidaddress()
-	if ( host.at( host.size() - 1 ) != tokdns ) return ( true );
+	aperrecord( l, n, r );
 
-	return ( false );
+	return ( EOK );
 }
 
-/////////////////////////////////////////////////////
-//      APERlinks::cleanup                         //
-/////////////////////////////////////////////////////
-// transform url to something sane. doesn't do much right now...
-
-std::string APERlinks::cleanup( std::string url )
+int aper_variants( aper_list *l, const char *address, aper_callback cb, void *arg )
 {
-	if ( url.empty() ) return ( url );
+	if ( ! l->loaded || l->list.mode != reply ) return ( EUSE );
 
-	std::string::size_type p;
+	if ( ! l->varindexed ) l->variants.build( l->list.db );
+	l->varindexed = true;
 
-// remove scheme
-// RFC3986 states the scheme can be uppercase but apps should produce
-// lowercase for consistency and documents that present schemes should
-// do so in lowercase.
+	APERdb::Nodes v;
+	l->variants.find( listkey( reply, address ), v );
 
-	std::string scheme;
-	std::string h( "://" );
+	if ( v.empty() ) return ( ENOENTRY );
 
-	p = url.find( h );
-	if ( p != std::string::npos )
+	for ( APERdb::Nodes::iterator itr = v.begin(); itr != v.end(); ++itr )
 	{
-		std::string::size_type q = p + h.size();
-		std::string s = tolowercase( url.substr( 0, q ) );
-
-		// we only nuke ordinary web schemes at the beginning,
-		// not embedded URLs (those found as extra info, etc).
-		// address validators should flag a bad addr if :// is found.
-		if ( s.find( "http" + h ) == 0 || s.find( "https" + h ) == 0 )
-			url.erase( 0, q );
+		aper_record r;
+		aperrecord( l, *itr, &r );
+		if ( cb( &r, arg ) ) break;
 	}
 
-// make host part ("authority" in RFC lingo) lowercase
-// RFC3986 specifies termination chars.
+	return ( EOK );
+}
+
+int aper_iterate( aper_list *l, aper_callback cb, void *arg )
+{
+	if ( ! l->loaded ) return ( EUSE );
 
-	p = url.find_first_of( "/?#" );
+	APERdb::Nodes nodes;
+	l->list.db.sorted( nodes );
 
-	if ( p != std::string::npos )
+	for ( APERdb::Nodes::iterator itr = nodes.begin(); itr != nodes.end(); ++itr )
 	{
-		for ( std::string::size_type q = 0; q < p; ++q )
-			url[ q ] = tolower( url[ q ] );
+		aper_record r;
+		aperrecord( l, *itr, &r );
+		if ( cb( &r, arg ) ) break;
 	}
-	else
-		url = tolowercase( url );
 
-// remove trailing slash
-
-	std::string::reverse_iterator ritr = url.rbegin();
+	return ( EOK );
+}
 
-	if ( *ritr == '/' )
-		url.resize( url.find_last_of( *ritr ) );
+int aper_commit( aper_list *l )
+{
+	if ( ! l->loaded || ! l->update ) return ( ELOCK );
 
-	return ( url );
-}
+	bool ok = writeaperdb( l->list );
 
-/////////////////////////////////////////////////////
-//      APERcleared::APERcleared                   //
-/////////////////////////////////////////////////////
+	l->list.lock.unlock();
+	l->update = false;
 
-APERcleared::APERcleared( void ) {}
+	return ( ok ? EOK : EWAPERDB );
+}
 
-/////////////////////////////////////////////////////
-//      APERcleared::write                         //
-/////////////////////////////////////////////////////
+void aper_close( aper_list *l )
+{
+	delete l;
+}
 
-void APERcleared::write( std::ostream &f )
+const char *aper_strerror( int err )
 {
-	std::string s = address() + tokcsv + date();
-	if ( ! s.empty() ) f << s << std::endl;
+	return ( errmessage( static_cast<errstate>( err ) ) );
 }
 
 /////////////////////////////////////////////////////
-//      APERcleared::isvalidaddess                 //
+//      C interface, snapshots                     //
 /////////////////////////////////////////////////////
+// a reader's view of a published snapshot.  strings handed back point
+// into the mapping.
 
-bool APERcleared::isvalidaddress( std::string address ) const
+struct aper_snapshot
 {
-	APERreply n;
+	std::string file;
+	const char *base;
+	std::size_t size;
+};
 
-	return ( n.isvalidaddress( address ) );
-}
+aper_snapshot *aper_snapshot_open( const char *file )
+{
+	aper_snapshot *s = new (std::nothrow) aper_snapshot;
+	if ( s == 0 ) return ( 0 );
 
-/////////////////////////////////////////////////////
-//      trimspace                                  //
-/////////////////////////////////////////////////////
-// no cleverness here, just plain brute force trimming.
+	s->file = file;
 
-std::string trimspace( std::string &s, trimspec trim )
+	if ( ! mapsnapshot( s->file, s->base, s->size ) )
+	{
+		delete s;
+		return ( 0 );
+	}
+
+	return ( s );
+}
+
+int aper_snapshot_query( aper_snapshot *s, int list, const char *address, aper_record *r )
 {
-	if ( s.empty() ) return s;
+	datamode m;
 
-	switch ( trim )
+	switch ( list )
 	{
-		case ALL:
-		{
-			std::string::iterator itr = s.begin();
-			std::string::iterator itrE = s.end();
-			std::string t;
+		case APER_REPLY:	m = reply; break;
+		case APER_LINKS:	m = links; break;
+		default:			return ( EUSE );
+	}
 
-			while ( itr != itrE )
-			{
-				if ( ! isspace( *itr ) ) t += *itr;
-				++itr;
-			}
+// move on to the current snapshot once this one has been replaced.  if
+// that can't be mapped, the old one is still whole.
 
-			s = t;
-		}
-			break;
+	__sync_synchronize();
 
-		case ENDS:
-		{
-			std::string::iterator itr = s.begin();
-			std::string::iterator itrE = s.end();
+	if ( reinterpret_cast<const APERsnapheader *>( s->base )->superseded )
+	{
+		const char *base;
+		std::size_t size;
 
-			while ( itr != itrE )
-			{
-				if ( ! isspace( *itr ) ) break;
-				++itr;
-			}
+		if ( mapsnapshot( s->file, base, size ) )
+		{
+			munmap( const_cast<char *>( s->base ), s->size );
+			s->base = base;
+			s->size = size;
+		}
+	}
 
-			if ( itr == itrE ) break;
+	const APERsnapheader *h = reinterpret_cast<const APERsnapheader *>( s->base );
+	const APERsnaptable &t = h->table[ m ];
+	const APERsnapbucket *b = reinterpret_cast<const APERsnapbucket *>( s->base + t.buckets );
 
-			std::string t = s.substr( s.find( *itr ) );
+	std::string key = listkey( m, address );
+	uint32_t hash = hash32( key );
 
-			std::string::reverse_iterator ritr = t.rbegin();
-			std::string::reverse_iterator ritrE = t.rend();
+	for ( uint64_t i = hash & t.mask; b[ i ].entry != 0; i = ( i + 1 ) & t.mask )
+	{
+		if ( b[ i ].hash != hash ) continue;
 
-			while ( ritr != ritrE )
-			{
-				if ( ! isspace( *ritr ) ) break;
-				++ritr;
-			}
+		const char *e = s->base + b[ i ].entry;
+		if ( key.compare( e ) != 0 ) continue;
 
-// at this point the reverse iterator must be pointing to
-// a non-space char since the earlier while() stopped at one.
+		r->address = e;
+		r->type = e + strlen( e ) + 1;
+		r->date = r->type + strlen( r->type ) + 1;
+		r->cleared = 0;
 
-			t.resize( t.find_last_of( *ritr ) + 1 );
-			s = t;
-		}
-			break;
+		return ( EOK );
 	}
 
-	return s;
+	return ( ENOENTRY );
 }
 
-/////////////////////////////////////////////////////
-//      split                                      //
-/////////////////////////////////////////////////////
-// not as powerful as the perl split, but it does what we need.
-
-std::string split( std::string s, char c )
+unsigned long long aper_snapshot_generation( aper_snapshot *s )
 {
-	trimspace( s, ALL );
-	std::replace( s.begin(), s.end(), c, toksplit );
-	return ( s );
+	return ( reinterpret_cast<const APERsnapheader *>( s->base )->generation );
 }
 
-/////////////////////////////////////////////////////
-//      tolowercase                                //
-/////////////////////////////////////////////////////
-
-std::string tolowercase( std::string s )
+void aper_snapshot_close( aper_snapshot *s )
 {
-	std::transform( s.begin(), s.end(), s.begin(), tolower );
-	return ( s );
+	munmap( const_cast<char *>( s->base ), s->size );
+	delete s;
 }
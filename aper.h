@@ -0,0 +1,100 @@
+/*
+Copyright (C) 2010 University of Minnesota.  All rights reserved.
+
+	aper.h - C interface to the APER lists, for use in process
+
+	Build the library from the same source as the command:
+
+		c++ -DAPER_LIBRARY -fPIC -shared -pthread -o libaper.so aper.cc
+
+	Each open list is its own handle and nothing is shared between
+	handles, so any number of lists can be open at once.  A handle must
+	not be used from more than one thread at a time.
+
+	Functions returning int give 0 (APER_OK) on success, otherwise one of
+	aper's exit codes, which aper_strerror() describes.  Problems are
+	also reported on stderr, as the command does.
+*/
+
+#ifndef APER_H
+#define APER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define APER_OK 0
+
+enum aper_listtype { APER_REPLY, APER_LINKS, APER_CLEARED };
+
+typedef struct aper_list aper_list;
+
+/* strings belong to the handle and are good until its next call */
+
+typedef struct aper_record
+{
+	const char *address;
+	const char *type;		/* reply types, "" for other lists */
+	const char *date;		/* last seen, YYYYMMDD */
+	int cleared;			/* reply entry found in the cleared list */
+} aper_record;
+
+/* return non-zero to stop iterating */
+
+typedef int ( *aper_callback )( const aper_record *r, void *arg );
+
+/* open one of the lists in dir, the current directory if null or "" */
+
+aper_list *aper_open( int list, const char *dir );
+
+/* read the list.  with update set the list is locked against other
+   writers, aper commands included, until aper_commit() or aper_close() */
+
+int aper_load( aper_list *l, int update );
+
+/* merge one entry, given as a line of new data for the list */
+
+int aper_add( aper_list *l, const char *entry );
+
+/* look up one address or link, normalized the way entries are.  a link
+   not listed as it is gets the wildcard entry matching it, if any */
+
+int aper_query( aper_list *l, const char *address, aper_record *r );
+
+/* every listed reply entry the address is a look-alike of, itself
+   included, as aper query reply --variants finds them */
+
+int aper_variants( aper_list *l, const char *address, aper_callback cb, void *arg );
+
+/* every entry in list order */
+
+int aper_iterate( aper_list *l, aper_callback cb, void *arg );
+
+/* write the list back and release the lock.  the list must have been
+   loaded for update */
+
+int aper_commit( aper_list *l );
+
+void aper_close( aper_list *l );
+
+const char *aper_strerror( int err );
+
+/* published snapshots (aper publish), searched in place.  entries are
+   the active reply and links entries, strings are good until the next
+   call.  a handle follows the snapshot as it is republished */
+
+typedef struct aper_snapshot aper_snapshot;
+
+aper_snapshot *aper_snapshot_open( const char *file );
+
+int aper_snapshot_query( aper_snapshot *s, int list, const char *address, aper_record *r );
+
+unsigned long long aper_snapshot_generation( aper_snapshot *s );
+
+void aper_snapshot_close( aper_snapshot *s );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif